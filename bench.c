@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// A benchmark driver for the bit array rotations.  It is linked against
+// exactly the objects the everybit test harness is, word kernels and all,
+// so what it measures is what everybit runs; the PGO build trains on it.
+
+// We need _POSIX_C_SOURCE >= 2 to use getopt.
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include "./tests.h"
+
+
+// ******************************* Prototypes *******************************
+
+void print_usage(const char* const argv_0);
+
+
+// ******************************* Functions ********************************
+
+int main(int argc, char** argv) {
+  // Parse options.
+  int optchar;
+  opterr = 0;
+  double tier_seconds = 0;
+  while ((optchar = getopt(argc, argv, "ck:p:t:v")) != -1) {
+    switch (optchar) {
+    case 'c':
+      // -c reports hardware counters along with the times.
+      if (!select_perf_counters(true)) {
+        fprintf(stderr, "Hardware counters are not available here.\n");
+      }
+      break;
+    case 'k':
+      // -k strategy forces the rotation strategy.
+      if (!select_rotate_strategy(optarg)) {
+        fprintf(stderr, "Unknown rotation strategy %s.\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'p':
+      // -p threads rotates with that many threads.
+      select_rotate_threads(atoi(optarg) > 0 ? atoi(optarg) : 1);
+      break;
+    case 't':
+      // -t seconds runs the timed tiers up to that limit instead of the
+      // sweep.
+      tier_seconds = atof(optarg);
+      break;
+    case 'v':
+      // -v rotates lazy bit arrays.
+      select_lazy_arrays(true);
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (tier_seconds > 0) {
+    printf("---- RESULTS ----\n");
+    printf("Succesfully completed tier: %d\n", timed_rotation(tier_seconds));
+    printf("---- END RESULTS ----\n");
+    return EXIT_SUCCESS;
+  }
+  const char* const format = optind < argc ? argv[optind] : "text";
+  if (!benchmark_rotations(format)) {
+    fprintf(stderr, "Unknown benchmark format %s.\n", format);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+void print_usage(const char* const argv_0) {
+  fprintf(stderr, "usage: %s [options] [text|csv|json]\n"
+          "\t    Run the benchmark sweep, reporting in the given format\n"
+          "\t -t 0.1\tRun the timed tiers up to 0.1s instead\n"
+          "\t -k cycle\tRotate with the given strategy\n"
+          "\t    (one of auto, reversal, cycle, shift)\n"
+          "\t -p 4\tSplit the rotations across 4 threads\n"
+          "\t -v\tRotate lazy bit arrays\n"
+          "\t -c\tAlso report cycles, instructions and cache, TLB and branch misses\n",
+          argv_0);
+}
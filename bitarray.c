@@ -23,28 +23,394 @@
 // Implements the ADT specified in bitarray.h as a packed array of bits; a bit
 // array containing bit_sz bits will consume roughly bit_sz/8 bytes of
 // memory.
+
+// For posix_memalign and posix_madvise, and MAP_ANONYMOUS.
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
+
 #include "./bitarray.h"
+#include "./bitarray_kernels.h"
+#include "./bitarray_stats.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <sys/syscall.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+  #define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MAP_NORESERVE
+  #define MAP_NORESERVE 0
+#endif
 
 // ********************************* Types **********************************
 
+// Most rotations a lazy bit array keeps recorded at a time.
+#define LAZY_MAX_VIEWS 8
+
+// A segmented bit array is compacted once it has more segments than this;
+// each lookup is a binary search over them, and each splice moves them.
+#define SEGMENT_MAX_COUNT 4096
+
+// Rotations of a segmented bit array shorter than this that lie within one
+// segment move the bits in the buffer; splitting the segment would cost
+// every later access more than it saves now.
+#define SEGMENT_SPLICE_MIN_BITS (UINT64_C(1) << 16)
+
+// A rotation recorded by a lazy bit array but not carried out yet.  The
+// subarray's logical bit bit_offset + i is physically stored at bit
+// bit_offset + ((i + left_amount) mod bit_length).
+typedef struct {
+  size_t bit_offset;
+  size_t bit_length;
+  size_t left_amount;
+} lazy_view_t;
+
+// A run of a segmented bit array's logical bits, stored consecutively in
+// its buffer: logical bit logical + i is physical bit physical + i, for i
+// below length.
+typedef struct {
+  size_t logical;
+  size_t physical;
+  size_t length;
+} segment_t;
+
+// A subarray a rotation of a concurrent bit array is working on, bits
+// [begin, end).  It is on its array's list of held ranges while the
+// rotation runs.
+typedef struct range_lock {
+  size_t begin;
+  size_t end;
+  struct range_lock* next;
+} range_lock_t;
+
 // Concrete data type representing an array of bits.
 struct bitarray {
   // The number of bits represented by this bit array.
   // Need not be divisible by 8.
   size_t bit_sz;
 
-  // The underlying memory buffer that stores the bits in
-  // packed form (8 per byte).
-  char* buf;
+  // The underlying memory buffer that stores the bits in packed form, 64
+  // per word.  The buffer starts on a cache line boundary and is padded to a
+  // whole number of cache lines, with at least one spare word past the last
+  // bit.  The padding of arrays in memory is kept zero.
+  uint64_t* buf;
+
+  // The length of the mapping buf lies in, for file-backed arrays and
+  // buffers allocated with huge pages or a NUMA policy; 0 for buffers that
+  // came from posix_memalign.
+  size_t map_bytes;
+
+  // Whether the mapping is of a file, see bitarray_open_mmap.
+  bool file_backed;
+
+  // Whether this header and buf were carved from an arena's slab, which
+  // owns them.
+  bool in_arena;
+
+  // Whether rotations are only recorded, see bitarray_set_lazy.
+  bool lazy;
+
+  // The recorded rotations, on pairwise disjoint subarrays.  Every access
+  // through the public interface sees the bits as if they had been carried
+  // out.
+  size_t view_count;
+  lazy_view_t views[LAZY_MAX_VIEWS];
+
+  // Whether the array is segmented, see bitarray_set_segmented.  Its
+  // segments then cover the array in logical order, and no segment
+  // continues in the buffer where the one before it ends.  A segmented
+  // array keeps no views.
+  bool segmented;
+  segment_t* segments;
+  size_t segment_count;
+  size_t segment_capacity;
+
+  // Whether rotations may run concurrently, see bitarray_set_concurrent.
+  // Each one holds its subarray on held_ranges while it runs; range_mutex
+  // guards the list, and rotations waiting for an overlapping one to finish
+  // wait on range_released.  The mutex and the condition are only
+  // initialized while the array is concurrent.
+  bool concurrent;
+  range_lock_t* held_ranges;
+  pthread_mutex_t range_mutex;
+  pthread_cond_t range_released;
+
+  // For a snapshot, see bitarray_snapshot: the array it was taken of, NULL
+  // once that has been freed, and for every chunk of the buffer whether the
+  // chunk has been saved into this array's own buf.  Chunks not saved yet
+  // are read from the original's buffer.
+  struct bitarray* origin;
+  uint8_t* saved;
+
+  // For an array with snapshots: how many there are, and the first of
+  // them, the others following through next_snapshot.  The lists are
+  // guarded by snapshot_lock.
+  size_t snapshot_count;
+  struct bitarray* snapshots;
+  struct bitarray* next_snapshot;
+};
+
+// One thread's share of a parallel reversal: the arguments to a call to
+// swap_reversed.
+typedef struct {
+  bitarray_t* bitarray;
+  size_t left;
+  size_t right;
+  size_t bit_count;
+} reverse_band_t;
+
+// A strided rotation: count fields of field_len bits, the first at
+// first_offset and each stride bits past the one before, all rotated left
+// by left_amount.
+typedef struct {
+  size_t first_offset;
+  size_t field_len;
+  size_t stride;
+  size_t count;
+  size_t left_amount;
+} strided_plan_t;
+
+// One thread's share of a parallel strided rotation: the fields numbered
+// [first_field, end_field).
+typedef struct {
+  bitarray_t* bitarray;
+  const strided_plan_t* plan;
+  size_t first_field;
+  size_t end_field;
+} strided_band_t;
+
+
+// A slab of memory in an arena.  Blocks are carved from the bytes that
+// follow the header, starting at ARENA_HEADER_BYTES.
+typedef struct arena_slab {
+  struct arena_slab* next;
+  size_t bytes;
+  size_t used;
+} arena_slab_t;
+
+struct bitarray_arena {
+  // The size of a regular slab.
+  size_t slab_bytes;
+
+  // Every slab, and the one blocks are carved from at the moment.  Slabs
+  // before current are full.
+  arena_slab_t* slabs;
+  arena_slab_t* current;
 };
 
+// One thread's share of a parallel random fill: the chunks in
+// [first_chunk, end_chunk).
+typedef struct {
+  bitarray_t* bitarray;
+  uint64_t seed;
+  size_t first_chunk;
+  size_t end_chunk;
+} fill_band_t;
+
+// One thread's share of the first touch of a new buffer: two byte ranges
+// to zero, mirror images of each other.
+typedef struct {
+  char* head;
+  char* tail;
+  size_t bytes;
+} touch_band_t;
+
+// The header at the start of a file written by bitarray_save, in the
+// byte order of the machine that wrote it.  The encoded bits take
+// payload_bytes bytes starting at payload_offset.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t bit_sz;
+  uint32_t codec;
+  uint32_t reserved;
+  uint64_t payload_offset;
+  uint64_t payload_bytes;
+} save_header_t;
+
+// Most buffers bitarray_save hands to one pwritev call.
+#define SAVE_MAX_IOVECS 256
+
+// The writes bitarray_save has gathered but not made yet: bytes pointed
+// to by iov, passed to pwritev together once there are enough.  The tokens
+// of the run-length code point into words.  offset is where the next byte
+// goes in the file, and bytes counts the payload written or gathered.
+typedef struct {
+  int fd;
+  struct iovec iov[SAVE_MAX_IOVECS];
+  size_t iov_count;
+  uint64_t words[SAVE_MAX_IOVECS];
+  size_t word_count;
+  off_t offset;
+  uint64_t bytes;
+} save_writer_t;
+
+// The payload bitarray_load is decoding, bytes [offset, end) of the file
+// not read yet and words [position, length) of buffer read but not used.
+typedef struct {
+  int fd;
+  off_t offset;
+  off_t end;
+  uint64_t* buffer;
+  size_t position;
+  size_t length;
+} load_reader_t;
+
+
+// ********************************* Macros *********************************
+
+// Bit n of the array lives in bit (n mod 64) of word floor(n/64).  A run of
+// bits that does not start on a word boundary is assembled from two
+// neighbouring words with plain shifts.
+#define WORD_BITS 64
+#define WORD_BYTES 8
+
+// The buffer is allocated in whole cache lines, starting on a line boundary.
+#define CACHE_LINE_BYTES 64
+
+// Number of words reverse() swaps per step in its bulk loop; four cache
+// lines, which keeps the vector kernels busy without crowding the stack.
+#define REVERSE_BLOCK_WORDS 32
+#define REVERSE_BLOCK_BITS (REVERSE_BLOCK_WORDS * WORD_BITS)
+
+// Largest number of adjacent cycles the cycle-leader rotation walks at once.
+// Each step of the walk then moves eight cache lines rather than a single
+// bit, which is enough for the hardware prefetcher to pick up the stream.
+#define CYCLE_BLOCK_WORDS 64
+#define CYCLE_BLOCK_BITS (CYCLE_BLOCK_WORDS * WORD_BITS)
+
+// The cycle-leader rotation is picked when the subarray is at least this
+// long and the cycles are numerous enough that every step moves a full
+// block; otherwise its strided steps stall on memory latency and the
+// sequential reversal is faster.
+#define CYCLE_LEADER_MIN_LENGTH (64 * CYCLE_BLOCK_BITS)
+#define CYCLE_LEADER_MIN_GCD CYCLE_BLOCK_BITS
+
+// Even when asked for, the cycle-leader rotation is only used when its
+// blocks are at least a word wide.  Narrower ones would cost a
+// read-modify-write of a word for every few bits moved.
+#define CYCLE_LEADER_MIN_WIDTH WORD_BITS
+
+// Size of the scratch buffer the shift-copy rotation keeps on the stack.
+// Rotations whose short side is longer than this use a heap buffer.
+#define SCRATCH_STACK_WORDS 128
+#define SCRATCH_STACK_BITS (SCRATCH_STACK_WORDS * WORD_BITS)
+
+// Subarrays of up to this many bits are rotated in registers: loaded whole,
+// rotated with shifts and stored back.  Two words need a 128-bit integer.
+#ifdef __SIZEOF_INT128__
+  #define REGISTER_ROTATE_MAX_BITS (2 * WORD_BITS)
+#else
+  #define REGISTER_ROTATE_MAX_BITS WORD_BITS
+#endif
+
+// bitarray_rotate_parallel never runs more threads than this.
+#define PARALLEL_MAX_THREADS 64
+
+// Subarrays shorter than this are rotated on the calling thread alone;
+// starting threads costs more than they would save.
+#define PARALLEL_MIN_LENGTH (UINT64_C(1) << 24)
+
+// A parallel reversal hands each thread a band of word pairs starting on a
+// cache line boundary.  Each thread leaves a margin of this many bits
+// untouched at both ends of its band, so that the partial words it
+// rewrites never share a cache line with the words another thread is
+// writing; the calling thread swaps the margins once the workers are done.
+#define PARALLEL_ALIGN_BITS 512
+#define PARALLEL_MARGIN_BITS 512
+
+// Large rotations of file-backed arrays move through the mapping in windows
+// of this many bits (8 MB), asking the kernel to read each window ahead
+// before it is needed.
+#define MMAP_WINDOW_BITS (UINT64_C(1) << 26)
+
+// Sizes of the huge pages bitarray_new can ask for.
+#define HUGE_2MB_BYTES (UINT64_C(1) << 21)
+#define HUGE_1GB_BYTES (UINT64_C(1) << 30)
+
+// NUMA memory policies for mbind, as numbered in linux/mempolicy.h; we call
+// the system call directly rather than depend on libnuma.
+#define NUMA_MPOL_INTERLEAVE 3
+#define NUMA_MPOL_LOCAL 4
+
+// A random fill produces chunks of this many words, each from generators
+// seeded by the fill's seed and the chunk's index alone, so that the bits
+// do not depend on how the chunks are split among threads.  A multiple of
+// RANDOM_LANES.
+#define RANDOM_CHUNK_WORDS 4096
+
+// Arenas hand out slabs of this size unless asked for another.
+#define ARENA_DEFAULT_SLAB_BYTES (UINT64_C(1) << 20)
+
+// Blocks in an arena start on cache line boundaries, the first one just
+// past the slab header, and the buffer of a bit array just past its header.
+#define ARENA_HEADER_BYTES                                                 \
+  ((sizeof(arena_slab_t) + CACHE_LINE_BYTES - 1) /                         \
+   CACHE_LINE_BYTES * CACHE_LINE_BYTES)
+#define ARENA_BITARRAY_BYTES                                               \
+  ((sizeof(struct bitarray) + CACHE_LINE_BYTES - 1) /                      \
+   CACHE_LINE_BYTES * CACHE_LINE_BYTES)
+
+// Snapshots share the original's buffer in chunks of this many bytes, a
+// page, and a chunk is copied into the snapshot when the original is first
+// written to there.
+#define SNAPSHOT_CHUNK_BYTES 4096
+#define SNAPSHOT_CHUNK_BITS (SNAPSHOT_CHUNK_BYTES * 8)
+
+// Number of words copy_bits moves per step.
+#define COPY_BLOCK_WORDS 64
+#define COPY_BLOCK_BITS (COPY_BLOCK_WORDS * WORD_BITS)
+
+// What a file written by bitarray_save starts with, and the format version
+// it is in.  byte_order is SAVE_BYTE_ORDER as stored by the writer.
+#define SAVE_MAGIC "EVBARRAY"
+#define SAVE_VERSION 1
+#define SAVE_BYTE_ORDER 0x01020304
+
+// Number of words bitarray_save copies out of an array it cannot write
+// from its buffer at a time, and bitarray_load reads ahead while decoding.
+#define SAVE_CHUNK_WORDS 65536
+
+// Every token of the run-length code is a count of words shifted left by
+// one, ORed with SAVE_RLE_LITERAL for that many words stored as they are,
+// which follow it, or not for one word, which follows it, repeated that
+// many times.  Runs shorter than SAVE_RLE_MIN_RUN are stored as they are.
+#define SAVE_RLE_LITERAL 1
+#define SAVE_RLE_MIN_RUN 3
+
+
+// ******************************** Globals *********************************
+
+// The longest short side, in bits, bitarray_rotate will set aside in scratch
+// space to do a shift-copy rotation.  See bitarray_set_scratch_limit.
+static size_t scratch_limit = SCRATCH_STACK_BITS;
+
+// How bitarray_new allocates buffers.  See bitarray_set_alloc_policy.
+static bitarray_alloc_policy_t alloc_policy;
+
+// Guards the lists of snapshots of every array.  Snapshots are taken and
+// freed rarely, and arrays without snapshots never take the lock.
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 // ******************** Prototypes for static functions *********************
 
@@ -58,22 +424,92 @@ struct bitarray {
 // The subarray spans the half-open interval
 // [bit_offset, bit_offset + bit_length)
 // That is, the start is inclusive, but the end is exclusive.
+//
+// This rotation is done by three reversals, which read and write every
+// bit of the subarray twice, but always sequentially.
 static void bitarray_rotate_left(bitarray_t* const bitarray,
                                  const size_t bit_offset,
                                  const size_t bit_length,
                                  const size_t bit_left_amount);
 
-// Rotates a subarray left by one bit.
+// Rotates a subarray left by an arbitrary number of bits, following the
+// cycles of the rotation permutation.
 //
-// bit_offset is the index of the start of the subarray
-// bit_length is the length of the subarray, in bits
+// The arguments are as for bitarray_rotate_left.
 //
-// The subarray spans the half-open interval
-// [bit_offset, bit_offset + bit_length)
-// That is, the start is inclusive, but the end is exclusive.
-static void bitarray_rotate_left_one(bitarray_t* const bitarray,
-                                     const size_t bit_offset,
-                                     const size_t bit_length);
+// A left rotation by k of a subarray of length n splits into gcd(n, k)
+// cycles, the cycle led by bit i visiting i, i + k, i + 2k, ... (mod n).
+// Adjacent cycles move in lockstep and never wrap within a run of gcd(n, k)
+// bits, so up to CYCLE_BLOCK_BITS of them are walked together as one block.
+// Every destination block is written exactly once; words that straddle
+// two blocks are written once for each.  gcd(n, k) must be at least
+// CYCLE_LEADER_MIN_WIDTH, so that every block spans a word.
+static void bitarray_rotate_left_cycle_leader(bitarray_t* const bitarray,
+                                              const size_t bit_offset,
+                                              const size_t bit_length,
+                                              const size_t bit_left_amount);
+
+// Rotates a subarray left by an arbitrary number of bits, by setting the
+// shorter of its two sides aside in a scratch buffer, sliding the longer side
+// over in one overlapping copy, and writing the short side back at the other
+// end.
+//
+// The arguments are as for bitarray_rotate_left.
+//
+// Every bit of the long side is read and written once, sequentially.
+static void bitarray_rotate_left_shift_copy(bitarray_t* const bitarray,
+                                            const size_t bit_offset,
+                                            const size_t bit_length,
+                                            const size_t bit_left_amount);
+
+// Rotates a subarray left, moving the bits in memory with the given strategy
+// (or the one choose_rotate_strategy picks for BITARRAY_ROTATE_AUTO).
+// Requires 0 < bit_left_amount < bit_length.
+static void rotate_left_in_place(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
+                                 const size_t bit_left_amount,
+                                 bitarray_rotate_strategy_t strategy);
+
+// Records a left rotation in a lazy bit array's views, carrying out the
+// views recorded so far if the new one cannot be kept alongside them.
+// Requires 0 < bit_left_amount < bit_length.
+static void record_view(bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        const size_t bit_left_amount);
+
+// Returns the physical index of the bit a bit array presents at logical
+// index bit_index, through its recorded views.
+static inline size_t view_index(const bitarray_t* const bitarray,
+                                const size_t bit_index);
+
+// Returns the physical index of the bit a bit array presents at logical
+// index bit_index, and stores in *run_length how many logical bits from
+// there on, up to end, are stored consecutively from it.
+static size_t physical_run(const bitarray_t* const bitarray,
+                           const size_t bit_index,
+                           const size_t end,
+                           size_t* const run_length);
+
+// Picks the rotation strategy bitarray_rotate uses for a left rotation by
+// bit_left_amount of a subarray of bit_length bits.
+static bitarray_rotate_strategy_t choose_rotate_strategy(
+    const size_t bit_length,
+    const size_t bit_left_amount);
+
+// Returns the greatest common divisor of a and b.
+static size_t gcd(size_t a, size_t b);
+
+// Rotates a subarray of at most REGISTER_ROTATE_MAX_BITS bits left by
+// bit_left_amount, with 0 < bit_left_amount < bit_length, in registers.  If
+// shared is set, other threads may be writing the bits around the subarray,
+// and its words are accessed as by load_shared and store_shared.
+static inline void rotate_left_in_register(bitarray_t* const bitarray,
+                                           const size_t bit_offset,
+                                           const size_t bit_length,
+                                           const size_t bit_left_amount,
+                                           const bool shared);
 
 // Portable modulo operation that supports negative dividends.
 //
@@ -92,10 +528,10 @@ static void bitarray_rotate_left_one(bitarray_t* const bitarray,
 // 0 <= r < m.
 static size_t modulo(const ssize_t n, const size_t m);
 
-// Produces a mask which, when ANDed with a byte, retains only the
-// bit_index th byte.
+// Produces a mask which, when ANDed with a word, retains only the
+// (bit_index mod 64) th bit.
 //
-// Example: bitmask(5) produces the byte 0b00100000.
+// Example: bitmask(69) produces the word 0b100000.
 //
 // (Note that here the index is counted from right
 // to left, which is different from how we represent bitarrays in the
@@ -103,25 +539,426 @@ static size_t modulo(const ssize_t n, const size_t m);
 // however, so as long as you always use bitarray_get and bitarray_set
 // to access bits in your bitarray, this reverse representation should
 // not matter.
-static char bitmask(const size_t bit_index);
+static inline uint64_t bitmask(const size_t bit_index);
 
+// Reverses the order of the bits in a subarray.
+//
+// bit_offset is the index of the start of the subarray
+// bit_length is the length of the subarray, in bits
 //
-static void reverse(bitarray_t* const bitarray, const size_t left, const size_t right);
-static void reverse_byte(bitarray_t* const bitarray, const size_t byteleft, const size_t byteright);
-static void reverse_short(bitarray_t* const bitarray, const size_t left, const size_t right);
-static void bitarray_rotate_short(bitarray_t* const bitarray,
-                                 const size_t l,
-                                 const size_t r,
-                                 const size_t bit_left_amount); //bit_left_amount <=8
-static void bitarray_rotate_short_right(bitarray_t* const bitarray,
-                                 const size_t l,
-                                 const size_t r,
-                                 const size_t bit_right_amount); //bit_right_amount <=8
+// The two ends of the subarray are swapped a block of words at a time; only
+// the middle, which is narrower than two words, is handled on its own.
+static void reverse(bitarray_t* const bitarray,
+                    const size_t bit_offset,
+                    const size_t bit_length);
+
+// Exchanges the bit_count bits starting at left with the bit_count bits
+// ending just before right, reversing the order of both on the way.  This is
+// the outer part of a reversal of [left, right); the two ranges must not
+// overlap.
+static void swap_reversed(bitarray_t* const bitarray,
+                          size_t left,
+                          size_t right,
+                          size_t bit_count);
+
+// Reverses the order of the bits in a subarray, like reverse, splitting the
+// work across up to thread_count threads.
+static void reverse_parallel(bitarray_t* const bitarray,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             size_t thread_count);
+
+// Thread entry point for reverse_parallel; arg is a reverse_band_t.
+static void* reverse_band_worker(void* const arg);
+
+// Rotates the fields numbered [first_field, end_field) of a strided
+// rotation, picking rotate_packed_fields when the fields tile the words
+// evenly, and rotating them one at a time otherwise.
+static void rotate_strided_fields(bitarray_t* const bitarray,
+                                  const strided_plan_t* const plan,
+                                  const size_t first_field,
+                                  const size_t end_field);
+
+// Rotates the fields numbered [first_field, end_field) of a strided
+// rotation whose stride divides WORD_BITS and whose fields never straddle
+// a word boundary.  Every word is rewritten with the same few shifts and
+// masks, which rotate all the fields in it at once.
+static void rotate_packed_fields(bitarray_t* const bitarray,
+                                 const strided_plan_t* const plan,
+                                 const size_t first_field,
+                                 const size_t end_field);
+
+// Thread entry point for bitarray_rotate_strided_parallel; arg is a
+// strided_band_t.
+static void* strided_band_worker(void* const arg);
+
+// Produces a mask which retains the low bit_count bits of a word.
+// bit_count may be anything from 0 through WORD_BITS inclusive.
+static inline uint64_t lowmask(const size_t bit_count);
+
+// Returns the bit_count bits starting at bit_index, packed so that bit
+// bit_index of the array lands in the least significant bit of the result.
+// Requires 0 < bit_count <= WORD_BITS.
+static inline uint64_t get_bits(const bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count);
+
+// Overwrites the bit_count bits starting at bit_index with the low bit_count
+// bits of value, leaving every other bit of the array untouched.
+// Requires 0 < bit_count <= WORD_BITS.
+static inline void set_bits(bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const size_t bit_count,
+                            const uint64_t value);
+
+// Like get_bits and set_bits, for words other threads may be updating bits
+// of at the same time: the words are read atomically, and written with
+// compare-and-swap so that only the bits in question change.
+static inline uint64_t load_shared(const bitarray_t* const bitarray,
+                                   const size_t bit_index,
+                                   const size_t bit_count);
+static inline void store_shared(bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count,
+                                const uint64_t value);
+
+// Copies word_count whole words of the array, starting at bit_index, into
+// words.
+static inline void extract_words(uint64_t* const words,
+                                 const bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const size_t word_count);
+
+// Stores word_count whole words into the array, starting at bit_index.
+static inline void deposit_words(bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const uint64_t* const words,
+                                 const size_t word_count);
+
+// Like extract_words, but copies bit_count bits, which need not be a whole
+// number of words.  The unused high bits of the last word are zeroed.
+static inline void extract_bits(uint64_t* const words,
+                                const bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count);
+
+// Like deposit_words, but stores bit_count bits, which need not be a whole
+// number of words.
+static inline void deposit_bits(bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const uint64_t* const words,
+                                const size_t bit_count);
+
+// Copies the bit_count bits starting at physical index bit_index into words,
+// starting at bit word_bit of the word buffer.  The bits of words below
+// word_bit are kept; those above the copied ones are zeroed up to the end
+// of the last word written.
+static void extract_bits_at(uint64_t* const words,
+                            const size_t word_bit,
+                            const bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const size_t bit_count);
+
+// Stores the bit_count bits starting at bit word_bit of words at physical
+// index bit_index.
+static void deposit_bits_at(bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const uint64_t* const words,
+                            const size_t word_bit,
+                            const size_t bit_count);
+
+// Sets the bit_count bits starting at physical index bit_index to value.
+static void fill_bits(bitarray_t* const bitarray,
+                      const size_t bit_index,
+                      const size_t bit_count,
+                      const bool value);
+
+// Returns the number of set bits among the bit_count bits starting at
+// physical index bit_index.
+static size_t count_bits(const bitarray_t* const bitarray,
+                         const size_t bit_index,
+                         const size_t bit_count);
+
+// Returns the offset from bit_index of the first of the bit_count bits
+// starting at physical index bit_index that equals value, or bit_count if
+// none does.
+static size_t find_bit(const bitarray_t* const bitarray,
+                       const size_t bit_index,
+                       const size_t bit_count,
+                       const bool value);
+
+// Fills the chunks in [first_chunk, end_chunk) of a bit array with random
+// bits derived from seed; see RANDOM_CHUNK_WORDS.
+static void fill_random_chunks(bitarray_t* const bitarray,
+                               const uint64_t seed,
+                               const size_t first_chunk,
+                               const size_t end_chunk);
+
+// Thread entry point for bitarray_randfill_parallel; arg is a fill_band_t.
+static void* fill_band_worker(void* const arg);
+
+// The SplitMix64 output function, a bijection that scrambles every bit of
+// its argument into every bit of the result.
+static inline uint64_t mix64(uint64_t x);
+
+// Returns the number of bytes a buffer for bit_sz bits takes: ceil(bit_sz/64)
+// words plus a spare one, rounded up to whole cache lines.
+static size_t buffer_bytes(const size_t bit_sz);
+
+// Carves a cache-line-aligned block of block_bytes bytes out of an arena,
+// adding a slab if none has room.  Returns NULL if that fails.
+static void* arena_carve(bitarray_arena_t* const arena,
+                         const size_t block_bytes);
+
+// Allocates a slab with room for block_bytes bytes of blocks, or NULL.
+static arena_slab_t* arena_slab_new(const size_t block_bytes);
+
+// Allocates a zeroed, cache-line-aligned buffer of buf_bytes bytes as the
+// current allocation policy asks.  Stores the length of the mapping the
+// buffer lies in, or 0 if it came from posix_memalign, in *map_bytes.
+// Returns NULL if there is not enough memory.
+static uint64_t* allocate_buffer(const size_t buf_bytes,
+                                 size_t* const map_bytes);
+
+// Maps buf_bytes bytes, rounded up to whole pages, of anonymous memory
+// backed by the given kind of pages.  Stores the length of the mapping in
+// *map_bytes.  Returns NULL if even regular pages cannot be had.
+static void* map_anonymous(const size_t buf_bytes,
+                           const bitarray_pages_t pages,
+                           size_t* const map_bytes);
+
+// Zeroes a buffer of buf_bytes bytes on thread_count threads, band by band
+// as described for bitarray_alloc_policy_t.
+static void first_touch(void* const buf,
+                        const size_t buf_bytes,
+                        size_t thread_count);
+
+// Thread entry point for first_touch; arg is a touch_band_t.
+static void* touch_band_worker(void* const arg);
+
+// Maps the open file fd, from file_offset (a multiple of the page size)
+// on, as the buffer of a bit array of bit_sz bits, storing the length of
+// the mapping in *map_bytes.  Returns NULL, with errno set, if the file
+// cannot be mapped.
+static uint64_t* map_file(const int fd,
+                          const size_t bit_sz,
+                          const int flags,
+                          const off_t file_offset,
+                          size_t* const map_bytes);
+
+// Makes a file-backed bit array of the bit_sz bits at file_offset in the
+// open file fd, for bitarray_open_mmap and bitarray_load_mmap, which close
+// fd.  Returns NULL if the file cannot be mapped or memory runs out.
+static bitarray_t* open_mapped(const int fd,
+                               const size_t bit_sz,
+                               const int flags,
+                               const off_t file_offset);
+
+// Reads a save_header_t from the open file fd, checking that bitarray_save
+// wrote it here, that it makes sense and that the file holds the whole
+// payload.  Returns false, with errno set (to EINVAL if the header is
+// wrong), if not.
+static bool load_header(const int fd, save_header_t* const header);
+
+// The bytes a raw payload of bit_sz bits takes.
+static size_t raw_payload_bytes(const size_t bit_sz);
+
+// Writes the word_count words of words, which hold the bits of the array
+// from word first_word on, in the encoding codec asks for.  The words must
+// stay untouched until the writes are made by save_flush.  Returns false,
+// with errno set, if a write fails.
+static bool save_words(save_writer_t* const writer,
+                       const uint64_t* const words,
+                       const size_t first_word,
+                       const size_t word_count,
+                       const size_t bit_sz,
+                       const bitarray_codec_t codec);
+
+// Writes the word_count words of words in the run-length code.
+static bool save_rle(save_writer_t* const writer,
+                     const uint64_t* const words,
+                     const size_t word_count);
+
+// Gathers a write of the bytes at data, flushing the writes gathered so far
+// first if there is no room.
+static bool save_bytes(save_writer_t* const writer,
+                       const void* const data,
+                       const size_t bytes);
+
+// Gathers a write of word, a token of the run-length code or the word it
+// repeats.
+static bool save_token(save_writer_t* const writer, const uint64_t word);
+
+// Makes every write gathered so far.
+static bool save_flush(save_writer_t* const writer);
+
+// Writes the count buffers of iov to the file fd at offset, calling
+// pwritev again for whatever it leaves out.  Modifies iov.  Returns false,
+// with errno set, if a write fails.
+static bool write_vectored(const int fd,
+                           struct iovec* iov,
+                           size_t count,
+                           off_t offset);
+
+// Reads the file fd at offset into the count buffers of iov, calling
+// preadv again for whatever it leaves out.  Modifies iov.  Returns false,
+// with errno set (to EINVAL if the file ends first), if a read fails.
+static bool read_vectored(const int fd,
+                          struct iovec* iov,
+                          size_t count,
+                          off_t offset);
+
+// Decodes the run-length code from reader into the word_count words of
+// buf, checking it fills them exactly.
+static bool load_rle(load_reader_t* const reader,
+                     uint64_t* const buf,
+                     const size_t word_count);
+
+// Copies the next count words of the payload into words.  Words past what
+// has been read ahead are read straight into words, and the read ahead is
+// refilled by the same call.
+static bool load_words(load_reader_t* const reader,
+                       uint64_t* words,
+                       size_t count);
+
+// Does swap_reversed's job for a file-backed array, a window at a time from
+// both ends, hinting each pair of windows to the kernel ahead of use.
+static void swap_reversed_streaming(bitarray_t* const bitarray,
+                                    size_t left,
+                                    size_t right,
+                                    size_t bit_count);
+
+// Tells the kernel the bit_count bits of a file-backed array starting at
+// bit_index will be needed soon.  Does nothing for arrays in memory.
+static void advise_window(const bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const size_t bit_count);
+
+// Copies bit_count bits from src_index to dst_index, like memmove: the two
+// ranges may overlap.
+static void copy_bits(bitarray_t* const bitarray,
+                      const size_t dst_index,
+                      const size_t src_index,
+                      const size_t bit_count);
+
+// Rotates a subarray of a segmented bit array left by bit_left_amount, with
+// 0 < bit_left_amount < bit_length, splicing its segments unless the
+// subarray is short and lies within one segment.
+static void rotate_segments(bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const size_t bit_left_amount);
+
+// Returns the index of the segment holding logical bit bit_index (which
+// must be below the size of the array) of a segmented bit array.
+static size_t find_segment(const bitarray_t* const bitarray,
+                           const size_t bit_index);
+
+// Splits the segment holding logical bit bit_index so that a segment
+// starts there, and returns the index of that segment, or segment_count if
+// bit_index is the size of the array.  There must be room for one more
+// segment.
+static size_t split_segment(bitarray_t* const bitarray,
+                            const size_t bit_index);
+
+// Merges the neighbours among the segments [first, end) that are stored
+// consecutively, and closes up the gap left behind.
+static void merge_segments(bitarray_t* const bitarray,
+                           size_t first,
+                           size_t end);
+
+// Moves the bits of a segmented bit array into logical order in its buffer,
+// leaving a single segment.
+static void compact_segments(bitarray_t* const bitarray);
+
+// Rotates a subarray of a concurrent bit array left by bit_left_amount,
+// with 0 < bit_left_amount < bit_length, once no other rotation holds bits
+// of it.  The words the subarray shares with bits outside it are only
+// updated with compare-and-swap; the words wholly inside it are rotated
+// with strategy, on thread_count threads.
+static void rotate_concurrent(bitarray_t* const bitarray,
+                              const size_t bit_offset,
+                              const size_t bit_length,
+                              const size_t bit_left_amount,
+                              const bitarray_rotate_strategy_t strategy,
+                              const size_t thread_count);
+
+// Rotates a subarray left by bit_left_amount with strategy, by the parallel
+// reversals if thread_count is above 1 and the subarray is long enough.  A
+// bit_left_amount of 0 does nothing.
+static void rotate_owned(bitarray_t* const bitarray,
+                         const size_t bit_offset,
+                         const size_t bit_length,
+                         const size_t bit_left_amount,
+                         const bitarray_rotate_strategy_t strategy,
+                         const size_t thread_count);
+
+// Waits until no range held on a concurrent bit array overlaps [begin, end),
+// then holds that range with lock.
+static void acquire_range(bitarray_t* const bitarray,
+                          range_lock_t* const lock,
+                          const size_t begin,
+                          const size_t end);
+
+// Releases a range acquired with acquire_range.
+static void release_range(bitarray_t* const bitarray,
+                          range_lock_t* const lock);
+
+// Returns bits [start, start + bit_count) of the cyclic sequence of the
+// bit_length bits at bit_offset, with start < bit_length and bit_count at
+// most WORD_BITS: the run wraps around to the start of the subarray.
+static uint64_t load_cyclic(const bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const size_t start,
+                            const size_t bit_count);
+
+// Fills in the fields of a new bit array's header that every constructor
+// sets the same way.
+static void init_header(bitarray_t* const bitarray,
+                        uint64_t* const buf,
+                        const size_t bit_sz);
+
+// Saves the chunks of the buffer holding the bit_count bits from physical
+// index bit_index into every snapshot that has not saved them yet.  Must be
+// called before those bits are modified.
+static inline void preserve_for_snapshots(bitarray_t* const bitarray,
+                                          const size_t bit_index,
+                                          const size_t bit_count);
+
+// Saves the chunks [first_chunk, end_chunk) of a bit array's buffer into
+// every snapshot of it that has not saved them yet.
+static void save_chunks(bitarray_t* const bitarray,
+                        const size_t first_chunk,
+                        const size_t end_chunk);
+
+// Returns the bit array whose buffer holds the bits a bit array stores from
+// physical index bit_index on: the original of a snapshot, for a chunk the
+// original has not written to, and otherwise the array itself.  Shortens
+// *run_length so that the run does not leave the chunk.
+static inline const bitarray_t* run_source(const bitarray_t* const bitarray,
+                                           const size_t bit_index,
+                                           size_t* const run_length);
+
+// Returns whether the chunk holding physical index bit_index of a snapshot
+// was saved while it was being read from the original.  The read may have
+// seen the original's new bits then, and must be repeated from the
+// snapshot's buffer.
+static inline bool run_moved(const bitarray_t* const bitarray,
+                             const size_t bit_index);
+
 // ******************************* Functions ********************************
 
+unsigned bitarray_version(void) {
+  return BITARRAY_VERSION;
+}
+
 bitarray_t* bitarray_new(const size_t bit_sz) {
-  // Allocate an underlying buffer of ceil(bit_sz/8) bytes.
-  char* const buf = calloc(1, (bit_sz+7) / 8);
+  // Allocate an underlying buffer of ceil(bit_sz/64) words plus a spare
+  // one, rounded up to whole cache lines.
+  const size_t buf_bytes = buffer_bytes(bit_sz);
+  size_t map_bytes;
+  uint64_t* const buf = allocate_buffer(buf_bytes, &map_bytes);
   if (buf == NULL) {
     return NULL;
   }
@@ -129,357 +966,2894 @@ bitarray_t* bitarray_new(const size_t bit_sz) {
   // Allocate space for the struct.
   bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
   if (bitarray == NULL) {
-    free(buf);
+    if (map_bytes != 0) {
+      munmap(buf, map_bytes);
+    } else {
+      free(buf);
+    }
     return NULL;
   }
 
-  bitarray->buf = buf;
-  bitarray->bit_sz = bit_sz;
+  init_header(bitarray, buf, bit_sz);
+  bitarray->map_bytes = map_bytes;
+  return bitarray;
+}
+
+bitarray_t* bitarray_open_mmap(const char* const path,
+                               const size_t bit_sz,
+                               const int flags) {
+  const bool copy_on_write = (flags & BITARRAY_MMAP_PRIVATE) != 0;
+  const int open_flags = (copy_on_write ? O_RDONLY : O_RDWR) |
+                         ((flags & BITARRAY_MMAP_CREATE) ? O_CREAT : 0);
+  const int fd = open(path, open_flags, 0666);
+  if (fd < 0) {
+    return NULL;
+  }
+  return open_mapped(fd, bit_sz, flags, 0);
+}
+
+bool bitarray_sync(bitarray_t* const bitarray) {
+  bitarray_materialize(bitarray);
+  if (!bitarray->file_backed) {
+    return true;
+  }
+  return msync(bitarray->buf, bitarray->map_bytes, MS_SYNC) == 0;
+}
+
+bool bitarray_save(const bitarray_t* const bitarray,
+                   const char* const path,
+                   const bitarray_codec_t codec) {
+  if (codec != BITARRAY_CODEC_RAW && codec != BITARRAY_CODEC_RLE) {
+    errno = EINVAL;
+    return false;
+  }
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    return false;
+  }
+
+  // The bits start on the first page boundary past the header, so that a
+  // raw payload can be mapped.
+  const size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+  save_header_t header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SAVE_MAGIC, sizeof(header.magic));
+  header.version = SAVE_VERSION;
+  header.byte_order = SAVE_BYTE_ORDER;
+  header.bit_sz = bitarray->bit_sz;
+  header.codec = codec;
+  header.payload_offset =
+    (sizeof(header) + page_bytes - 1) / page_bytes * page_bytes;
+
+  save_writer_t writer;
+  writer.fd = fd;
+  writer.iov_count = 0;
+  writer.word_count = 0;
+  writer.offset = (off_t)header.payload_offset;
+  writer.bytes = 0;
+
+  const size_t bit_sz = bitarray->bit_sz;
+  const size_t word_count = (bit_sz + WORD_BITS - 1) / WORD_BITS;
+  bool ok = true;
+  if (bitarray->view_count == 0 && !bitarray->segmented &&
+      bitarray->saved == NULL) {
+    // The buffer holds the bits in order, so they are written from it.
+    ok = save_words(&writer, bitarray->buf, 0, word_count, bit_sz, codec) &&
+         save_flush(&writer);
+  } else {
+    // Otherwise they are copied out a chunk at a time, each one written
+    // before the next is copied over it.
+    uint64_t* const chunk = malloc(SAVE_CHUNK_WORDS * WORD_BYTES);
+    ok = chunk != NULL;
+    for (size_t w = 0; ok && w < word_count; w += SAVE_CHUNK_WORDS) {
+      const size_t count = word_count - w < SAVE_CHUNK_WORDS ?
+                           word_count - w : SAVE_CHUNK_WORDS;
+      const size_t bit_offset = w * WORD_BITS;
+      const size_t bit_length = bit_sz - bit_offset < count * WORD_BITS ?
+                                bit_sz - bit_offset : count * WORD_BITS;
+      bitarray_get_range(bitarray, bit_offset, bit_length, chunk);
+      ok = save_words(&writer, chunk, w, count, bit_sz, codec) &&
+           save_flush(&writer);
+    }
+    free(chunk);
+  }
+
+  // The header goes in last, once the length of the payload is known.
+  if (ok) {
+    header.payload_bytes = writer.bytes;
+    struct iovec iov = { &header, sizeof(header) };
+    // An empty payload still starts where the header says, inside the file.
+    ok = write_vectored(fd, &iov, 1, 0) &&
+         ftruncate(fd, (off_t)(header.payload_offset +
+                               header.payload_bytes)) == 0;
+  }
+  if (close(fd) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    const int error = errno;
+    unlink(path);
+    errno = error;
+  }
+  return ok;
+}
+
+bitarray_t* bitarray_load(const char* const path) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  save_header_t header;
+  bool ok = load_header(fd, &header);
+  bitarray_t* const bitarray = ok ? bitarray_new(header.bit_sz) : NULL;
+  if (ok && bitarray == NULL) {
+    errno = ENOMEM;
+    ok = false;
+  }
+
+  const size_t word_count = (header.bit_sz + WORD_BITS - 1) / WORD_BITS;
+  if (ok && header.codec == BITARRAY_CODEC_RAW) {
+    // The payload is the buffer's bytes; read it straight in.
+    struct iovec iov = { bitarray->buf, header.payload_bytes };
+    ok = read_vectored(fd, &iov, 1, (off_t)header.payload_offset);
+  } else if (ok) {
+    load_reader_t reader;
+    reader.fd = fd;
+    reader.offset = (off_t)header.payload_offset;
+    reader.end = (off_t)(header.payload_offset + header.payload_bytes);
+    reader.buffer = malloc(SAVE_CHUNK_WORDS * WORD_BYTES);
+    reader.position = 0;
+    reader.length = 0;
+    ok = reader.buffer != NULL &&
+         load_rle(&reader, bitarray->buf, word_count);
+    free(reader.buffer);
+  }
+
+  const int error = errno;
+  close(fd);
+  if (!ok) {
+    bitarray_free(bitarray);
+    errno = error;
+    return NULL;
+  }
+  // The file may have bits set past the end of the array, but the padding
+  // of arrays in memory is kept zero.
+  if (header.bit_sz % WORD_BITS != 0) {
+    bitarray->buf[word_count - 1] &= lowmask(header.bit_sz % WORD_BITS);
+  }
+  return bitarray;
+}
+
+bitarray_t* bitarray_load_mmap(const char* const path, const int flags) {
+  const bool copy_on_write = (flags & BITARRAY_MMAP_PRIVATE) != 0;
+  const int fd = open(path, copy_on_write ? O_RDONLY : O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+  save_header_t header;
+  bool ok = load_header(fd, &header);
+  const size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+  if (ok && (header.codec != BITARRAY_CODEC_RAW ||
+             header.payload_offset % page_bytes != 0)) {
+    errno = EINVAL;
+    ok = false;
+  }
+  if (!ok) {
+    const int error = errno;
+    close(fd);
+    errno = error;
+    return NULL;
+  }
+  // The file must not grow past the payload.
+  return open_mapped(fd, header.bit_sz, flags & BITARRAY_MMAP_PRIVATE,
+                     (off_t)header.payload_offset);
+}
+
+bitarray_arena_t* bitarray_arena_new(const size_t slab_bytes) {
+  bitarray_arena_t* const arena = malloc(sizeof(struct bitarray_arena));
+  if (arena == NULL) {
+    return NULL;
+  }
+  arena->slab_bytes = slab_bytes != 0 ? slab_bytes : ARENA_DEFAULT_SLAB_BYTES;
+  arena->slabs = NULL;
+  arena->current = NULL;
+  return arena;
+}
+
+bitarray_t* bitarray_new_in(bitarray_arena_t* const arena,
+                            const size_t bit_sz) {
+  // The header and the buffer behind it, in one block.
+  const size_t buf_bytes = buffer_bytes(bit_sz);
+  char* const block = arena_carve(arena, ARENA_BITARRAY_BYTES + buf_bytes);
+  if (block == NULL) {
+    return NULL;
+  }
+  // Slabs are reused after a reset, so the buffer must be cleared here.
+  uint64_t* const buf = (uint64_t*)(block + ARENA_BITARRAY_BYTES);
+  memset(buf, 0, buf_bytes);
+
+  bitarray_t* const bitarray = (bitarray_t*)block;
+  init_header(bitarray, buf, bit_sz);
+  bitarray->in_arena = true;
   return bitarray;
 }
 
+void bitarray_arena_reset(bitarray_arena_t* const arena) {
+  // Regular slabs are kept for reuse; the oversized ones made for a single
+  // big array are given back, so that one huge case does not pin its memory
+  // for the rest of the run.
+  arena_slab_t** link = &arena->slabs;
+  while (*link != NULL) {
+    arena_slab_t* const slab = *link;
+    if (slab->bytes > arena->slab_bytes) {
+      *link = slab->next;
+      free(slab);
+    } else {
+      slab->used = 0;
+      link = &slab->next;
+    }
+  }
+  arena->current = arena->slabs;
+}
+
+void bitarray_arena_free(bitarray_arena_t* const arena) {
+  if (arena == NULL) {
+    return;
+  }
+  arena_slab_t* slab = arena->slabs;
+  while (slab != NULL) {
+    arena_slab_t* const next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  free(arena);
+}
+
 void bitarray_free(bitarray_t* const bitarray) {
   if (bitarray == NULL) {
     return;
   }
-  free(bitarray->buf);
+  // Snapshots are freed with bitarray_snapshot_free.
+  assert(bitarray->saved == NULL);
+  // Rotations only recorded in memory must reach the file.
+  if (bitarray->file_backed) {
+    bitarray_materialize(bitarray);
+  }
+  if (__atomic_load_n(&bitarray->snapshot_count, __ATOMIC_ACQUIRE) != 0) {
+    // The snapshots take over every chunk they still share.
+    save_chunks(bitarray, 0, (buffer_bytes(bitarray->bit_sz) +
+                              SNAPSHOT_CHUNK_BYTES - 1) /
+                             SNAPSHOT_CHUNK_BYTES);
+    pthread_mutex_lock(&snapshot_lock);
+    for (bitarray_t* snapshot = bitarray->snapshots; snapshot != NULL;
+         snapshot = snapshot->next_snapshot) {
+      snapshot->origin = NULL;
+    }
+    bitarray->snapshots = NULL;
+    bitarray->snapshot_count = 0;
+    pthread_mutex_unlock(&snapshot_lock);
+  }
+  free(bitarray->segments);
+  bitarray->segments = NULL;
+  bitarray_set_concurrent(bitarray, false);
+  if (bitarray->in_arena) {
+    return;
+  }
+  if (bitarray->map_bytes != 0) {
+    munmap(bitarray->buf, bitarray->map_bytes);
+  } else {
+    free(bitarray->buf);
+  }
   bitarray->buf = NULL;
   free(bitarray);
 }
 
+const bitarray_t* bitarray_snapshot(bitarray_t* const bitarray) {
+  assert(bitarray->saved == NULL);
+  const size_t chunk_count = (buffer_bytes(bitarray->bit_sz) +
+                              SNAPSHOT_CHUNK_BYTES - 1) / SNAPSHOT_CHUNK_BYTES;
+  const size_t map_bytes = chunk_count * SNAPSHOT_CHUNK_BYTES;
+
+  // The buffer only gets pages for the chunks that are saved into it.
+  void* const buf = mmap(NULL, map_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (buf == MAP_FAILED) {
+    return NULL;
+  }
+  bitarray_t* const snapshot = malloc(sizeof(struct bitarray));
+  uint8_t* const saved = calloc(chunk_count, 1);
+  if (snapshot == NULL || saved == NULL) {
+    free(snapshot);
+    free(saved);
+    munmap(buf, map_bytes);
+    return NULL;
+  }
+
+  // The snapshot sees the bits through the views recorded so far; the
+  // original may go on to record others, or carry these out.
+  init_header(snapshot, buf, bitarray->bit_sz);
+  snapshot->map_bytes = map_bytes;
+  snapshot->view_count = bitarray->view_count;
+  memcpy(snapshot->views, bitarray->views,
+         bitarray->view_count * sizeof(lazy_view_t));
+  if (bitarray->segmented) {
+    snapshot->segments = malloc(bitarray->segment_count * sizeof(segment_t));
+    if (snapshot->segments == NULL && bitarray->segment_count != 0) {
+      free(snapshot);
+      free(saved);
+      munmap(buf, map_bytes);
+      return NULL;
+    }
+    memcpy(snapshot->segments, bitarray->segments,
+           bitarray->segment_count * sizeof(segment_t));
+    snapshot->segmented = true;
+    snapshot->segment_count = bitarray->segment_count;
+    snapshot->segment_capacity = bitarray->segment_count;
+  }
+  snapshot->origin = bitarray;
+  snapshot->saved = saved;
+
+  pthread_mutex_lock(&snapshot_lock);
+  snapshot->next_snapshot = bitarray->snapshots;
+  bitarray->snapshots = snapshot;
+  __atomic_fetch_add(&bitarray->snapshot_count, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&snapshot_lock);
+  return snapshot;
+}
+
+void bitarray_snapshot_free(const bitarray_t* const snapshot) {
+  if (snapshot == NULL) {
+    return;
+  }
+  // The caller only got to see the snapshot as read-only.
+  bitarray_t* const owned = (bitarray_t*)snapshot;
+  assert(owned->saved != NULL);
+  pthread_mutex_lock(&snapshot_lock);
+  if (owned->origin != NULL) {
+    bitarray_t** link = &owned->origin->snapshots;
+    while (*link != owned) {
+      link = &(*link)->next_snapshot;
+    }
+    *link = owned->next_snapshot;
+    __atomic_fetch_sub(&owned->origin->snapshot_count, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  munmap(owned->buf, owned->map_bytes);
+  free(owned->segments);
+  free(owned->saved);
+  free(owned);
+}
+
 size_t bitarray_get_bit_sz(const bitarray_t* const bitarray) {
   return bitarray->bit_sz;
 }
 
-bool bitarray_get(const bitarray_t* const bitarray, const size_t bit_index) {
-  assert(bit_index < bitarray->bit_sz);
+bool bitarray_get(const bitarray_t* const bitarray,
+                  const size_t logical_index) {
+  assert(logical_index < bitarray->bit_sz);
+  // A lazy bit array may keep the bit somewhere else.
+  const size_t bit_index =
+    bitarray->view_count == 0 && !bitarray->segmented ? logical_index :
+    view_index(bitarray, logical_index);
 
-  // We're storing bits in packed form, 8 per byte.  So to get the nth
-  // bit, we want to look at the (n mod 8)th bit of the (floor(n/8)th)
-  // byte.
+  // A snapshot may still share the bit with its original.
+  size_t run_length = 1;
+  const bitarray_t* const source = run_source(bitarray, bit_index,
+                                              &run_length);
+
+  // We're storing bits in packed form, 64 per word.  So to get the nth
+  // bit, we want to look at the (n mod 64)th bit of the (floor(n/64)th)
+  // word.
   //
   // In C, integer division is floored explicitly, so we can just do it to
-  // get the byte; we then bitwise-and the byte with an appropriate mask
-  // to produce either a zero byte (if the bit was 0) or a nonzero byte
+  // get the word; we then bitwise-and the word with an appropriate mask
+  // to produce either a zero word (if the bit was 0) or a nonzero word
   // (if it wasn't).  Finally, we convert that to a boolean.
-  return (bitarray->buf[bit_index / 8] & bitmask(bit_index)) ?
-         true : false;
+  bool value = (source->buf[bit_index / WORD_BITS] & bitmask(bit_index)) ?
+               true : false;
+  if (source != bitarray && run_moved(bitarray, bit_index)) {
+    value = (bitarray->buf[bit_index / WORD_BITS] & bitmask(bit_index)) ?
+            true : false;
+  }
+  return value;
 }
 
 void bitarray_set(bitarray_t* const bitarray,
-                  const size_t bit_index,
+                  const size_t logical_index,
                   const bool value) {
-  assert(bit_index < bitarray->bit_sz);
+  assert(logical_index < bitarray->bit_sz);
+  // A lazy bit array may keep the bit somewhere else.
+  const size_t bit_index =
+    bitarray->view_count == 0 && !bitarray->segmented ? logical_index :
+    view_index(bitarray, logical_index);
+  preserve_for_snapshots(bitarray, bit_index, 1);
 
-  // We're storing bits in packed form, 8 per byte.  So to set the nth
-  // bit, we want to set the (n mod 8)th bit of the (floor(n/8)th) byte.
+  // We're storing bits in packed form, 64 per word.  So to set the nth
+  // bit, we want to set the (n mod 64)th bit of the (floor(n/64)th) word.
   //
   // In C, integer division is floored explicitly, so we can just do it to
-  // get the byte; we then bitwise-and the byte with an appropriate mask
+  // get the word; we then bitwise-and the word with an appropriate mask
   // to clear out the bit we're about to set.  We bitwise-or the result
-  // with a byte that has either a 1 or a 0 in the correct place.
-  bitarray->buf[bit_index / 8] =
-    (bitarray->buf[bit_index / 8] & ~bitmask(bit_index)) |
-    (value ? bitmask(bit_index) : 0);
+  // with a word that has either a 1 or a 0 in the correct place.
+  uint64_t* const word = &bitarray->buf[bit_index / WORD_BITS];
+  *word = (*word & ~bitmask(bit_index)) | (value ? bitmask(bit_index) : 0);
 }
 
-void bitarray_randfill(bitarray_t* const bitarray){
-  int32_t *ptr = (int32_t *)bitarray->buf;
-  for (int64_t i=0; i<bitarray->bit_sz/32 + 1; i++){
-    ptr[i] = rand();
+void bitarray_get_range(const bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        uint64_t* const words) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  const size_t end = bit_offset + bit_length;
+  // Without views the whole range is one run; otherwise it breaks up
+  // wherever a view starts, ends or wraps around.
+  for (size_t i = bit_offset; i < end;) {
+    size_t run_length;
+    const size_t physical = physical_run(bitarray, i, end, &run_length);
+    const bitarray_t* const source = run_source(bitarray, physical,
+                                                &run_length);
+    extract_bits_at(words, i - bit_offset, source, physical, run_length);
+    if (source != bitarray && run_moved(bitarray, physical)) {
+      extract_bits_at(words, i - bit_offset, bitarray, physical, run_length);
+    }
+    i += run_length;
   }
 }
 
-void bitarray_rotate(bitarray_t* const bitarray,
-                     const size_t bit_offset,
-                     const size_t bit_length,
-                     const ssize_t bit_right_amount) {
+void bitarray_set_range(bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        const uint64_t* const words) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  const size_t end = bit_offset + bit_length;
+  for (size_t i = bit_offset; i < end;) {
+    size_t run_length;
+    const size_t physical = physical_run(bitarray, i, end, &run_length);
+    preserve_for_snapshots(bitarray, physical, run_length);
+    deposit_bits_at(bitarray, physical, words, i - bit_offset, run_length);
+    i += run_length;
+  }
+}
+
+void bitarray_fill(bitarray_t* const bitarray,
+                   const size_t bit_offset,
+                   const size_t bit_length,
+                   const bool value) {
   assert(bit_offset + bit_length <= bitarray->bit_sz);
-  int bit_left_amount=modulo(-bit_right_amount, bit_length);
-  if (bit_length == 0 || bit_left_amount==0) {
+  const size_t end = bit_offset + bit_length;
+  for (size_t i = bit_offset; i < end;) {
+    size_t run_length;
+    const size_t physical = physical_run(bitarray, i, end, &run_length);
+    preserve_for_snapshots(bitarray, physical, run_length);
+    fill_bits(bitarray, physical, run_length, value);
+    i += run_length;
+  }
+}
+
+void bitarray_copy(bitarray_t* const dst,
+                   const size_t dst_offset,
+                   const bitarray_t* const src,
+                   const size_t src_offset,
+                   const size_t bit_length) {
+  assert(dst_offset + bit_length <= dst->bit_sz);
+  assert(src_offset + bit_length <= src->bit_sz);
+  if (dst == src) {
+    // Within one array the ranges may overlap; copy_bits takes care of that
+    // once the bits are where they appear to be.
+    bitarray_materialize(dst);
+    preserve_for_snapshots(dst, dst_offset, bit_length);
+    copy_bits(dst, dst_offset, src_offset, bit_length);
     return;
   }
-  // Convert a rotate left or right to a left rotate only, and eliminate
-  // multiple full rotations.
-  bitarray_rotate_left(bitarray, bit_offset, bit_length,bit_left_amount);
+
+  uint64_t block[COPY_BLOCK_WORDS];
+  for (size_t done = 0; done < bit_length; done += COPY_BLOCK_BITS) {
+    const size_t width = bit_length - done < COPY_BLOCK_BITS ?
+                         bit_length - done : COPY_BLOCK_BITS;
+    bitarray_get_range(src, src_offset + done, width, block);
+    bitarray_set_range(dst, dst_offset + done, width, block);
+  }
 }
 
-static void bitarray_rotate_left(bitarray_t* const bitarray,
-                                 const size_t bit_offset,
-                                 const size_t bit_length,
+size_t bitarray_count(const bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const size_t bit_length) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  const size_t end = bit_offset + bit_length;
+  size_t count = 0;
+  for (size_t i = bit_offset; i < end;) {
+    size_t run_length;
+    const size_t physical = physical_run(bitarray, i, end, &run_length);
+    const bitarray_t* const source = run_source(bitarray, physical,
+                                                &run_length);
+    size_t run_count = count_bits(source, physical, run_length);
+    if (source != bitarray && run_moved(bitarray, physical)) {
+      run_count = count_bits(bitarray, physical, run_length);
+    }
+    count += run_count;
+    i += run_length;
+  }
+  return count;
+}
+
+size_t bitarray_find_next(const bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const bool value) {
+  assert(bit_index <= bitarray->bit_sz);
+  const size_t end = bitarray->bit_sz;
+  // Each run is stored in logical order, so the first match within the
+  // first run that has one is the answer.
+  for (size_t i = bit_index; i < end;) {
+    size_t run_length;
+    const size_t physical = physical_run(bitarray, i, end, &run_length);
+    const bitarray_t* const source = run_source(bitarray, physical,
+                                                &run_length);
+    size_t found = find_bit(source, physical, run_length, value);
+    if (source != bitarray && run_moved(bitarray, physical)) {
+      found = find_bit(bitarray, physical, run_length, value);
+    }
+    if (found < run_length) {
+      return i + found;
+    }
+    i += run_length;
+  }
+  return end;
+}
+
+void bitarray_randfill(bitarray_t* const bitarray){
+  // Draw the seed from rand(), so that srand still picks the bits.
+  const uint64_t low = (uint32_t)rand();
+  const uint64_t high = (uint32_t)rand();
+  bitarray_randfill_with_seed(bitarray, low | (high << 32));
+}
+
+void bitarray_randfill_with_seed(bitarray_t* const bitarray,
+                                 const uint64_t seed) {
+  bitarray_randfill_parallel(bitarray, seed, 1);
+}
+
+void bitarray_randfill_parallel(bitarray_t* const bitarray,
+                                const uint64_t seed,
+                                size_t thread_count) {
+  // Random bits are random in any order; the recorded rotations, and the
+  // order of the segments, can go.
+  bitarray->view_count = 0;
+  if (bitarray->segmented && bitarray->segment_count > 1) {
+    bitarray->segment_count = 1;
+    bitarray->segments[0].physical = 0;
+    bitarray->segments[0].length = bitarray->bit_sz;
+  }
+  preserve_for_snapshots(bitarray, 0, bitarray->bit_sz);
+  const size_t word_count = (bitarray->bit_sz + WORD_BITS - 1) / WORD_BITS;
+  const size_t chunk_count =
+    (word_count + RANDOM_CHUNK_WORDS - 1) / RANDOM_CHUNK_WORDS;
+  if (thread_count > PARALLEL_MAX_THREADS) {
+    thread_count = PARALLEL_MAX_THREADS;
+  }
+  if (thread_count > chunk_count) {
+    thread_count = chunk_count;
+  }
+  if (thread_count <= 1) {
+    fill_random_chunks(bitarray, seed, 0, chunk_count);
+    return;
+  }
+
+  // Chunks are seeded by their index alone, so any split gives the same
+  // bits; contiguous shares keep each thread's writes to its own lines.
+  fill_band_t bands[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  bool started[PARALLEL_MAX_THREADS];
+  for (size_t t = 0; t < thread_count; t++) {
+    bands[t].bitarray = bitarray;
+    bands[t].seed = seed;
+    bands[t].first_chunk = chunk_count * t / thread_count;
+    bands[t].end_chunk = chunk_count * (t + 1) / thread_count;
+    started[t] = false;
+    if (t > 0) {
+      started[t] = pthread_create(&threads[t], NULL, fill_band_worker,
+                                  &bands[t]) == 0;
+      if (!started[t]) {
+        fill_band_worker(&bands[t]);
+      }
+    }
+  }
+  fill_band_worker(&bands[0]);
+  for (size_t t = 1; t < thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+}
+
+void bitarray_rotate(bitarray_t* const bitarray,
+                     const size_t bit_offset,
+                     const size_t bit_length,
+                     const ssize_t bit_right_amount) {
+  bitarray_rotate_with_strategy(bitarray, bit_offset, bit_length,
+                                bit_right_amount, BITARRAY_ROTATE_AUTO);
+}
+
+void bitarray_rotate_with_strategy(bitarray_t* const bitarray,
+                                   const size_t bit_offset,
+                                   const size_t bit_length,
+                                   const ssize_t bit_right_amount,
+                                   bitarray_rotate_strategy_t strategy) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  if (bit_length == 0) {
+    return;
+  }
+  // Convert a rotate left or right to a left rotate only, and eliminate
+  // multiple full rotations.
+  const size_t bit_left_amount = modulo(-bit_right_amount, bit_length);
+  if (bit_left_amount == 0) {
+    return;
+  }
+
+  if (bitarray->concurrent) {
+    rotate_concurrent(bitarray, bit_offset, bit_length, bit_left_amount,
+                      strategy, 1);
+    return;
+  }
+
+  if (bitarray->segmented && strategy == BITARRAY_ROTATE_AUTO) {
+    rotate_segments(bitarray, bit_offset, bit_length, bit_left_amount);
+    return;
+  }
+
+  // A rotation that fits in registers costs less than recording a view, so
+  // lazy arrays take it too, as long as no view moves its bits elsewhere.
+  if (bit_length <= REGISTER_ROTATE_MAX_BITS &&
+      strategy == BITARRAY_ROTATE_AUTO && bitarray->view_count == 0 &&
+      !bitarray->segmented) {
+    preserve_for_snapshots(bitarray, bit_offset, bit_length);
+    STATS_ROTATION_BEGIN(timer);
+    rotate_left_in_register(bitarray, bit_offset, bit_length,
+                            bit_left_amount, false);
+    STATS_PHASE(STATS_BULK);
+    STATS_ROTATION_END(timer, STATS_REGISTER, bit_offset, bit_length);
+    return;
+  }
+
+  if (bitarray->lazy && strategy == BITARRAY_ROTATE_AUTO) {
+    STATS_ROTATION_BEGIN(timer);
+    record_view(bitarray, bit_offset, bit_length, bit_left_amount);
+    STATS_ROTATION_END(timer, STATS_LAZY_VIEW, bit_offset, bit_length);
+    return;
+  }
+  bitarray_materialize(bitarray);
+  preserve_for_snapshots(bitarray, bit_offset, bit_length);
+  rotate_left_in_place(bitarray, bit_offset, bit_length, bit_left_amount,
+                       strategy);
+}
+
+static void rotate_left_in_place(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
+                                 const size_t bit_left_amount,
+                                 bitarray_rotate_strategy_t strategy) {
+  if (strategy == BITARRAY_ROTATE_AUTO) {
+    strategy = choose_rotate_strategy(bit_length, bit_left_amount);
+    // The strided walk of the cycle leader would fault pages of a large
+    // file-backed array in at random; the reversal streams through it.
+    if (bitarray->file_backed && bit_length > MMAP_WINDOW_BITS &&
+        strategy == BITARRAY_ROTATE_CYCLE_LEADER) {
+      strategy = BITARRAY_ROTATE_REVERSAL;
+    }
+  }
+  if (strategy == BITARRAY_ROTATE_CYCLE_LEADER &&
+      gcd(bit_length, bit_left_amount) < CYCLE_LEADER_MIN_WIDTH) {
+    strategy = BITARRAY_ROTATE_REVERSAL;
+  }
+  STATS_ROTATION_BEGIN(timer);
+  switch (strategy) {
+  case BITARRAY_ROTATE_SHIFT_COPY:
+    bitarray_rotate_left_shift_copy(bitarray, bit_offset, bit_length,
+                                    bit_left_amount);
+    STATS_ROTATION_END(timer, STATS_SHIFT_COPY, bit_offset, bit_length);
+    break;
+  case BITARRAY_ROTATE_CYCLE_LEADER:
+    bitarray_rotate_left_cycle_leader(bitarray, bit_offset, bit_length,
+                                      bit_left_amount);
+    STATS_ROTATION_END(timer, STATS_CYCLE_LEADER, bit_offset, bit_length);
+    break;
+  case BITARRAY_ROTATE_REVERSAL:
+  default:
+    bitarray_rotate_left(bitarray, bit_offset, bit_length, bit_left_amount);
+    STATS_ROTATION_END(timer, STATS_REVERSAL, bit_offset, bit_length);
+    break;
+  }
+}
+
+void bitarray_rotate_parallel(bitarray_t* const bitarray,
+                              const size_t bit_offset,
+                              const size_t bit_length,
+                              const ssize_t bit_right_amount,
+                              const size_t thread_count) {
+  assert(bit_offset + bit_length <= bitarray->bit_sz);
+  // Segmented arrays splice instead, which no thread could speed up.
+  if (thread_count <= 1 || bit_length < PARALLEL_MIN_LENGTH ||
+      bitarray->segmented) {
+    bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    return;
+  }
+  const size_t bit_left_amount = modulo(-bit_right_amount, bit_length);
+  if (bit_left_amount == 0) {
+    return;
+  }
+  if (bitarray->concurrent) {
+    rotate_concurrent(bitarray, bit_offset, bit_length, bit_left_amount,
+                      BITARRAY_ROTATE_AUTO, thread_count);
+    return;
+  }
+  bitarray_materialize(bitarray);
+  preserve_for_snapshots(bitarray, bit_offset, bit_length);
+
+  // The same three reversals as bitarray_rotate_left, each one split into
+  // bands.  The reversals share words where they meet, so each one must
+  // finish before the next starts.
+  STATS_ROTATION_BEGIN(timer);
+  reverse_parallel(bitarray, bit_offset, bit_left_amount, thread_count);
+  reverse_parallel(bitarray, bit_offset + bit_left_amount,
+                   bit_length - bit_left_amount, thread_count);
+  reverse_parallel(bitarray, bit_offset, bit_length, thread_count);
+  STATS_ROTATION_END(timer, STATS_PARALLEL_REVERSAL, bit_offset, bit_length);
+}
+
+void bitarray_rotate_strided(bitarray_t* const bitarray,
+                             const size_t first_offset,
+                             const size_t field_len,
+                             const size_t stride,
+                             const size_t count,
+                             const ssize_t bit_right_amount) {
+  bitarray_rotate_strided_parallel(bitarray, first_offset, field_len, stride,
+                                   count, bit_right_amount, 1);
+}
+
+void bitarray_rotate_strided_parallel(bitarray_t* const bitarray,
+                                      const size_t first_offset,
+                                      const size_t field_len,
+                                      const size_t stride,
+                                      const size_t count,
+                                      const ssize_t bit_right_amount,
+                                      size_t thread_count) {
+  if (count == 0 || field_len == 0) {
+    return;
+  }
+  assert(count == 1 || stride >= field_len);
+  assert(first_offset + (count - 1) * stride + field_len <= bitarray->bit_sz);
+  // Every field has the same length, so one modulo serves them all.
+  const strided_plan_t plan = {
+    .first_offset = first_offset,
+    .field_len = field_len,
+    .stride = stride,
+    .count = count,
+    .left_amount = modulo(-bit_right_amount, field_len),
+  };
+  if (plan.left_amount == 0) {
+    return;
+  }
+  // The fields are read and written in place, past any view.
+  bitarray_materialize(bitarray);
+  preserve_for_snapshots(bitarray, first_offset,
+                         (count - 1) * stride + field_len);
+
+  STATS_ROTATION_BEGIN(timer);
+  if (thread_count > PARALLEL_MAX_THREADS) {
+    thread_count = PARALLEL_MAX_THREADS;
+  }
+  if (thread_count > count) {
+    thread_count = count;
+  }
+  if (thread_count <= 1 || count * field_len < PARALLEL_MIN_LENGTH) {
+    rotate_strided_fields(bitarray, &plan, 0, count);
+    STATS_PHASE(STATS_BULK);
+    STATS_ROTATION_END(timer, STATS_STRIDED, first_offset, count * field_len);
+    return;
+  }
+
+  // Each thread takes a contiguous run of fields.  A run's first fields may
+  // share a word with the last field of the run before it, so they are
+  // left to the calling thread once the workers are done.
+  strided_band_t bands[PARALLEL_MAX_THREADS];
+  size_t band_starts[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  bool started[PARALLEL_MAX_THREADS];
+  for (size_t t = 0; t < thread_count; t++) {
+    size_t first_field = count * t / thread_count;
+    const size_t end_field = count * (t + 1) / thread_count;
+    band_starts[t] = first_field;
+    if (t > 0) {
+      const size_t shared_word =
+        (first_offset + (first_field - 1) * stride + field_len - 1) /
+        WORD_BITS;
+      while (first_field < end_field &&
+             (first_offset + first_field * stride) / WORD_BITS <=
+             shared_word) {
+        first_field++;
+      }
+    }
+    bands[t].bitarray = bitarray;
+    bands[t].plan = &plan;
+    bands[t].first_field = first_field;
+    bands[t].end_field = end_field;
+    started[t] = false;
+    if (t > 0) {
+      // If we cannot get another thread, do the band ourselves.
+      started[t] = pthread_create(&threads[t], NULL, strided_band_worker,
+                                  &bands[t]) == 0;
+      if (!started[t]) {
+        strided_band_worker(&bands[t]);
+      }
+    }
+  }
+  strided_band_worker(&bands[0]);
+  for (size_t t = 1; t < thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  STATS_PHASE(STATS_BULK);
+
+  // Now that nobody else is writing, rotate the fields at the seams.
+  for (size_t t = 1; t < thread_count; t++) {
+    rotate_strided_fields(bitarray, &plan, band_starts[t],
+                          bands[t].first_field);
+  }
+  STATS_PHASE(STATS_TAIL);
+  STATS_ROTATION_END(timer, STATS_STRIDED, first_offset, count * field_len);
+}
+
+static void rotate_strided_fields(bitarray_t* const bitarray,
+                                  const strided_plan_t* const plan,
+                                  const size_t first_field,
+                                  const size_t end_field) {
+  if (first_field >= end_field) {
+    return;
+  }
+  const size_t stride = plan->stride;
+  const size_t field_len = plan->field_len;
+  // With a single field the stride is arbitrary, and means nothing.
+  if (plan->count > 1 && stride <= WORD_BITS && WORD_BITS % stride == 0 &&
+      plan->first_offset % stride + field_len <= stride) {
+    rotate_packed_fields(bitarray, plan, first_field, end_field);
+    return;
+  }
+  size_t field_offset = plan->first_offset + first_field * stride;
+  if (field_len <= REGISTER_ROTATE_MAX_BITS) {
+    for (size_t f = first_field; f < end_field; f++) {
+      rotate_left_in_register(bitarray, field_offset, field_len,
+                              plan->left_amount, false);
+      field_offset += stride;
+    }
+    return;
+  }
+  for (size_t f = first_field; f < end_field; f++) {
+    rotate_left_in_place(bitarray, field_offset, field_len, plan->left_amount,
+                         BITARRAY_ROTATE_AUTO);
+    field_offset += stride;
+  }
+}
+
+static void rotate_packed_fields(bitarray_t* const bitarray,
+                                 const strided_plan_t* const plan,
+                                 const size_t first_field,
+                                 const size_t end_field) {
+  const size_t stride = plan->stride;
+  const size_t field_len = plan->field_len;
+  const size_t left_amount = plan->left_amount;
+  const size_t right_amount = field_len - left_amount;
+
+  // The stride divides the word, so every word holds its fields at the same
+  // bit positions.  In each field, the bits left_amount and up move down to
+  // the bottom and the bits below left_amount move up to the top.
+  const size_t phase = plan->first_offset % stride;
+  uint64_t field_mask = 0;
+  uint64_t down_mask = 0;
+  uint64_t up_mask = 0;
+  for (size_t p = phase; p < WORD_BITS; p += stride) {
+    field_mask |= lowmask(field_len) << p;
+    down_mask |= lowmask(right_amount) << p;
+    up_mask |= lowmask(left_amount) << (p + right_amount);
+  }
+
+  // The first and last words may hold fields outside the range, which must
+  // keep their bits; the words between are rewritten whole.
+  const size_t start = plan->first_offset + first_field * stride;
+  const size_t end = plan->first_offset + (end_field - 1) * stride +
+                     field_len;
+  const size_t first_word = start / WORD_BITS;
+  const size_t last_word = (end - 1) / WORD_BITS;
+  uint64_t* const buf = bitarray->buf;
+  const uint64_t head_mask = ~lowmask(start % WORD_BITS);
+  const uint64_t tail_mask = lowmask(end - last_word * WORD_BITS);
+  if (first_word == last_word) {
+    const uint64_t in_range = head_mask & tail_mask;
+    const uint64_t word = buf[first_word];
+    buf[first_word] = (word & ~(field_mask & in_range)) |
+                      ((((word >> left_amount) & down_mask) |
+                        ((word << right_amount) & up_mask)) & in_range);
+    return;
+  }
+  const uint64_t head = buf[first_word];
+  buf[first_word] = (head & ~(field_mask & head_mask)) |
+                    ((((head >> left_amount) & down_mask) |
+                      ((head << right_amount) & up_mask)) & head_mask);
+  for (size_t w = first_word + 1; w < last_word; w++) {
+    const uint64_t word = buf[w];
+    buf[w] = (word & ~field_mask) | ((word >> left_amount) & down_mask) |
+             ((word << right_amount) & up_mask);
+  }
+  const uint64_t tail = buf[last_word];
+  buf[last_word] = (tail & ~(field_mask & tail_mask)) |
+                   ((((tail >> left_amount) & down_mask) |
+                     ((tail << right_amount) & up_mask)) & tail_mask);
+}
+
+static void* strided_band_worker(void* const arg) {
+  const strided_band_t* const band = arg;
+  rotate_strided_fields(band->bitarray, band->plan, band->first_field,
+                        band->end_field);
+  return NULL;
+}
+
+void bitarray_set_lazy(bitarray_t* const bitarray, const bool lazy) {
+  assert(!lazy || !bitarray->concurrent);
+  // Only a lazy array has views to carry out.
+  if (!lazy && bitarray->lazy) {
+    bitarray_materialize(bitarray);
+  }
+  bitarray->lazy = lazy;
+}
+
+bool bitarray_get_lazy(const bitarray_t* const bitarray) {
+  return bitarray->lazy;
+}
+
+void bitarray_materialize(bitarray_t* const bitarray) {
+  // The views are disjoint, so they can be carried out in any order.
+  for (size_t v = 0; v < bitarray->view_count; v++) {
+    const lazy_view_t* const view = &bitarray->views[v];
+    preserve_for_snapshots(bitarray, view->bit_offset, view->bit_length);
+    rotate_left_in_place(bitarray, view->bit_offset, view->bit_length,
+                         view->left_amount, BITARRAY_ROTATE_AUTO);
+  }
+  bitarray->view_count = 0;
+  if (bitarray->segmented) {
+    compact_segments(bitarray);
+  }
+}
+
+void bitarray_set_segmented(bitarray_t* const bitarray,
+                            const bool segmented) {
+  if (segmented == bitarray->segmented) {
+    return;
+  }
+  assert(!segmented || !bitarray->concurrent);
+  if (!segmented) {
+    compact_segments(bitarray);
+    free(bitarray->segments);
+    bitarray->segments = NULL;
+    bitarray->segment_count = 0;
+    bitarray->segment_capacity = 0;
+    bitarray->segmented = false;
+    return;
+  }
+  // Segments and views are not combined; the segments start out as the
+  // buffer in order.
+  bitarray_materialize(bitarray);
+  segment_t* const segments = malloc(4 * sizeof(segment_t));
+  if (segments == NULL) {
+    // Without room for segments, the array just stays flat.
+    return;
+  }
+  segments[0].logical = 0;
+  segments[0].physical = 0;
+  segments[0].length = bitarray->bit_sz;
+  bitarray->segments = segments;
+  bitarray->segment_count = bitarray->bit_sz == 0 ? 0 : 1;
+  bitarray->segment_capacity = 4;
+  bitarray->segmented = true;
+}
+
+bool bitarray_get_segmented(const bitarray_t* const bitarray) {
+  return bitarray->segmented;
+}
+
+static void rotate_segments(bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const size_t bit_left_amount) {
+  const segment_t* const segment =
+    &bitarray->segments[find_segment(bitarray, bit_offset)];
+  const size_t physical = segment->physical + (bit_offset - segment->logical);
+  if (bit_length < SEGMENT_SPLICE_MIN_BITS &&
+      bit_offset + bit_length <= segment->logical + segment->length) {
+    // Within one segment, the subarray is just as consecutive in the
+    // buffer.
+    preserve_for_snapshots(bitarray, physical, bit_length);
+    if (bit_length <= REGISTER_ROTATE_MAX_BITS) {
+      STATS_ROTATION_BEGIN(timer);
+      rotate_left_in_register(bitarray, physical, bit_length,
+                              bit_left_amount, false);
+      STATS_PHASE(STATS_BULK);
+      STATS_ROTATION_END(timer, STATS_REGISTER, physical, bit_length);
+    } else {
+      rotate_left_in_place(bitarray, physical, bit_length, bit_left_amount,
+                           BITARRAY_ROTATE_AUTO);
+    }
+    return;
+  }
+
+  STATS_ROTATION_BEGIN(timer);
+
+  // The three splits add at most three segments.
+  if (bitarray->segment_count + 3 > bitarray->segment_capacity) {
+    const size_t capacity = 2 * bitarray->segment_capacity + 3;
+    segment_t* const segments = realloc(bitarray->segments,
+                                        capacity * sizeof(segment_t));
+    if (segments == NULL) {
+      // Put the bits in order and rotate them where they are.
+      compact_segments(bitarray);
+      preserve_for_snapshots(bitarray, bit_offset, bit_length);
+      rotate_left_in_place(bitarray, bit_offset, bit_length, bit_left_amount,
+                           BITARRAY_ROTATE_AUTO);
+      STATS_ROTATION_END(timer, STATS_SPLICE, bit_offset, bit_length);
+      return;
+    }
+    bitarray->segments = segments;
+    bitarray->segment_capacity = capacity;
+  }
+
+  // A left rotation by k turns the subarray's segments, a run A of k bits
+  // followed by a run B, into B followed by A.
+  const size_t first = split_segment(bitarray, bit_offset);
+  const size_t middle = split_segment(bitarray, bit_offset + bit_left_amount);
+  const size_t end = split_segment(bitarray, bit_offset + bit_length);
+  STATS_PHASE(STATS_HEAD);
+  segment_t* const segments = bitarray->segments;
+  for (size_t i = first, j = middle - 1; i < j; i++, j--) {
+    const segment_t t = segments[i];
+    segments[i] = segments[j];
+    segments[j] = t;
+  }
+  for (size_t i = middle, j = end - 1; i < j; i++, j--) {
+    const segment_t t = segments[i];
+    segments[i] = segments[j];
+    segments[j] = t;
+  }
+  for (size_t i = first, j = end - 1; i < j; i++, j--) {
+    const segment_t t = segments[i];
+    segments[i] = segments[j];
+    segments[j] = t;
+  }
+  size_t logical = bit_offset;
+  for (size_t i = first; i < end; i++) {
+    segments[i].logical = logical;
+    logical += segments[i].length;
+  }
+  STATS_PHASE(STATS_BULK);
+
+  // Rotating back and forth brings split segments together again.
+  merge_segments(bitarray, first > 0 ? first - 1 : 0,
+                 end < bitarray->segment_count ? end + 1 : end);
+  if (bitarray->segment_count > SEGMENT_MAX_COUNT) {
+    compact_segments(bitarray);
+  }
+  STATS_PHASE(STATS_TAIL);
+  STATS_ROTATION_END(timer, STATS_SPLICE, bit_offset, bit_length);
+}
+
+static size_t find_segment(const bitarray_t* const bitarray,
+                           const size_t bit_index) {
+  assert(bit_index < bitarray->bit_sz);
+  const segment_t* const segments = bitarray->segments;
+  // The last segment starting at or before bit_index holds it.
+  size_t low = 0;
+  size_t high = bitarray->segment_count;
+  while (high - low > 1) {
+    const size_t mid = low + (high - low) / 2;
+    if (segments[mid].logical <= bit_index) {
+      low = mid;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+static size_t split_segment(bitarray_t* const bitarray,
+                            const size_t bit_index) {
+  if (bit_index == bitarray->bit_sz) {
+    return bitarray->segment_count;
+  }
+  const size_t s = find_segment(bitarray, bit_index);
+  segment_t* const segments = bitarray->segments;
+  const size_t head = bit_index - segments[s].logical;
+  if (head == 0) {
+    return s;
+  }
+  assert(bitarray->segment_count < bitarray->segment_capacity);
+  memmove(&segments[s + 2], &segments[s + 1],
+          (bitarray->segment_count - s - 1) * sizeof(segment_t));
+  bitarray->segment_count++;
+  segments[s + 1].logical = bit_index;
+  segments[s + 1].physical = segments[s].physical + head;
+  segments[s + 1].length = segments[s].length - head;
+  segments[s].length = head;
+  return s + 1;
+}
+
+static void merge_segments(bitarray_t* const bitarray,
+                           size_t first,
+                           size_t end) {
+  segment_t* const segments = bitarray->segments;
+  if (end - first < 2) {
+    return;
+  }
+  size_t kept = first;
+  for (size_t i = first + 1; i < end; i++) {
+    if (segments[kept].physical + segments[kept].length ==
+        segments[i].physical) {
+      segments[kept].length += segments[i].length;
+    } else {
+      segments[++kept] = segments[i];
+    }
+  }
+  kept++;
+  memmove(&segments[kept], &segments[end],
+          (bitarray->segment_count - end) * sizeof(segment_t));
+  bitarray->segment_count -= end - kept;
+}
+
+static void compact_segments(bitarray_t* const bitarray) {
+  if (bitarray->segment_count <= 1) {
+    // One segment covers the whole array from the start of the buffer.
+    return;
+  }
+  // Every bit is about to move, so the snapshots take all their chunks.
+  preserve_for_snapshots(bitarray, 0, bitarray->bit_sz);
+
+  // Gather the segments, in order, into a buffer of their own.  A buffer we
+  // own is simply replaced; the buffers of arenas and files are refilled.
+  const size_t buf_bytes = buffer_bytes(bitarray->bit_sz);
+  const bool replace = !bitarray->file_backed && !bitarray->in_arena;
+  size_t map_bytes;
+  uint64_t* const gathered = allocate_buffer(buf_bytes, &map_bytes);
+  if (gathered != NULL) {
+    for (size_t s = 0; s < bitarray->segment_count; s++) {
+      const segment_t* const segment = &bitarray->segments[s];
+      extract_bits_at(gathered, segment->logical, bitarray, segment->physical,
+                      segment->length);
+    }
+    uint64_t* const old_buf = bitarray->buf;
+    const size_t old_map_bytes = bitarray->map_bytes;
+    if (replace) {
+      bitarray->buf = gathered;
+      bitarray->map_bytes = map_bytes;
+    } else {
+      memcpy(bitarray->buf, gathered,
+             (bitarray->bit_sz + WORD_BITS - 1) / WORD_BITS * WORD_BYTES);
+    }
+    uint64_t* const unused = replace ? old_buf : gathered;
+    const size_t unused_map_bytes = replace ? old_map_bytes : map_bytes;
+    if (unused_map_bytes != 0) {
+      munmap(unused, unused_map_bytes);
+    } else {
+      free(unused);
+    }
+  } else {
+    // Without the memory for a second buffer, rotate each segment into
+    // place in turn.  The segments not placed yet fill the buffer from the
+    // cursor on, so bringing the next one to the cursor shifts the others
+    // between them up by its length.
+    segment_t* const segments = bitarray->segments;
+    size_t cursor = 0;
+    for (size_t s = 0; s < bitarray->segment_count; s++) {
+      const size_t physical = segments[s].physical;
+      const size_t length = segments[s].length;
+      if (physical != cursor) {
+        rotate_left_in_place(bitarray, cursor, physical + length - cursor,
+                             physical - cursor, BITARRAY_ROTATE_AUTO);
+        for (size_t t = s + 1; t < bitarray->segment_count; t++) {
+          if (segments[t].physical < physical) {
+            segments[t].physical += length;
+          }
+        }
+      }
+      cursor += length;
+    }
+  }
+  bitarray->segment_count = 1;
+  bitarray->segments[0].logical = 0;
+  bitarray->segments[0].physical = 0;
+  bitarray->segments[0].length = bitarray->bit_sz;
+}
+
+void bitarray_set_concurrent(bitarray_t* const bitarray,
+                             const bool concurrent) {
+  if (concurrent == bitarray->concurrent) {
+    return;
+  }
+  assert(bitarray->held_ranges == NULL);
+  if (!concurrent) {
+    pthread_cond_destroy(&bitarray->range_released);
+    pthread_mutex_destroy(&bitarray->range_mutex);
+    bitarray->concurrent = false;
+    return;
+  }
+  // Views and segments would be shared by every rotation; the bits go back
+  // in order instead.
+  bitarray_set_lazy(bitarray, false);
+  bitarray_set_segmented(bitarray, false);
+  pthread_mutex_init(&bitarray->range_mutex, NULL);
+  pthread_cond_init(&bitarray->range_released, NULL);
+  bitarray->concurrent = true;
+}
+
+static void rotate_concurrent(bitarray_t* const bitarray,
+                              const size_t bit_offset,
+                              const size_t bit_length,
+                              const size_t bit_left_amount,
+                              const bitarray_rotate_strategy_t strategy,
+                              const size_t thread_count) {
+  const size_t end = bit_offset + bit_length;
+  STATS_ROTATION_BEGIN(timer);
+  range_lock_t lock;
+  acquire_range(bitarray, &lock, bit_offset, end);
+  preserve_for_snapshots(bitarray, bit_offset, bit_length);
+  if (bit_length <= REGISTER_ROTATE_MAX_BITS) {
+    rotate_left_in_register(bitarray, bit_offset, bit_length,
+                            bit_left_amount, true);
+    STATS_PHASE(STATS_BULK);
+    STATS_ROTATION_END(timer, STATS_CONCURRENT, bit_offset, bit_length);
+    release_range(bitarray, &lock);
+    return;
+  }
+
+  // The subarray is a partial head word, whole words in the middle and a
+  // partial tail word; only the head and the tail may share their words
+  // with other rotations.
+  const size_t to_boundary = (WORD_BITS - bit_offset % WORD_BITS) % WORD_BITS;
+  const size_t head = to_boundary < bit_length ? to_boundary : bit_length;
+  const size_t middle_offset = bit_offset + head;
+  const size_t middle_end = end - end % WORD_BITS > middle_offset ?
+                            end - end % WORD_BITS : middle_offset;
+  const size_t middle = middle_end - middle_offset;
+  const size_t tail = end - middle_end;
+  const size_t k = bit_left_amount;
+
+  // Work out what the head and the tail end up holding before anything
+  // moves.  Bit i of the result is bit (i + k) mod bit_length of the
+  // subarray.
+  const uint64_t head_bits = head == 0 ? 0 :
+    load_cyclic(bitarray, bit_offset, bit_length, k, head);
+  const uint64_t tail_bits = tail == 0 ? 0 :
+    load_cyclic(bitarray, bit_offset, bit_length,
+                (k + head + middle) % bit_length, tail);
+  STATS_PHASE(STATS_HEAD);
+
+  if (middle != 0) {
+    // Read from the middle on around, the subarray is the middle m followed
+    // by x, the old tail and then the old head, and the new middle is the
+    // middle-sized run of that from k on.  Either way that is some of x
+    // written over bits of the middle that the new middle drops, and a
+    // rotation or two of the middle alone.
+    uint64_t x[3] = {0, 0, 0};
+    const size_t x_length = tail + head;
+    if (tail != 0) {
+      x[0] = load_shared(bitarray, middle_end, tail);
+    }
+    if (head != 0) {
+      const uint64_t old_head = load_shared(bitarray, bit_offset, head);
+      x[0] |= old_head << tail;
+      if (x_length > WORD_BITS) {
+        x[1] = old_head >> (WORD_BITS - tail);
+      }
+    }
+    if (k >= middle) {
+      // The new middle starts in x.
+      const size_t from_x = bit_length - k;
+      if (from_x >= middle) {
+        deposit_bits_at(bitarray, middle_offset, x, k - middle, middle);
+      } else {
+        deposit_bits_at(bitarray, middle_offset + middle - from_x, x,
+                        k - middle, from_x);
+        rotate_owned(bitarray, middle_offset, middle, middle - from_x,
+                     strategy, thread_count);
+      }
+    } else if (k <= x_length) {
+      // m[k, middle) and then x[0, k).
+      deposit_bits_at(bitarray, middle_offset, x, 0, k);
+      rotate_owned(bitarray, middle_offset, middle, k, strategy,
+                   thread_count);
+    } else {
+      // m[k, middle), all of x and then m[0, k - x_length): with x in place
+      // of the bits between, p x q becomes q x p.
+      if (x_length != 0) {
+        deposit_bits_at(bitarray, middle_offset + k - x_length, x, 0,
+                        x_length);
+      }
+      if (k <= middle - k + x_length) {
+        rotate_owned(bitarray, middle_offset, middle, k, strategy,
+                     thread_count);
+        rotate_owned(bitarray, middle_offset + middle - k, k, k - x_length,
+                     strategy, thread_count);
+      } else {
+        rotate_owned(bitarray, middle_offset, middle, k - x_length, strategy,
+                     thread_count);
+        rotate_owned(bitarray, middle_offset, middle - k + x_length,
+                     x_length, strategy, thread_count);
+      }
+    }
+  }
+  STATS_PHASE(STATS_BULK);
+
+  if (head != 0) {
+    store_shared(bitarray, bit_offset, head, head_bits);
+  }
+  if (tail != 0) {
+    store_shared(bitarray, middle_end, tail, tail_bits);
+  }
+  STATS_ROTATION_END(timer, STATS_CONCURRENT, bit_offset, bit_length);
+  release_range(bitarray, &lock);
+}
+
+static void rotate_owned(bitarray_t* const bitarray,
+                         const size_t bit_offset,
+                         const size_t bit_length,
+                         const size_t bit_left_amount,
+                         const bitarray_rotate_strategy_t strategy,
+                         const size_t thread_count) {
+  if (bit_left_amount == 0) {
+    return;
+  }
+  if (thread_count > 1 && bit_length >= PARALLEL_MIN_LENGTH) {
+    reverse_parallel(bitarray, bit_offset, bit_left_amount, thread_count);
+    reverse_parallel(bitarray, bit_offset + bit_left_amount,
+                     bit_length - bit_left_amount, thread_count);
+    reverse_parallel(bitarray, bit_offset, bit_length, thread_count);
+    return;
+  }
+  rotate_left_in_place(bitarray, bit_offset, bit_length, bit_left_amount,
+                       strategy);
+}
+
+static void acquire_range(bitarray_t* const bitarray,
+                          range_lock_t* const lock,
+                          const size_t begin,
+                          const size_t end) {
+  lock->begin = begin;
+  lock->end = end;
+  pthread_mutex_lock(&bitarray->range_mutex);
+  // There are rarely more ranges held than threads, so a list will do.
+  for (;;) {
+    const range_lock_t* held = bitarray->held_ranges;
+    while (held != NULL && (held->end <= begin || end <= held->begin)) {
+      held = held->next;
+    }
+    if (held == NULL) {
+      break;
+    }
+    pthread_cond_wait(&bitarray->range_released, &bitarray->range_mutex);
+  }
+  lock->next = bitarray->held_ranges;
+  bitarray->held_ranges = lock;
+  pthread_mutex_unlock(&bitarray->range_mutex);
+}
+
+static void release_range(bitarray_t* const bitarray,
+                          range_lock_t* const lock) {
+  pthread_mutex_lock(&bitarray->range_mutex);
+  range_lock_t** link = &bitarray->held_ranges;
+  while (*link != lock) {
+    link = &(*link)->next;
+  }
+  *link = lock->next;
+  pthread_cond_broadcast(&bitarray->range_released);
+  pthread_mutex_unlock(&bitarray->range_mutex);
+}
+
+static uint64_t load_cyclic(const bitarray_t* const bitarray,
+                            const size_t bit_offset,
+                            const size_t bit_length,
+                            const size_t start,
+                            const size_t bit_count) {
+  assert(start < bit_length && bit_count <= WORD_BITS);
+  const size_t first = bit_length - start < bit_count ?
+                       bit_length - start : bit_count;
+  uint64_t bits = load_shared(bitarray, bit_offset + start, first);
+  if (first < bit_count) {
+    bits |= load_shared(bitarray, bit_offset, bit_count - first) << first;
+  }
+  return bits;
+}
+
+static void record_view(bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        const size_t bit_left_amount) {
+  for (size_t v = 0; v < bitarray->view_count; v++) {
+    lazy_view_t* const view = &bitarray->views[v];
+    if (view->bit_offset == bit_offset && view->bit_length == bit_length) {
+      // Rotating the same subarray again just moves its view further.
+      view->left_amount = (view->left_amount + bit_left_amount) % bit_length;
+      if (view->left_amount == 0) {
+        *view = bitarray->views[--bitarray->view_count];
+      }
+      return;
+    }
+    if (view->bit_offset < bit_offset + bit_length &&
+        bit_offset < view->bit_offset + view->bit_length) {
+      // Overlapping views would compose into something no single offset
+      // can describe; carry out what we have and start over.
+      bitarray_materialize(bitarray);
+      break;
+    }
+  }
+  if (bitarray->view_count == LAZY_MAX_VIEWS) {
+    bitarray_materialize(bitarray);
+  }
+  lazy_view_t* const view = &bitarray->views[bitarray->view_count++];
+  view->bit_offset = bit_offset;
+  view->bit_length = bit_length;
+  view->left_amount = bit_left_amount;
+}
+
+static inline size_t view_index(const bitarray_t* const bitarray,
+                                const size_t bit_index) {
+  if (bitarray->segmented) {
+    const segment_t* const segment =
+      &bitarray->segments[find_segment(bitarray, bit_index)];
+    return segment->physical + (bit_index - segment->logical);
+  }
+  for (size_t v = 0; v < bitarray->view_count; v++) {
+    const lazy_view_t* const view = &bitarray->views[v];
+    // Unsigned arithmetic makes this a single range check.
+    const size_t i = bit_index - view->bit_offset;
+    if (i < view->bit_length) {
+      const size_t j = i + view->left_amount;
+      return view->bit_offset +
+             (j >= view->bit_length ? j - view->bit_length : j);
+    }
+  }
+  return bit_index;
+}
+
+static size_t physical_run(const bitarray_t* const bitarray,
+                           const size_t bit_index,
+                           const size_t end,
+                           size_t* const run_length) {
+  if (bitarray->segmented) {
+    // The run stops where the segment does.
+    const segment_t* const segment =
+      &bitarray->segments[find_segment(bitarray, bit_index)];
+    const size_t segment_end = segment->logical + segment->length;
+    *run_length = (segment_end < end ? segment_end : end) - bit_index;
+    return segment->physical + (bit_index - segment->logical);
+  }
+  size_t run_end = end;
+  for (size_t v = 0; v < bitarray->view_count; v++) {
+    const lazy_view_t* const view = &bitarray->views[v];
+    const size_t i = bit_index - view->bit_offset;
+    if (i < view->bit_length) {
+      // Inside the view the run stops where the view ends or wraps.
+      size_t j = i + view->left_amount;
+      if (j >= view->bit_length) {
+        j -= view->bit_length;
+      }
+      const size_t until_wrap = view->bit_length - j;
+      const size_t until_end = view->bit_length - i;
+      size_t length = until_wrap < until_end ? until_wrap : until_end;
+      if (length > end - bit_index) {
+        length = end - bit_index;
+      }
+      *run_length = length;
+      return view->bit_offset + j;
+    }
+    if (view->bit_offset > bit_index && view->bit_offset < run_end) {
+      run_end = view->bit_offset;
+    }
+  }
+  *run_length = run_end - bit_index;
+  return bit_index;
+}
+
+static void fill_random_chunks(bitarray_t* const bitarray,
+                               const uint64_t seed,
+                               const size_t first_chunk,
+                               const size_t end_chunk) {
+  const size_t full_words = bitarray->bit_sz / WORD_BITS;
+  const size_t word_count = (bitarray->bit_sz + WORD_BITS - 1) / WORD_BITS;
+  for (size_t chunk = first_chunk; chunk < end_chunk; chunk++) {
+    // Each lane's state comes from a SplitMix64 stream of its own.
+    uint64_t state[4][RANDOM_LANES];
+    for (size_t lane = 0; lane < RANDOM_LANES; lane++) {
+      uint64_t x = mix64(seed ^ mix64(chunk * RANDOM_LANES + lane));
+      for (size_t j = 0; j < 4; j++) {
+        x += UINT64_C(0x9E3779B97F4A7C15);
+        state[j][lane] = mix64(x);
+      }
+    }
+
+    // Whole groups of words go straight into the buffer.  The last group
+    // is staged, so that nothing is written past the last word and the
+    // bits past the end of the array are left alone.
+    const size_t begin = chunk * RANDOM_CHUNK_WORDS;
+    const size_t end = begin + RANDOM_CHUNK_WORDS < word_count ?
+                       begin + RANDOM_CHUNK_WORDS : word_count;
+    const size_t direct_end = end < full_words ? end : full_words;
+    const size_t direct = direct_end > begin ?
+                          (direct_end - begin) / RANDOM_LANES * RANDOM_LANES :
+                          0;
+    bitarray_kernels->fill_random(bitarray->buf + begin, direct, state);
+    for (size_t i = begin + direct; i < end; i += RANDOM_LANES) {
+      uint64_t group[RANDOM_LANES];
+      bitarray_kernels->fill_random(group, RANDOM_LANES, state);
+      for (size_t lane = 0; lane < RANDOM_LANES && i + lane < end; lane++) {
+        if (i + lane < full_words) {
+          bitarray->buf[i + lane] = group[lane];
+        } else {
+          set_bits(bitarray, (i + lane) * WORD_BITS,
+                   bitarray->bit_sz % WORD_BITS, group[lane]);
+        }
+      }
+    }
+  }
+}
+
+static void* fill_band_worker(void* const arg) {
+  const fill_band_t* const band = arg;
+  fill_random_chunks(band->bitarray, band->seed, band->first_chunk,
+                     band->end_chunk);
+  return NULL;
+}
+
+static inline uint64_t mix64(uint64_t x) {
+  x = (x ^ (x >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return x ^ (x >> 31);
+}
+
+static size_t buffer_bytes(const size_t bit_sz) {
+  const size_t word_count = (bit_sz + WORD_BITS - 1) / WORD_BITS + 1;
+  return (word_count * WORD_BYTES + CACHE_LINE_BYTES - 1) /
+         CACHE_LINE_BYTES * CACHE_LINE_BYTES;
+}
+
+static void* arena_carve(bitarray_arena_t* const arena,
+                         const size_t block_bytes) {
+  // Full slabs are skipped for good; the one after current may have room.
+  while (arena->current != NULL &&
+         arena->current->bytes - arena->current->used < block_bytes) {
+    if (arena->current->next == NULL) {
+      break;
+    }
+    arena->current = arena->current->next;
+  }
+  arena_slab_t* slab = arena->current;
+  if (slab == NULL || slab->bytes - slab->used < block_bytes) {
+    slab = arena_slab_new(block_bytes > arena->slab_bytes ?
+                          block_bytes : arena->slab_bytes);
+    if (slab == NULL) {
+      return NULL;
+    }
+    // Slot the new slab in after current, ahead of any slabs still unused.
+    if (arena->current == NULL) {
+      slab->next = arena->slabs;
+      arena->slabs = slab;
+    } else {
+      slab->next = arena->current->next;
+      arena->current->next = slab;
+    }
+    arena->current = slab;
+  }
+  void* const block = (char*)slab + ARENA_HEADER_BYTES + slab->used;
+  slab->used += block_bytes;
+  return block;
+}
+
+static arena_slab_t* arena_slab_new(const size_t block_bytes) {
+  void* memory;
+  if (posix_memalign(&memory, CACHE_LINE_BYTES,
+                     ARENA_HEADER_BYTES + block_bytes) != 0) {
+    return NULL;
+  }
+  arena_slab_t* const slab = memory;
+  slab->next = NULL;
+  slab->bytes = block_bytes;
+  slab->used = 0;
+  return slab;
+}
+
+void bitarray_set_alloc_policy(const bitarray_alloc_policy_t* const policy) {
+  alloc_policy = *policy;
+}
+
+bitarray_alloc_policy_t bitarray_get_alloc_policy(void) {
+  return alloc_policy;
+}
+
+static uint64_t* allocate_buffer(const size_t buf_bytes,
+                                 size_t* const map_bytes) {
+  const bitarray_alloc_policy_t policy = alloc_policy;
+  if (policy.pages == BITARRAY_PAGES_DEFAULT &&
+      policy.numa == BITARRAY_NUMA_DEFAULT) {
+    void* buf;
+    if (posix_memalign(&buf, CACHE_LINE_BYTES, buf_bytes) != 0) {
+      return NULL;
+    }
+    *map_bytes = 0;
+    first_touch(buf, buf_bytes, policy.first_touch_threads);
+    return buf;
+  }
+
+  // Placement and page size are properties of a mapping, so the buffer
+  // gets one of its own.
+  void* const buf = map_anonymous(buf_bytes, policy.pages, map_bytes);
+  if (buf == NULL) {
+    return NULL;
+  }
+#if defined(__linux__) && defined(SYS_mbind)
+  if (policy.numa != BITARRAY_NUMA_DEFAULT) {
+    // An all-ones mask is cut down to the nodes we may use.  Failing to set
+    // the policy only costs locality, so errors are ignored.
+    const unsigned long all_nodes = ~0UL;
+    const int mode = policy.numa == BITARRAY_NUMA_INTERLEAVE ?
+                     NUMA_MPOL_INTERLEAVE : NUMA_MPOL_LOCAL;
+    syscall(SYS_mbind, buf, *map_bytes, mode,
+            mode == NUMA_MPOL_LOCAL ? NULL : &all_nodes,
+            mode == NUMA_MPOL_LOCAL ? 0 : sizeof(all_nodes) * 8, 0);
+  }
+#endif
+  // Fresh anonymous pages read as zero already; they only need touching if
+  // the policy says who touches them first.
+  if (policy.first_touch_threads > 1) {
+    first_touch(buf, buf_bytes, policy.first_touch_threads);
+  }
+  return buf;
+}
+
+static void* map_anonymous(const size_t buf_bytes,
+                           const bitarray_pages_t pages,
+                           size_t* const map_bytes) {
+  size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  if (pages == BITARRAY_PAGES_HUGE_2MB || pages == BITARRAY_PAGES_HUGE_1GB) {
+    const size_t huge_bytes = pages == BITARRAY_PAGES_HUGE_1GB ?
+                              HUGE_1GB_BYTES : HUGE_2MB_BYTES;
+    const int huge_shift = pages == BITARRAY_PAGES_HUGE_1GB ? 30 : 21;
+    const size_t bytes = (buf_bytes + huge_bytes - 1) / huge_bytes * huge_bytes;
+    void* const buf = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                           (huge_shift << MAP_HUGE_SHIFT), -1, 0);
+    if (buf != MAP_FAILED) {
+      *map_bytes = bytes;
+      return buf;
+    }
+  }
+#endif
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (pages != BITARRAY_PAGES_DEFAULT) {
+    page_bytes = HUGE_2MB_BYTES;
+  }
+#endif
+
+  // Over-allocate by a page so that the buffer can start on a page
+  // boundary, then give back what lies outside it.
+  const size_t bytes = (buf_bytes + page_bytes - 1) / page_bytes * page_bytes;
+  char* const raw = mmap(NULL, bytes + page_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+  char* const buf = raw + (page_bytes - (uintptr_t)raw % page_bytes) %
+                          page_bytes;
+  if (buf > raw) {
+    munmap(raw, buf - raw);
+  }
+  if (raw + page_bytes > buf) {
+    munmap(buf + bytes, raw + page_bytes - buf);
+  }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (pages != BITARRAY_PAGES_DEFAULT) {
+    madvise(buf, bytes, MADV_HUGEPAGE);
+  }
+#endif
+  *map_bytes = bytes;
+  return buf;
+}
+
+static void first_touch(void* const buf,
+                        const size_t buf_bytes,
+                        size_t thread_count) {
+  if (thread_count > PARALLEL_MAX_THREADS) {
+    thread_count = PARALLEL_MAX_THREADS;
+  }
+  if (thread_count <= 1) {
+    memset(buf, 0, buf_bytes);
+    return;
+  }
+
+  // buf_bytes is a whole number of cache lines, so the halves meet without
+  // a stray byte in the middle; bands are cut on cache line boundaries.
+  const size_t half = buf_bytes / 2;
+  touch_band_t bands[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  bool started[PARALLEL_MAX_THREADS];
+  size_t start = 0;
+  for (size_t t = 0; t < thread_count; t++) {
+    size_t end = t + 1 == thread_count ? half :
+                 (half / thread_count * (t + 1)) / CACHE_LINE_BYTES *
+                 CACHE_LINE_BYTES;
+    if (end < start) {
+      end = start;
+    }
+    bands[t].head = (char*)buf + start;
+    bands[t].tail = (char*)buf + buf_bytes - end;
+    bands[t].bytes = end - start;
+    start = end;
+    started[t] = false;
+    if (t > 0) {
+      started[t] = pthread_create(&threads[t], NULL, touch_band_worker,
+                                  &bands[t]) == 0;
+      if (!started[t]) {
+        touch_band_worker(&bands[t]);
+      }
+    }
+  }
+  touch_band_worker(&bands[0]);
+  for (size_t t = 1; t < thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+}
+
+static void* touch_band_worker(void* const arg) {
+  const touch_band_t* const band = arg;
+  memset(band->head, 0, band->bytes);
+  memset(band->tail, 0, band->bytes);
+  return NULL;
+}
+
+void bitarray_set_scratch_limit(const size_t bit_limit) {
+  scratch_limit = bit_limit;
+}
+
+size_t bitarray_get_scratch_limit(void) {
+  return scratch_limit;
+}
+
+static bitarray_rotate_strategy_t choose_rotate_strategy(
+    const size_t bit_length,
+    const size_t bit_left_amount) {
+  // Sliding the long side over costs a single sequential pass, which no
+  // other strategy beats, so use it whenever the short side fits.
+  const size_t right_amount = bit_length - bit_left_amount;
+  const size_t short_side = bit_left_amount < right_amount ?
+                            bit_left_amount : right_amount;
+  if (short_side <= scratch_limit) {
+    return BITARRAY_ROTATE_SHIFT_COPY;
+  }
+  if (bit_length >= CYCLE_LEADER_MIN_LENGTH &&
+      gcd(bit_length, bit_left_amount) >= CYCLE_LEADER_MIN_GCD) {
+    return BITARRAY_ROTATE_CYCLE_LEADER;
+  }
+  return BITARRAY_ROTATE_REVERSAL;
+}
+
+static void bitarray_rotate_left(bitarray_t* const bitarray,
+                                 const size_t bit_offset,
+                                 const size_t bit_length,
                                  const size_t bit_left_amount) {
-  size_t i,j,l,m,r,tmp,prev;
-  size_t k;
-  l=bit_offset; m=bit_offset+bit_left_amount; r=bit_offset+bit_length-1;
-  if(bit_left_amount==0) return;
-  /*for(i=l;i<=r-bit_left_amount;i++){
-    if(i<bit_left_amount+l)
-      k=i+r+1-bit_left_amount-l;
-    else
-      k=i-bit_left_amount;
-    tmp=bitarray_get(bitarray,i);
-    bitarray_set(bitarray,i,bitarray_get(bitarray,k));
-    bitarray_set(bitarray,k,tmp);
-  }
-  return;*/
-  //printf("\n");
-  //for(size_t i=l; i<=r; i++){
-  //  tmp=bitarray_get(bitarray, i);
-  //  printf("%d",tmp);
-  //}
-  //printf("\n");
-  //printf("%d %d\n",l,r);
-  /*i=r;
-  prev=bitarray_get(bitarray,r);
-  do{
-    k=i-bit_left_amount;
-    if(k<l)
-      k=k+r+1;
-    tmp=bitarray_get(bitarray,k);
-    bitarray_set(bitarray,k,prev);
-    prev=tmp;
-    i=k;
-  }while(i!=r);
-  for(i=0;i<bit_left_amount;i++){
-    prev=bitarray_get(bitarray,r-i);     
-    for(j=r-i;j>=l;j-=bit_left_amount){
-      k=j-bit_left_amount;
-      if(k<l)
-        k=k+r+1;
-      tmp=bitarray_get(bitarray,k);
-      bitarray_set(bitarray,k,prev);
-      prev=tmp;
-    }
-  }*/
-  reverse(bitarray,l,m-1);
-  reverse(bitarray,m,r);
-  reverse(bitarray,l,r);
-  /*printf("\n");
-  for(size_t i=l; i<=r; i++){
-    tmp=bitarray_get(bitarray, i);
-    printf("%d",tmp);
-  }
-  printf("\n");
-  printf("%d %d\n",l,r);*/
-}
-
-static void reverse_byte(bitarray_t* const bitarray, const size_t byteleft, const size_t byteright){
-  size_t i,j;
-  char tmp;
-  for(i=byteleft,j=byteright;i<j;i++,j--){
-    tmp=bitarray->buf[i];
-    bitarray->buf[i]=bitarray->buf[j];
-    bitarray->buf[j]=tmp;
-    reverse_short(bitarray,8*i,8*i+7);
-    reverse_short(bitarray,8*j,8*j+7);
-  }
-}
-static void reverse_short(bitarray_t* const bitarray, const size_t left, const size_t right){//right-left<8,left and right belong to the same byte
-  size_t i,j;
-  char byte;
-  bool tmp;
-  byte=bitarray->buf[left>>3];
-  /*for(i=left,j=right;i<j;i++,j--){
-    tmp=bitarray_get(bitarray, i);
-    bitarray_set(bitarray,i,bitarray_get(bitarray,j));
-    bitarray_set(bitarray,j,tmp);
-  }*/
-  for(i=left,j=right;i<j;i++,j--){
-    tmp=(byte & bitmask(i)) ? true : false;
-    bitarray_set(bitarray,i,(byte & bitmask(i)) ? true : false);
-    bitarray_set(bitarray,j,tmp);
-  }
-}
-static void reverse(bitarray_t* const bitarray, const size_t left, const size_t right){
-  size_t i,j,l,k;
-  int8_t byte1,byte2,ci,offset,wholel,wholer;
-  //bool biti,bitj;
-  wholel=((left+7)/8)*8;
-  wholer=right-right%8;
-  byte1=bitarray->buf[left/8];
-  byte2=bitarray->buf[right/8];
-  reverse_short(bitarray,left,wholel-1);
-  reverse_short(bitarray,wholer,right);
-  reverse_byte(bitarray,wholel/8,wholer/8-1);
-  /*if(wholel-left<right-wholer){
-    bitarray_rotate_short_right(bitarray,left,right,right+left-wholer-wholel);
-  }
-  else
-    if(wholel-left>right-wholer)
-      bitarray_rotate_short(bitarray,left,right,wholel+wholer-right-left);*/
-  //to do: swap before and after, copy back the correct bits between the first byte and left, right and last byte
-  /*k=left/8,l=right/8;
-  offset=(right+left)%8;
-  byte1=bitarray->buf[k];
-  byte2=bitarray->buf[l];
-  ci=left%8;
-  if(offset==0){
-    for(i=left,j=right;i<j;){
-      byte1=bitarray->buf[i>>3];
-      byte2=bitarray->buf[j>>3];
-      for(; ci<8 && i<j; ci++,i++,j--){
-        bitarray_set(bitarray,i,byte2&bitmask(j));
-        bitarray_set(bitarray,j,byte1&bitmask(i));
+  // Rotating ab to ba is the same as reversing a and b separately, and then
+  // reversing the whole subarray: (a^R b^R)^R = ba.
+  reverse(bitarray, bit_offset, bit_left_amount);
+  reverse(bitarray, bit_offset + bit_left_amount,
+          bit_length - bit_left_amount);
+  reverse(bitarray, bit_offset, bit_length);
+}
+
+static void bitarray_rotate_left_cycle_leader(bitarray_t* const bitarray,
+                                              const size_t bit_offset,
+                                              const size_t bit_length,
+                                              const size_t bit_left_amount) {
+  const size_t cycle_count = gcd(bit_length, bit_left_amount);
+  assert(cycle_count >= CYCLE_LEADER_MIN_WIDTH);
+  uint64_t leader[CYCLE_BLOCK_WORDS];
+  uint64_t block[CYCLE_BLOCK_WORDS];
+
+  for (size_t first = 0; first < cycle_count; first += CYCLE_BLOCK_BITS) {
+    const size_t width = cycle_count - first < CYCLE_BLOCK_BITS ?
+                         cycle_count - first : CYCLE_BLOCK_BITS;
+
+    // Set the leading block aside, then pull each block of the cycle
+    // into the slot it rotates to, until the walk comes back around to
+    // the leader's slot.
+    extract_bits(leader, bitarray, bit_offset + first, width);
+    size_t dst = first;
+    for (;;) {
+      size_t src = dst + bit_left_amount;
+      if (src >= bit_length) {
+        src -= bit_length;
       }
-      ci=0;
-    }
-  }
-  else{
-    //i=left,j=right;
-    //while(i<j){
-    //tmp=bitarray_get(bitarray, i);
-     //  byte1=bitarray->buf[i>>3];
-      //biti=byte1&bitmask(i);
-      for(i=left,j=right; i<j; ci++,i++,j--){
-        if(ci==8){
-          byte1=bitarray->buf[i>>3];
-          ci=0;
-        }
-        else
-          if(ci==offset)
-           byte2=bitarray->buf[j>>3];
-        bitarray_set(bitarray,i,byte2&bitmask(j));
-        bitarray_set(bitarray,j,byte1&bitmask(i));
+      if (src == first) {
+        break;
       }
-      //ci=0;
-      //byte1=bitarray->buf[i>>3];
-    //}
-  }
-  
-  bytel=left-left%8;
-  byter=right+7-right%8;
-  printf("a%d %d %d %d\n",left,right,bytel,byter);
-  for(i=bytel/8,j=byter/8; i<j; i++,j--){
-    tmp=bitarray->buf[i];
-    printf("%c\n",tmp);
-    bitarray->buf[i ]=bitarray->buf[(j)];
-    bitarray->buf[(j )]=tmp;
-  }
-  //printf("%d %d\n",i,j);
-  for(i=bytel;i<=byter;i+=8){
-    //if(i+8<byter)
-      k=i+7;
-    //else k=right;
-    printf("%d\n",i);
-    for(j=i;j<k;j++,k--){
-      tmp=bitarray_get(bitarray, j);
-      bitarray_set(bitarray,j,bitarray_get(bitarray,k));
-      bitarray_set(bitarray,k,tmp);
-    }
-  }
-  for(j=bytel,k=left-1;j<k;j++,k--){
-    tmp=bitarray_get(bitarray, j);
-    bitarray_set(bitarray,j,bitarray_get(bitarray,k));
-    bitarray_set(bitarray,k,tmp);
-  }
-  for(j=right,k=byter;j<k;j++,k--){
-    tmp=bitarray_get(bitarray, j);
-    bitarray_set(bitarray,j,bitarray_get(bitarray,k));
-    bitarray_set(bitarray,k,tmp);
-  }*/
-}
-
-static void bitarray_rotate_short(bitarray_t* const bitarray,
-                                 const size_t l,
-                                 const size_t r,
-                                 const size_t bit_left_amount) {
-  unsigned int current;
-  size_t i,rbyte;
-  char mask,prev,k; 
-   int j;
-  rbyte=r>>3;
-  for(i=0,mask=0; i<8-bit_left_amount; i++)
-    mask|=1<<i;
-  prev=bitarray->buf[l>>3]&mask;
-  /*for(i=(l>>3)+1;i<rbyte;i+=3){
-    current+=(((unsigned int)prev)<<24);
-    current+=(((unsigned int)bitarray[i])<<(16+bit_left_amount));
-    current+=(((unsigned int)bitarray[i+1])<<(8+bit_left_amount));
-    current+=(((unsigned int)bitarray[i+2])<<bit_left_amount);
-    current+=(((unsigned int)bitarray[i+3])>>bit_left_amount);
-    prev=bitarray[i+3]&mask;
-    for(j=0;j<3;j++){
-      k=(8*(3-j));
-      bitarray[i+j]=current>>k;
-      current-=(bitarray[i+j]>>k)<<k;
-    }
-  }*/
-  current=0;
-  for(i=(l>>3)+1,j=16+bit_left_amount;i<=rbyte;i++,j-=8){
-    current+=(((unsigned int)bitarray->buf[i])<<j);
-    if(j<0 || i==rbyte){      
-      current+=(((unsigned int)prev)<<24);
-      current+=(((unsigned int)bitarray->buf[i])>>(8-bit_left_amount));
-      prev=bitarray->buf[i]&mask;
-      for(j=0,k=24;j<3;j++,k-=8){
-        bitarray->buf[i+j-3]=current>>k;
-        current-=((current>>k)<<k);
+      extract_bits(block, bitarray, bit_offset + src, width);
+      deposit_bits(bitarray, bit_offset + dst, block, width);
+      dst = src;
+    }
+    deposit_bits(bitarray, bit_offset + dst, leader, width);
+  }
+  STATS_PHASE(STATS_BULK);
+}
+
+static void bitarray_rotate_left_shift_copy(bitarray_t* const bitarray,
+                                            const size_t bit_offset,
+                                            const size_t bit_length,
+                                            const size_t bit_left_amount) {
+  const size_t right_amount = bit_length - bit_left_amount;
+  const bool left_is_short = bit_left_amount <= right_amount;
+  const size_t short_side = left_is_short ? bit_left_amount : right_amount;
+  const size_t short_words = (short_side + WORD_BITS - 1) / WORD_BITS;
+
+  uint64_t stack_scratch[SCRATCH_STACK_WORDS];
+  uint64_t* scratch = stack_scratch;
+  if (short_words > SCRATCH_STACK_WORDS) {
+    scratch = malloc(short_words * sizeof(uint64_t));
+    if (scratch == NULL) {
+      // Fall back to the strategy that needs no scratch space at all.
+      bitarray_rotate_left(bitarray, bit_offset, bit_length, bit_left_amount);
+      return;
+    }
+  }
+
+  if (left_is_short) {
+    // ab -> ba with a short: set a aside, slide b down, put a at the end.
+    extract_bits(scratch, bitarray, bit_offset, short_side);
+    STATS_PHASE(STATS_HEAD);
+    copy_bits(bitarray, bit_offset, bit_offset + short_side, right_amount);
+    STATS_PHASE(STATS_BULK);
+    deposit_bits(bitarray, bit_offset + right_amount, scratch, short_side);
+  } else {
+    // ab -> ba with b short: set b aside, slide a up, put b at the start.
+    extract_bits(scratch, bitarray, bit_offset + bit_left_amount, short_side);
+    STATS_PHASE(STATS_HEAD);
+    copy_bits(bitarray, bit_offset + short_side, bit_offset, bit_left_amount);
+    STATS_PHASE(STATS_BULK);
+    deposit_bits(bitarray, bit_offset, scratch, short_side);
+  }
+
+  if (scratch != stack_scratch) {
+    free(scratch);
+  }
+}
+
+static void copy_bits(bitarray_t* const bitarray,
+                      const size_t dst_index,
+                      const size_t src_index,
+                      const size_t bit_count) {
+  uint64_t block[COPY_BLOCK_WORDS];
+  if (dst_index == src_index || bit_count == 0) {
+    return;
+  }
+
+  // Each block is read completely before it is written, so copying front to
+  // back is safe when the destination is below the source (the write never
+  // reaches source bits not yet read), and back to front when above.
+  // File-backed arrays have the source read ahead a window at a time.
+  if (dst_index < src_index) {
+    for (size_t done = 0; done < bit_count; done += COPY_BLOCK_BITS) {
+      const size_t width = bit_count - done < COPY_BLOCK_BITS ?
+                           bit_count - done : COPY_BLOCK_BITS;
+      if (done % MMAP_WINDOW_BITS == 0) {
+        advise_window(bitarray, src_index + done, bit_count - done <
+                      MMAP_WINDOW_BITS ? bit_count - done : MMAP_WINDOW_BITS);
       }
-      j=16+bit_left_amount;
-      current=0;
-    }
-  }
-} 
-static void bitarray_rotate_short_right(bitarray_t* const bitarray,
-                                 const size_t l,
-                                 const size_t r,
-                                 const size_t bit_right_amount) {
-  unsigned int current;
-  size_t i,rbyte;
-  char mask,prev,k;
-   int j;
-  rbyte=r>>3;
-  for(i=0,mask=0; i<bit_right_amount; i++)
-    mask|=1<<i;
-  prev=bitarray->buf[l>>3]&mask;
-  current=0;
-  for(i=(l>>3),j=24-bit_right_amount;i<=rbyte;i++,j-=8){
-    current+=(((unsigned int)bitarray->buf[i])<<j);
-    if(j==8-bit_right_amount || i==rbyte){
-      current+=(((unsigned int)prev)<<24);
-      current+=(((unsigned int)bitarray->buf[i])>>bit_right_amount);
-      prev=bitarray->buf[i]&mask;
-      for(j=0,k=24;j<3;j++,k-=8){
-        bitarray->buf[i+j-3]=current>>k;
-        current-=((current>>k)<<k);  
-        }
-      j=24-bit_right_amount;
-      current=0;
+      extract_bits(block, bitarray, src_index + done, width);
+      deposit_bits(bitarray, dst_index + done, block, width);
+    }
+  } else {
+    for (size_t left = bit_count; left > 0;) {
+      const size_t width = left < COPY_BLOCK_BITS ? left : COPY_BLOCK_BITS;
+      if ((bit_count - left) % MMAP_WINDOW_BITS == 0) {
+        const size_t window = left < MMAP_WINDOW_BITS ? left : MMAP_WINDOW_BITS;
+        advise_window(bitarray, src_index + left - window, window);
+      }
+      left -= width;
+      extract_bits(block, bitarray, src_index + left, width);
+      deposit_bits(bitarray, dst_index + left, block, width);
     }
   }
 }
-/*
-static void bitarray_rotate_left(bitarray_t* const bitarray,
-                                 const size_t bit_offset,
-                                 const size_t bit_length,
-                                 const size_t bit_left_amount) {
-  for (size_t i = 0; i < bit_left_amount; i++) {
-    bitarray_rotate_left_one(bitarray, bit_offset, bit_length);
+
+static void extract_bits_at(uint64_t* const words,
+                            const size_t word_bit,
+                            const bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const size_t bit_count) {
+  uint64_t* word = words + word_bit / WORD_BITS;
+  const size_t shift = word_bit % WORD_BITS;
+  size_t done = 0;
+  if (shift != 0) {
+    // Top up the partly filled word, then carry on from a word boundary.
+    done = WORD_BITS - shift < bit_count ? WORD_BITS - shift : bit_count;
+    *word = (*word & lowmask(shift)) |
+            (get_bits(bitarray, bit_index, done) << shift);
+    word++;
+  }
+  if (done < bit_count) {
+    extract_bits(word, bitarray, bit_index + done, bit_count - done);
+  }
+}
+
+static void deposit_bits_at(bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const uint64_t* const words,
+                            const size_t word_bit,
+                            const size_t bit_count) {
+  const uint64_t* word = words + word_bit / WORD_BITS;
+  const size_t shift = word_bit % WORD_BITS;
+  size_t done = 0;
+  if (shift != 0) {
+    done = WORD_BITS - shift < bit_count ? WORD_BITS - shift : bit_count;
+    set_bits(bitarray, bit_index, done, *word >> shift);
+    word++;
+  }
+  if (done < bit_count) {
+    deposit_bits(bitarray, bit_index + done, word, bit_count - done);
+  }
+}
+
+static void fill_bits(bitarray_t* const bitarray,
+                      const size_t bit_index,
+                      const size_t bit_count,
+                      const bool value) {
+  const uint64_t pattern = value ? ~UINT64_C(0) : 0;
+  const size_t end = bit_index + bit_count;
+  size_t i = bit_index;
+
+  // Partial words at either end are merged in; the whole words in between
+  // are simply overwritten.
+  if (i % WORD_BITS != 0) {
+    const size_t head = WORD_BITS - i % WORD_BITS < bit_count ?
+                        WORD_BITS - i % WORD_BITS : bit_count;
+    set_bits(bitarray, i, head, pattern);
+    i += head;
+  }
+  const size_t word_count = (end - i) / WORD_BITS;
+  memset(bitarray->buf + i / WORD_BITS, value ? 0xFF : 0,
+         word_count * WORD_BYTES);
+  i += word_count * WORD_BITS;
+  if (i < end) {
+    set_bits(bitarray, i, end - i, pattern);
+  }
+}
+
+static size_t count_bits(const bitarray_t* const bitarray,
+                         const size_t bit_index,
+                         const size_t bit_count) {
+  const size_t end = bit_index + bit_count;
+  size_t i = bit_index;
+  size_t count = 0;
+
+  // The partial words at either end are counted on their own; the whole
+  // words in between go to the kernel straight from the buffer.
+  if (i % WORD_BITS != 0) {
+    const size_t head = WORD_BITS - i % WORD_BITS < bit_count ?
+                        WORD_BITS - i % WORD_BITS : bit_count;
+    count += __builtin_popcountll(get_bits(bitarray, i, head));
+    i += head;
+  }
+  const size_t word_count = (end - i) / WORD_BITS;
+  count += bitarray_kernels->count_ones(bitarray->buf + i / WORD_BITS,
+                                        word_count);
+  i += word_count * WORD_BITS;
+  if (i < end) {
+    count += __builtin_popcountll(get_bits(bitarray, i, end - i));
+  }
+  return count;
+}
+
+static size_t find_bit(const bitarray_t* const bitarray,
+                       const size_t bit_index,
+                       const size_t bit_count,
+                       const bool value) {
+  // Looking for a zero is looking for a one in the complement.
+  const uint64_t flip = value ? 0 : ~UINT64_C(0);
+  const uint64_t* word = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+
+  // Drop the bits below bit_index from the first word; past the end of the
+  // run a match no longer counts.
+  uint64_t bits = (*word ^ flip) >> shift;
+  size_t base = 0;
+  if (bits == 0) {
+    base = WORD_BITS - shift;
+    while (base < bit_count) {
+      bits = *++word ^ flip;
+      if (bits != 0) {
+        break;
+      }
+      base += WORD_BITS;
+    }
+    if (bits == 0) {
+      return bit_count;
+    }
+  }
+  const size_t found = base + __builtin_ctzll(bits);
+  return found < bit_count ? found : bit_count;
+}
+
+static void reverse(bitarray_t* const bitarray,
+                    const size_t bit_offset,
+                    const size_t bit_length) {
+  // Swap whole words from either end until fewer than two words are left.
+  const size_t outer = bit_length / (2 * WORD_BITS) * WORD_BITS;
+  if (bitarray->file_backed && outer > MMAP_WINDOW_BITS) {
+    swap_reversed_streaming(bitarray, bit_offset, bit_offset + bit_length,
+                            outer);
+  } else {
+    swap_reversed(bitarray, bit_offset, bit_offset + bit_length, outer);
+  }
+  STATS_PHASE(STATS_BULK);
+
+  // Reversing a word moves its low bits to the top, so a partial word of n
+  // bits must be shifted back down by WORD_BITS - n once it has been
+  // reversed.
+  const size_t left = bit_offset + outer;
+  const size_t remaining = bit_length - 2 * outer;
+  if (remaining > WORD_BITS) {
+    const size_t spill = remaining - WORD_BITS;
+    const uint64_t low = get_bits(bitarray, left, WORD_BITS);
+    const uint64_t high = get_bits(bitarray, left + WORD_BITS, spill);
+    set_bits(bitarray, left, spill, reverse_word(high) >> (WORD_BITS - spill));
+    set_bits(bitarray, left + spill, WORD_BITS, reverse_word(low));
+  } else if (remaining > 1) {
+    const uint64_t word = get_bits(bitarray, left, remaining);
+    set_bits(bitarray, left, remaining,
+             reverse_word(word) >> (WORD_BITS - remaining));
+  }
+  STATS_PHASE(STATS_TAIL);
+}
+
+static void reverse_parallel(bitarray_t* const bitarray,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             size_t thread_count) {
+  const size_t half = bit_length / 2;
+  if (thread_count > PARALLEL_MAX_THREADS) {
+    thread_count = PARALLEL_MAX_THREADS;
+  }
+  if (thread_count <= 1 || half < thread_count * 4 * PARALLEL_MARGIN_BITS) {
+    reverse(bitarray, bit_offset, bit_length);
+    return;
+  }
+  const size_t left = bit_offset;
+  const size_t right = bit_offset + bit_length;
+
+  // Reversing [left, right) swaps the first half with the second, mirrored.
+  // Split the first half into bands; band t pairs bits
+  // [left + bounds[t], left + bounds[t + 1]) with their mirror images at
+  // the other end.
+  size_t bounds[PARALLEL_MAX_THREADS + 1];
+  const size_t band = half / thread_count;
+  bounds[0] = 0;
+  for (size_t t = 1; t < thread_count; t++) {
+    const size_t start = left + t * band;
+    const size_t aligned = start + (PARALLEL_ALIGN_BITS -
+                                    start % PARALLEL_ALIGN_BITS) %
+                                   PARALLEL_ALIGN_BITS;
+    bounds[t] = aligned - left;
+  }
+  bounds[thread_count] = half;
+
+  // Everything but the margins of each band can be swapped concurrently.
+  reverse_band_t bands[PARALLEL_MAX_THREADS];
+  pthread_t threads[PARALLEL_MAX_THREADS];
+  bool started[PARALLEL_MAX_THREADS];
+  for (size_t t = 0; t < thread_count; t++) {
+    const size_t width = bounds[t + 1] - bounds[t];
+    bands[t].bitarray = bitarray;
+    bands[t].left = left + bounds[t] + PARALLEL_MARGIN_BITS;
+    bands[t].right = right - bounds[t] - PARALLEL_MARGIN_BITS;
+    bands[t].bit_count = width - 2 * PARALLEL_MARGIN_BITS;
+    started[t] = false;
+    if (t > 0) {
+      // If we cannot get another thread, do the band ourselves.
+      started[t] = pthread_create(&threads[t], NULL, reverse_band_worker,
+                                  &bands[t]) == 0;
+      if (!started[t]) {
+        reverse_band_worker(&bands[t]);
+      }
+    }
+  }
+  reverse_band_worker(&bands[0]);
+  for (size_t t = 1; t < thread_count; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  STATS_PHASE(STATS_BULK);
+
+  // Now that nobody else is writing, swap the margins.
+  for (size_t t = 0; t < thread_count; t++) {
+    swap_reversed(bitarray, left + bounds[t], right - bounds[t],
+                  PARALLEL_MARGIN_BITS);
+    swap_reversed(bitarray, left + bounds[t + 1] - PARALLEL_MARGIN_BITS,
+                  right - bounds[t + 1] + PARALLEL_MARGIN_BITS,
+                  PARALLEL_MARGIN_BITS);
+  }
+  STATS_PHASE(STATS_TAIL);
+
+  // The middle bit of an odd-length subarray stays put.
+}
+
+static void* reverse_band_worker(void* const arg) {
+  const reverse_band_t* const band = arg;
+  swap_reversed(band->bitarray, band->left, band->right, band->bit_count);
+  return NULL;
+}
+
+static void swap_reversed(bitarray_t* const bitarray,
+                          size_t left,
+                          size_t right,
+                          size_t bit_count) {
+  assert(left + 2 * bit_count <= right);
+  uint64_t head[REVERSE_BLOCK_WORDS];
+  uint64_t tail[REVERSE_BLOCK_WORDS];
+
+  // Swap a block of words from either end at a time, reversing each block
+  // on the way.  The two blocks never overlap, so both are read before
+  // either is written back.
+  while (bit_count >= REVERSE_BLOCK_BITS) {
+    extract_words(head, bitarray, left, REVERSE_BLOCK_WORDS);
+    extract_words(tail, bitarray, right - REVERSE_BLOCK_BITS,
+                  REVERSE_BLOCK_WORDS);
+    bitarray_kernels->reverse_block(head, REVERSE_BLOCK_WORDS);
+    bitarray_kernels->reverse_block(tail, REVERSE_BLOCK_WORDS);
+    deposit_words(bitarray, left, tail, REVERSE_BLOCK_WORDS);
+    deposit_words(bitarray, right - REVERSE_BLOCK_BITS, head,
+                  REVERSE_BLOCK_WORDS);
+    left += REVERSE_BLOCK_BITS;
+    right -= REVERSE_BLOCK_BITS;
+    bit_count -= REVERSE_BLOCK_BITS;
+  }
+
+  // Then a single word from either end at a time.
+  while (bit_count >= WORD_BITS) {
+    const uint64_t head_word = get_bits(bitarray, left, WORD_BITS);
+    const uint64_t tail_word = get_bits(bitarray, right - WORD_BITS, WORD_BITS);
+    set_bits(bitarray, left, WORD_BITS, reverse_word(tail_word));
+    set_bits(bitarray, right - WORD_BITS, WORD_BITS, reverse_word(head_word));
+    left += WORD_BITS;
+    right -= WORD_BITS;
+    bit_count -= WORD_BITS;
+  }
+
+  // And finally the partial words closest to the middle.
+  if (bit_count > 0) {
+    const uint64_t head_bits = get_bits(bitarray, left, bit_count);
+    const uint64_t tail_bits = get_bits(bitarray, right - bit_count, bit_count);
+    set_bits(bitarray, left, bit_count,
+             reverse_word(tail_bits) >> (WORD_BITS - bit_count));
+    set_bits(bitarray, right - bit_count, bit_count,
+             reverse_word(head_bits) >> (WORD_BITS - bit_count));
+  }
+}
+
+static uint64_t* map_file(const int fd,
+                          const size_t bit_sz,
+                          const int flags,
+                          const off_t file_offset,
+                          size_t* const map_bytes) {
+  const bool copy_on_write = (flags & BITARRAY_MMAP_PRIVATE) != 0;
+  const size_t file_bytes = raw_payload_bytes(bit_sz);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return NULL;
+  }
+  if (file_bytes > 0 &&
+      (size_t)st.st_size < (size_t)file_offset + file_bytes) {
+    // Only a shared mapping we may create can grow the file.
+    if (copy_on_write || !(flags & BITARRAY_MMAP_CREATE)) {
+      errno = EINVAL;
+      return NULL;
+    }
+    if (ftruncate(fd, file_offset + (off_t)file_bytes) != 0) {
+      return NULL;
+    }
+  }
+
+  // The file holds the bits themselves; the spare word and the rest of the
+  // last page come from anonymous memory reserved behind it.
+  const size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t word_count = (bit_sz + WORD_BITS - 1) / WORD_BITS + 1;
+  *map_bytes =
+    (word_count * WORD_BYTES + page_bytes - 1) / page_bytes * page_bytes;
+  void* const buf = mmap(NULL, *map_bytes, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    return NULL;
+  }
+
+  // Only whole pages can be mapped, so bits past the end of the array that
+  // share its last page are the file's own data; none of the kernels writes
+  // them.
+  const size_t file_map_bytes =
+    (file_bytes + page_bytes - 1) / page_bytes * page_bytes;
+  if (file_map_bytes > 0 &&
+      mmap(buf, file_map_bytes, PROT_READ | PROT_WRITE,
+           (copy_on_write ? MAP_PRIVATE : MAP_SHARED) | MAP_FIXED, fd,
+           file_offset) == MAP_FAILED) {
+    const int error = errno;
+    munmap(buf, *map_bytes);
+    errno = error;
+    return NULL;
+  }
+  return buf;
+}
+
+static bitarray_t* open_mapped(const int fd,
+                               const size_t bit_sz,
+                               const int flags,
+                               const off_t file_offset) {
+  size_t map_bytes;
+  uint64_t* const buf = map_file(fd, bit_sz, flags, file_offset, &map_bytes);
+  // The mapping keeps the file referenced on its own.
+  const int error = errno;
+  close(fd);
+  if (buf == NULL) {
+    errno = error;
+    return NULL;
+  }
+
+  bitarray_t* const bitarray = malloc(sizeof(struct bitarray));
+  if (bitarray == NULL) {
+    munmap(buf, map_bytes);
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  init_header(bitarray, buf, bit_sz);
+  bitarray->map_bytes = map_bytes;
+  bitarray->file_backed = true;
+  return bitarray;
+}
+
+static bool load_header(const int fd, save_header_t* const header) {
+  memset(header, 0, sizeof(*header));
+  struct iovec iov = { header, sizeof(*header) };
+  if (!read_vectored(fd, &iov, 1, 0)) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  // Sizes, offsets and lengths past 2^62 cannot be real, and would overflow
+  // the buffer size of the array or off_t once added up.  The payload must
+  // lie within the file.
+  const uint64_t limit = UINT64_C(1) << 62;
+  bool valid = memcmp(header->magic, SAVE_MAGIC, sizeof(header->magic)) == 0 &&
+               header->version == SAVE_VERSION &&
+               header->byte_order == SAVE_BYTE_ORDER &&
+               header->bit_sz < limit &&
+               header->payload_offset >= sizeof(*header) &&
+               header->payload_offset < limit &&
+               header->payload_bytes < limit &&
+               header->payload_offset + header->payload_bytes <=
+               (uint64_t)st.st_size;
+  if (header->codec == BITARRAY_CODEC_RAW) {
+    valid = valid &&
+            header->payload_bytes == raw_payload_bytes(header->bit_sz);
+  } else {
+    valid = valid && header->codec == BITARRAY_CODEC_RLE &&
+            header->payload_bytes % WORD_BYTES == 0;
+  }
+  if (!valid) {
+    errno = EINVAL;
+  }
+  return valid;
+}
+
+static size_t raw_payload_bytes(const size_t bit_sz) {
+  return bit_sz / 8 + (bit_sz % 8 != 0);
+}
+
+static bool save_words(save_writer_t* const writer,
+                       const uint64_t* const words,
+                       const size_t first_word,
+                       const size_t word_count,
+                       const size_t bit_sz,
+                       const bitarray_codec_t codec) {
+  if (codec == BITARRAY_CODEC_RLE) {
+    return save_rle(writer, words, word_count);
   }
+  // A raw payload ends with the last byte holding any of the bits.
+  const size_t rest = raw_payload_bytes(bit_sz) - first_word * WORD_BYTES;
+  return save_bytes(writer, words, rest < word_count * WORD_BYTES ?
+                                   rest : word_count * WORD_BYTES);
 }
-*/
-static void bitarray_rotate_left_one(bitarray_t* const bitarray,
-                                     const size_t bit_offset,
-                                     const size_t bit_length) {
-  // Grab the first bit in the range, shift everything left by one, and
-  // then stick the first bit at the end.
-  const bool first_bit = bitarray_get(bitarray, bit_offset);
-  size_t i;
-  for (i = bit_offset; i + 1 < bit_offset + bit_length; i++) {
-    bitarray_set(bitarray, i, bitarray_get(bitarray, i + 1));
+
+static bool save_rle(save_writer_t* const writer,
+                     const uint64_t* const words,
+                     const size_t word_count) {
+  // literal is the first word not encoded yet, and i the first one not
+  // looked at.
+  size_t literal = 0;
+  size_t i = 0;
+  while (literal < word_count) {
+    // Find the next run long enough to store once, if any.
+    size_t run_length = 0;
+    while (i < word_count) {
+      size_t j = i + 1;
+      while (j < word_count && words[j] == words[i]) {
+        j++;
+      }
+      if (j - i >= SAVE_RLE_MIN_RUN) {
+        run_length = j - i;
+        break;
+      }
+      i = j;
+    }
+    // The words before it are stored as they are.
+    if (i > literal &&
+        (!save_token(writer,
+                     (uint64_t)(i - literal) << 1 | SAVE_RLE_LITERAL) ||
+         !save_bytes(writer, words + literal, (i - literal) * WORD_BYTES))) {
+      return false;
+    }
+    if (run_length > 0 &&
+        (!save_token(writer, (uint64_t)run_length << 1) ||
+         !save_token(writer, words[i]))) {
+      return false;
+    }
+    i += run_length;
+    literal = i;
+  }
+  return true;
+}
+
+static bool save_bytes(save_writer_t* const writer,
+                       const void* const data,
+                       const size_t bytes) {
+  if (bytes == 0) {
+    return true;
+  }
+  writer->bytes += bytes;
+  // Bytes that carry on where the last buffer ends extend it.
+  if (writer->iov_count > 0) {
+    struct iovec* const last = &writer->iov[writer->iov_count - 1];
+    if ((const char*)last->iov_base + last->iov_len == (const char*)data) {
+      last->iov_len += bytes;
+      return true;
+    }
+  }
+  if (writer->iov_count == SAVE_MAX_IOVECS && !save_flush(writer)) {
+    return false;
+  }
+  writer->iov[writer->iov_count].iov_base = (void*)data;
+  writer->iov[writer->iov_count].iov_len = bytes;
+  writer->iov_count++;
+  return true;
+}
+
+static bool save_token(save_writer_t* const writer, const uint64_t word) {
+  // Flushing first keeps save_bytes from flushing, which would free the
+  // slot for reuse before it is written.
+  if ((writer->word_count == SAVE_MAX_IOVECS ||
+       writer->iov_count == SAVE_MAX_IOVECS) && !save_flush(writer)) {
+    return false;
+  }
+  uint64_t* const slot = &writer->words[writer->word_count++];
+  *slot = word;
+  return save_bytes(writer, slot, WORD_BYTES);
+}
+
+static bool save_flush(save_writer_t* const writer) {
+  size_t bytes = 0;
+  for (size_t i = 0; i < writer->iov_count; i++) {
+    bytes += writer->iov[i].iov_len;
+  }
+  if (!write_vectored(writer->fd, writer->iov, writer->iov_count,
+                      writer->offset)) {
+    return false;
+  }
+  writer->offset += (off_t)bytes;
+  writer->iov_count = 0;
+  writer->word_count = 0;
+  return true;
+}
+
+static bool write_vectored(const int fd,
+                           struct iovec* iov,
+                           size_t count,
+                           off_t offset) {
+  while (count > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      count--;
+      continue;
+    }
+    const ssize_t written = pwritev(fd, iov, (int)count, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    offset += written;
+    size_t rest = (size_t)written;
+    while (count > 0 && rest >= iov->iov_len) {
+      rest -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + rest;
+      iov->iov_len -= rest;
+    }
+  }
+  return true;
+}
+
+static bool read_vectored(const int fd,
+                          struct iovec* iov,
+                          size_t count,
+                          off_t offset) {
+  while (count > 0) {
+    if (iov->iov_len == 0) {
+      iov++;
+      count--;
+      continue;
+    }
+    const ssize_t read = preadv(fd, iov, (int)count, offset);
+    if (read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (read == 0) {
+      errno = EINVAL;
+      return false;
+    }
+    offset += read;
+    size_t rest = (size_t)read;
+    while (count > 0 && rest >= iov->iov_len) {
+      rest -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + rest;
+      iov->iov_len -= rest;
+    }
+  }
+  return true;
+}
+
+static bool load_rle(load_reader_t* const reader,
+                     uint64_t* const buf,
+                     const size_t word_count) {
+  size_t filled = 0;
+  while (filled < word_count) {
+    uint64_t token;
+    if (!load_words(reader, &token, 1)) {
+      return false;
+    }
+    const uint64_t count = token >> 1;
+    if (count == 0 || count > word_count - filled) {
+      errno = EINVAL;
+      return false;
+    }
+    if (token & SAVE_RLE_LITERAL) {
+      if (!load_words(reader, buf + filled, count)) {
+        return false;
+      }
+    } else {
+      uint64_t word;
+      if (!load_words(reader, &word, 1)) {
+        return false;
+      }
+      for (size_t i = 0; i < count; i++) {
+        buf[filled + i] = word;
+      }
+    }
+    filled += count;
+  }
+  // Nothing may follow the last token's words.
+  if (reader->position != reader->length || reader->offset != reader->end) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+static bool load_words(load_reader_t* const reader,
+                       uint64_t* words,
+                       size_t count) {
+  const size_t buffered = reader->length - reader->position < count ?
+                          reader->length - reader->position : count;
+  memcpy(words, reader->buffer + reader->position, buffered * WORD_BYTES);
+  reader->position += buffered;
+  words += buffered;
+  count -= buffered;
+  if (count == 0) {
+    return true;
+  }
+
+  const uint64_t rest = (uint64_t)(reader->end - reader->offset);
+  if (count > rest / WORD_BYTES) {
+    errno = EINVAL;
+    return false;
+  }
+  const uint64_t ahead = rest - count * WORD_BYTES;
+  struct iovec iov[2] = {
+    { words, count * WORD_BYTES },
+    { reader->buffer, ahead < SAVE_CHUNK_WORDS * WORD_BYTES ?
+                      ahead : SAVE_CHUNK_WORDS * WORD_BYTES },
+  };
+  const size_t refill = iov[1].iov_len;
+  if (!read_vectored(reader->fd, iov, 2, reader->offset)) {
+    return false;
+  }
+  reader->offset += (off_t)(count * WORD_BYTES + refill);
+  reader->position = 0;
+  reader->length = refill / WORD_BYTES;
+  return true;
+}
+
+static void swap_reversed_streaming(bitarray_t* const bitarray,
+                                    size_t left,
+                                    size_t right,
+                                    size_t bit_count) {
+  size_t width = bit_count < MMAP_WINDOW_BITS ? bit_count : MMAP_WINDOW_BITS;
+  advise_window(bitarray, left, width);
+  advise_window(bitarray, right - width, width);
+  while (bit_count > 0) {
+    // Both ends of a reversal move toward the middle, so the windows to
+    // read ahead are the ones just inside the current pair.
+    const size_t rest = bit_count - width;
+    const size_t next = rest < MMAP_WINDOW_BITS ? rest : MMAP_WINDOW_BITS;
+    if (next > 0) {
+      advise_window(bitarray, left + width, next);
+      advise_window(bitarray, right - width - next, next);
+    }
+    swap_reversed(bitarray, left, right, width);
+    left += width;
+    right -= width;
+    bit_count = rest;
+    width = next;
+  }
+}
+
+static void advise_window(const bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const size_t bit_count) {
+  if (!bitarray->file_backed || bit_count == 0) {
+    return;
+  }
+  // posix_madvise wants a page-aligned start.
+  const size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t first = bit_index / 8 / page_bytes * page_bytes;
+  size_t last = (bit_index + bit_count + 7) / 8;
+  if (last > bitarray->map_bytes) {
+    last = bitarray->map_bytes;
+  }
+  posix_madvise((char*)bitarray->buf + first, last - first,
+                POSIX_MADV_WILLNEED);
+}
+
+static inline uint64_t lowmask(const size_t bit_count) {
+  return bit_count >= WORD_BITS ? ~UINT64_C(0) : (UINT64_C(1) << bit_count) - 1;
+}
+
+static inline uint64_t get_bits(const bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count) {
+  assert(bit_count > 0 && bit_count <= WORD_BITS);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  const uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+
+  // The word at base holds the low WORD_BITS - shift bits we want; any
+  // others come from the next word.
+  uint64_t word = base[0] >> shift;
+  if (shift + bit_count > WORD_BITS) {
+    word |= base[1] << (WORD_BITS - shift);
+  }
+  return word & lowmask(bit_count);
+}
+
+static inline void set_bits(bitarray_t* const bitarray,
+                            const size_t bit_index,
+                            const size_t bit_count,
+                            const uint64_t value) {
+  assert(bit_count > 0 && bit_count <= WORD_BITS);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+  const uint64_t mask = lowmask(bit_count);
+  const uint64_t bits = value & mask;
+
+  base[0] = (base[0] & ~(mask << shift)) | (bits << shift);
+
+  // Bits shifted past the top of the word spill into the next one.
+  if (shift + bit_count > WORD_BITS) {
+    const uint64_t spill_mask = lowmask(shift + bit_count - WORD_BITS);
+    base[1] = (base[1] & ~spill_mask) | (bits >> (WORD_BITS - shift));
+  }
+}
+
+static inline uint64_t load_shared(const bitarray_t* const bitarray,
+                                   const size_t bit_index,
+                                   const size_t bit_count) {
+  assert(bit_count > 0 && bit_count <= WORD_BITS);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+  uint64_t word = __atomic_load_n(&base[0], __ATOMIC_RELAXED) >> shift;
+  if (shift + bit_count > WORD_BITS) {
+    word |= __atomic_load_n(&base[1], __ATOMIC_RELAXED) << (WORD_BITS - shift);
+  }
+  return word & lowmask(bit_count);
+}
+
+static inline void store_shared(bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count,
+                                const uint64_t value) {
+  assert(bit_count > 0 && bit_count <= WORD_BITS);
+  assert(bit_index + bit_count <= bitarray->bit_sz);
+  uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+  const uint64_t bits = value & lowmask(bit_count);
+
+  // Each word is retried until no other thread changed its other bits
+  // between our read and our write.
+  const size_t low_count = WORD_BITS - shift < bit_count ?
+                           WORD_BITS - shift : bit_count;
+  const uint64_t mask = lowmask(low_count) << shift;
+  uint64_t word = __atomic_load_n(&base[0], __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&base[0], &word,
+                                      (word & ~mask) | (bits << shift), true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  if (low_count < bit_count) {
+    const uint64_t spill_mask = lowmask(bit_count - low_count);
+    word = __atomic_load_n(&base[1], __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&base[1], &word,
+                                        (word & ~spill_mask) |
+                                        (bits >> low_count), true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+  }
+}
+
+static inline void extract_words(uint64_t* const words,
+                                 const bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const size_t word_count) {
+  assert(bit_index + word_count * WORD_BITS <= bitarray->bit_sz);
+  const uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+  if (shift == 0) {
+    memcpy(words, base, word_count * WORD_BYTES);
+    return;
+  }
+
+  // Each output word is the top of one stored word joined to the bottom of
+  // the next.  All word_count + 1 of them hold bits of the range.
+  bitarray_kernels->shift_right(words, base, shift, word_count);
+}
+
+static inline void deposit_words(bitarray_t* const bitarray,
+                                 const size_t bit_index,
+                                 const uint64_t* const words,
+                                 const size_t word_count) {
+  assert(bit_index + word_count * WORD_BITS <= bitarray->bit_sz);
+  if (word_count == 0) {
+    return;
+  }
+  uint64_t* const base = bitarray->buf + bit_index / WORD_BITS;
+  const size_t shift = bit_index % WORD_BITS;
+  if (shift == 0) {
+    memcpy(base, words, word_count * WORD_BYTES);
+    return;
+  }
+
+  // Only the first and the last word are shared with bits outside the
+  // range; everything in between is overwritten a whole word at a time.
+  const uint64_t keep = lowmask(shift);
+  base[0] = (base[0] & keep) | (words[0] << shift);
+  bitarray_kernels->shift_left(base + 1, words, shift, word_count - 1);
+  base[word_count] = (base[word_count] & ~keep) |
+                     (words[word_count - 1] >> (WORD_BITS - shift));
+}
+
+static inline void extract_bits(uint64_t* const words,
+                                const bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const size_t bit_count) {
+  const size_t word_count = bit_count / WORD_BITS;
+  const size_t spill = bit_count % WORD_BITS;
+  extract_words(words, bitarray, bit_index, word_count);
+  if (spill != 0) {
+    words[word_count] =
+      get_bits(bitarray, bit_index + word_count * WORD_BITS, spill);
   }
-  bitarray_set(bitarray, i, first_bit);
+}
+
+static inline void deposit_bits(bitarray_t* const bitarray,
+                                const size_t bit_index,
+                                const uint64_t* const words,
+                                const size_t bit_count) {
+  const size_t word_count = bit_count / WORD_BITS;
+  const size_t spill = bit_count % WORD_BITS;
+  deposit_words(bitarray, bit_index, words, word_count);
+  if (spill != 0) {
+    set_bits(bitarray, bit_index + word_count * WORD_BITS, spill,
+             words[word_count]);
+  }
+}
+
+static inline void rotate_left_in_register(bitarray_t* const bitarray,
+                                           const size_t bit_offset,
+                                           const size_t bit_length,
+                                           const size_t bit_left_amount,
+                                           const bool shared) {
+  // With the subarray packed low in an integer, a left rotation by k moves
+  // bit i + k down to bit i: the low k bits go to the top.
+  if (bit_length <= WORD_BITS) {
+    const uint64_t bits =
+      shared ? load_shared(bitarray, bit_offset, bit_length) :
+               get_bits(bitarray, bit_offset, bit_length);
+    const uint64_t rotated = (bits >> bit_left_amount) |
+                             (bits << (bit_length - bit_left_amount));
+    if (shared) {
+      store_shared(bitarray, bit_offset, bit_length, rotated);
+    } else {
+      set_bits(bitarray, bit_offset, bit_length, rotated);
+    }
+    return;
+  }
+#ifdef __SIZEOF_INT128__
+  const size_t high_length = bit_length - WORD_BITS;
+  const uint64_t low =
+    shared ? load_shared(bitarray, bit_offset, WORD_BITS) :
+             get_bits(bitarray, bit_offset, WORD_BITS);
+  const uint64_t high =
+    shared ? load_shared(bitarray, bit_offset + WORD_BITS, high_length) :
+             get_bits(bitarray, bit_offset + WORD_BITS, high_length);
+  const unsigned __int128 bits = low | (unsigned __int128) high << WORD_BITS;
+  const unsigned __int128 rotated = (bits >> bit_left_amount) |
+                                    (bits << (bit_length - bit_left_amount));
+  if (shared) {
+    store_shared(bitarray, bit_offset, WORD_BITS, (uint64_t) rotated);
+    store_shared(bitarray, bit_offset + WORD_BITS, high_length,
+                 (uint64_t) (rotated >> WORD_BITS));
+  } else {
+    set_bits(bitarray, bit_offset, WORD_BITS, (uint64_t) rotated);
+    set_bits(bitarray, bit_offset + WORD_BITS, high_length,
+             (uint64_t) (rotated >> WORD_BITS));
+  }
+#endif
+}
+
+static size_t gcd(size_t a, size_t b) {
+  while (b != 0) {
+    const size_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
 }
 
 static size_t modulo(const ssize_t n, const size_t m) {
   const ssize_t signed_m = (ssize_t)m;
   assert(signed_m > 0);
-  const ssize_t result = ((n % signed_m) + signed_m) % signed_m;
-  assert(result >= 0);
+  // Rotation amounts are usually smaller than the subarray, so only divide
+  // when they are not.
+  ssize_t result = n;
+  if (result >= signed_m || result <= -signed_m) {
+    result %= signed_m;
+  }
+  if (result < 0) {
+    result += signed_m;
+  }
+  assert(result >= 0 && result < signed_m);
   return (size_t)result;
 }
 
-static char bitmask(const size_t bit_index) {
-  return 1 << (bit_index % 8);
+static inline uint64_t bitmask(const size_t bit_index) {
+  return UINT64_C(1) << (bit_index % WORD_BITS);
+}
+
+static void init_header(bitarray_t* const bitarray,
+                        uint64_t* const buf,
+                        const size_t bit_sz) {
+  bitarray->buf = buf;
+  bitarray->map_bytes = 0;
+  bitarray->file_backed = false;
+  bitarray->in_arena = false;
+  bitarray->bit_sz = bit_sz;
+  bitarray->lazy = false;
+  bitarray->view_count = 0;
+  bitarray->segmented = false;
+  bitarray->segments = NULL;
+  bitarray->segment_count = 0;
+  bitarray->segment_capacity = 0;
+  bitarray->concurrent = false;
+  bitarray->held_ranges = NULL;
+  bitarray->origin = NULL;
+  bitarray->saved = NULL;
+  bitarray->snapshot_count = 0;
+  bitarray->snapshots = NULL;
+  bitarray->next_snapshot = NULL;
+}
+
+static inline void preserve_for_snapshots(bitarray_t* const bitarray,
+                                          const size_t bit_index,
+                                          const size_t bit_count) {
+  // Arrays nobody has a snapshot of pay for this one load.
+  if (bit_count == 0 ||
+      __atomic_load_n(&bitarray->snapshot_count, __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  save_chunks(bitarray, bit_index / SNAPSHOT_CHUNK_BITS,
+              (bit_index + bit_count - 1) / SNAPSHOT_CHUNK_BITS + 1);
+}
+
+static void save_chunks(bitarray_t* const bitarray,
+                        const size_t first_chunk,
+                        const size_t end_chunk) {
+  const size_t buf_bytes = buffer_bytes(bitarray->bit_sz);
+  const char* const from = (const char*)bitarray->buf;
+  pthread_mutex_lock(&snapshot_lock);
+  for (bitarray_t* snapshot = bitarray->snapshots; snapshot != NULL;
+       snapshot = snapshot->next_snapshot) {
+    char* const to = (char*)snapshot->buf;
+    for (size_t c = first_chunk; c < end_chunk; c++) {
+      if (__atomic_load_n(&snapshot->saved[c], __ATOMIC_RELAXED)) {
+        continue;
+      }
+      const size_t start = c * SNAPSHOT_CHUNK_BYTES;
+      const size_t bytes = buf_bytes - start < SNAPSHOT_CHUNK_BYTES ?
+                           buf_bytes - start : SNAPSHOT_CHUNK_BYTES;
+      memcpy(to + start, from + start, bytes);
+      // Readers that see the flag see the copy.
+      __atomic_store_n(&snapshot->saved[c], 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&snapshot_lock);
+  // The caller's writes to the chunks must not become visible before the
+  // flags; see run_moved.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline const bitarray_t* run_source(const bitarray_t* const bitarray,
+                                           const size_t bit_index,
+                                           size_t* const run_length) {
+  if (bitarray->saved == NULL) {
+    return bitarray;
+  }
+  const size_t chunk = bit_index / SNAPSHOT_CHUNK_BITS;
+  const size_t chunk_left = (chunk + 1) * SNAPSHOT_CHUNK_BITS - bit_index;
+  if (*run_length > chunk_left) {
+    *run_length = chunk_left;
+  }
+  return __atomic_load_n(&bitarray->saved[chunk], __ATOMIC_ACQUIRE) ?
+         bitarray : bitarray->origin;
 }
 
+static inline bool run_moved(const bitarray_t* const bitarray,
+                             const size_t bit_index) {
+  // The original sets the flag before it writes to the chunk.  If our read
+  // saw any of those writes, this load sees the flag.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&bitarray->saved[bit_index / SNAPSHOT_CHUNK_BITS],
+                         __ATOMIC_RELAXED) != 0;
+}
@@ -25,28 +25,262 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ********************************* Macros *********************************
+
+// The version of the interface declared here.  The major version changes
+// whenever code built against an earlier one could break, and is part of the
+// shared library's soname; the minor one whenever something is added.
+#define BITARRAY_VERSION_MAJOR 1
+#define BITARRAY_VERSION_MINOR 0
+#define BITARRAY_VERSION_PATCH 0
+#define BITARRAY_VERSION (BITARRAY_VERSION_MAJOR * 10000 +                  \
+                          BITARRAY_VERSION_MINOR * 100 +                    \
+                          BITARRAY_VERSION_PATCH)
 
 // ********************************* Types **********************************
 
 // Abstract data type representing an array of bits.
 typedef struct bitarray bitarray_t;
 
+// A pool that bit arrays can be carved out of, and given back all at once.
+typedef struct bitarray_arena bitarray_arena_t;
+
+// The algorithms bitarray_rotate_with_strategy can move bits with.  All of
+// them produce the same result; they differ only in how memory is touched.
+typedef enum {
+  // Let the implementation pick, as bitarray_rotate does.
+  BITARRAY_ROTATE_AUTO = 0,
+
+  // Three in-place reversals.  Every bit is read and written about twice,
+  // but always in sequential order.
+  BITARRAY_ROTATE_REVERSAL,
+
+  // Follow the cycles of the rotation, moving whole blocks of adjacent
+  // cycles at once.  Every bit is written exactly once, in strided order.
+  // Works best when gcd(bit_length, amount) is large.  The blocks are
+  // gcd(bit_length, amount) bits wide, so rotations where that is less
+  // than 64 would rewrite each word bit by bit; they are reversed instead.
+  BITARRAY_ROTATE_CYCLE_LEADER,
+
+  // Set the shorter side aside in a scratch buffer, slide the longer side
+  // over in one pass, and write the short side back.  Every bit is moved
+  // about once, sequentially, but needs scratch space for the short side.
+  BITARRAY_ROTATE_SHIFT_COPY,
+} bitarray_rotate_strategy_t;
+
+// One rotation of a batch passed to bitarray_rotate_batch.  The fields are
+// the arguments of the corresponding bitarray_rotate call.
+typedef struct {
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+} bitarray_rotation_t;
+
+// Names a rotation submitted with bitarray_rotate_async.  Tickets are handed
+// out in increasing order, across all bit arrays.
+typedef uint64_t bitarray_ticket_t;
+
+// Called once a rotation submitted with bitarray_rotate_async has been
+// carried out, with the context it was submitted with.
+typedef void (*bitarray_rotate_callback_t)(void* const context);
+
+// Flags for bitarray_open_mmap, to be ORed together.
+typedef enum {
+  // Create the file if it does not exist, and grow it if it is too short.
+  BITARRAY_MMAP_CREATE = 1 << 0,
+
+  // Map the file copy-on-write: the array starts out with the file's bits,
+  // but changes are never written back.  The file is opened read-only.
+  BITARRAY_MMAP_PRIVATE = 1 << 1,
+} bitarray_mmap_flags_t;
+
+// How bitarray_save encodes the bits of a bit array in the file.
+typedef enum {
+  // The words as they are laid out in memory, so bitarray_load_mmap can map
+  // them.
+  BITARRAY_CODEC_RAW = 0,
+
+  // Runs of equal 64-bit words stored once, with the other words in
+  // between stored as they are.  Sparse and mostly-set arrays shrink to a
+  // few words; arrays without runs grow by a word.
+  BITARRAY_CODEC_RLE,
+} bitarray_codec_t;
+
+// The pages bitarray_new backs a bit array's buffer with.
+typedef enum {
+  // Whatever the C library's allocator hands out.
+  BITARRAY_PAGES_DEFAULT = 0,
+
+  // Regular pages, but aligned and marked so that the kernel may back them
+  // with transparent 2 MB huge pages.
+  BITARRAY_PAGES_TRANSPARENT,
+
+  // Explicit 2 MB or 1 GB huge pages from the kernel's reserved pool.
+  // Buffers fall back to transparent huge pages when the pool runs dry.
+  BITARRAY_PAGES_HUGE_2MB,
+  BITARRAY_PAGES_HUGE_1GB,
+} bitarray_pages_t;
+
+// Which NUMA nodes bitarray_new places a bit array's buffer on.
+typedef enum {
+  // Wherever the kernel's default policy puts each page when first touched.
+  BITARRAY_NUMA_DEFAULT = 0,
+
+  // On the node of the thread that first touches each page.
+  BITARRAY_NUMA_LOCAL,
+
+  // Round-robin across every node the process may use.
+  BITARRAY_NUMA_INTERLEAVE,
+} bitarray_numa_t;
+
+// How bitarray_new allocates the buffers of new bit arrays.
+typedef struct {
+  bitarray_pages_t pages;
+  bitarray_numa_t numa;
+
+  // If more than 1, the buffer is zeroed by this many threads, each
+  // touching the pages bitarray_rotate_parallel with the same thread count
+  // hands to it: band t of the first half of the buffer and its mirror
+  // image in the second half.  With BITARRAY_NUMA_LOCAL, every worker of a
+  // parallel rotation of the whole array then finds its bands on its own
+  // node, as long as the threads stay where they ran.
+  size_t first_touch_threads;
+} bitarray_alloc_policy_t;
+
 // ******************************* Prototypes *******************************
 
+// The library is built with every symbol hidden but those declared here.
+#ifdef __GNUC__
+  #pragma GCC visibility push(default)
+#endif
+
+// Returns BITARRAY_VERSION as it was when the library was built, for
+// programs linked against the shared library to check against the header
+// they were compiled with.
+unsigned bitarray_version(void);
+
 // Allocates space for a new bit array.
 // bit_sz is the number of bits storable in the resultant bit array
 bitarray_t* bitarray_new(const size_t bit_sz);
 
-// Frees a bit array allocated by bitarray_new.
+// Opens a bit array of bit_sz bits backed by a memory mapping of the file at
+// path, for arrays too large to load or build in memory.  flags is a
+// combination of bitarray_mmap_flags_t values.  Returns NULL, with errno
+// set, if the file cannot be opened or mapped, or is shorter than
+// ceil(bit_sz / 8) bytes and may not be grown.
+//
+// The file holds the bits in the layout used in memory: on little-endian
+// machines, bit n is bit (n mod 8) of byte floor(n/8).  Pages are read in
+// only when touched, and rotations of large subarrays sweep the mapping in
+// sequential windows that are hinted to the kernel ahead of use.  Changes
+// reach the file as the kernel writes the pages back, at the latest when
+// the array is freed.
+bitarray_t* bitarray_open_mmap(const char* const path,
+                               const size_t bit_sz,
+                               const int flags);
+
+// Carries out any recorded rotations and, for an array made by
+// bitarray_open_mmap without BITARRAY_MMAP_PRIVATE, waits until every change
+// has been written to the file.  Returns false if writing failed.
+bool bitarray_sync(bitarray_t* const bitarray);
+
+// Writes the bits of a bit array to a new file at path (replacing any file
+// there), encoded with codec.  The file starts with a header recording the
+// format version, the byte order and bit_sz; the encoded bits follow at an
+// offset that is a multiple of the page size.  The words of an array in
+// memory are handed to writev straight from its buffer.  Returns false,
+// with errno set, if the file cannot be written.
+bool bitarray_save(const bitarray_t* const bitarray,
+                   const char* const path,
+                   const bitarray_codec_t codec);
+
+// Reads a bit array written by bitarray_save into a new array allocated
+// with bitarray_new, reading the bits straight into its buffer.  Returns
+// NULL, with errno set, if the file cannot be read or memory runs out;
+// errno is EINVAL if the file is not one bitarray_save wrote on a machine
+// of the same byte order, or is cut short.
+bitarray_t* bitarray_load(const char* const path);
+
+// Opens a bit array written by bitarray_save with BITARRAY_CODEC_RAW as a
+// mapping of the file, as bitarray_open_mmap does for a file of bare bits;
+// nothing is read until touched.  flags is 0 or BITARRAY_MMAP_PRIVATE.
+// Returns NULL, with errno set, as bitarray_load does, and with errno
+// EINVAL also if the file is encoded otherwise or its bits do not start on
+// a page boundary here.
+bitarray_t* bitarray_load_mmap(const char* const path, const int flags);
+
+// Creates an arena that hands out memory for bit arrays from slabs of
+// slab_bytes bytes (or a sensible default, if slab_bytes is 0).  An arena
+// must only be used by one thread at a time.
+bitarray_arena_t* bitarray_arena_new(const size_t slab_bytes);
+
+// Allocates a bit array of bit_sz bits in an arena.  Its header and buffer
+// share one contiguous block carved from a slab, so making it costs no call
+// to the C library's allocator once the arena has warmed up; arrays too big
+// for a slab get a block of their own.  The array stays valid until the
+// arena is reset or freed; calling bitarray_free on it does nothing.
+bitarray_t* bitarray_new_in(bitarray_arena_t* const arena, const size_t bit_sz);
+
+// Invalidates every bit array allocated in an arena at once, keeping its
+// slabs for the arrays allocated next.
+void bitarray_arena_reset(bitarray_arena_t* const arena);
+
+// Frees an arena and with it every bit array allocated in it.
+void bitarray_arena_free(bitarray_arena_t* const arena);
+
+// Frees a bit array allocated by bitarray_new or bitarray_open_mmap.  Its
+// snapshots stay valid.
 void bitarray_free(bitarray_t* const bitarray);
 
+// Takes a snapshot of a bit array: a read-only bit array that keeps the
+// bits the original holds now, whatever is done to the original later.
+// Snapshots are read with bitarray_get, bitarray_get_range, bitarray_count,
+// bitarray_find_next and bitarray_get_bit_sz, and can be the source of
+// bitarray_copy.  Returns NULL if there is not enough memory.
+//
+// Taking a snapshot copies no bits.  The snapshot shares the original's
+// buffer in 4 KB chunks, and each chunk is copied into the snapshot just
+// before the original first writes to it.  A snapshot costs memory and time
+// for the chunks written to since it was taken, not for the whole array.
+//
+// A snapshot may be read on one thread while another thread writes to the
+// original.  Taking the snapshot, and freeing the original, must not
+// overlap with anything else done to the original or its snapshots.
+// Snapshots of an array in an arena must be freed before the arena is
+// reset or freed.
+const bitarray_t* bitarray_snapshot(bitarray_t* const bitarray);
+
+// Frees a snapshot made by bitarray_snapshot.
+void bitarray_snapshot_free(const bitarray_t* const snapshot);
+
 // Returns the number of bits stored in a bit array.
 // Note the invariant bitarray_get_bit_sz(bitarray_new(n)) = n.
 size_t bitarray_get_bit_sz(const bitarray_t* const bitarray);
 
-// Does a random fill of all the bits in the bit array.
+// Does a random fill of all the bits in the bit array.  The seed is drawn
+// from rand(), so srand determines the bits.
 void bitarray_randfill(bitarray_t* const bitarray);
 
+// Fills the bit array with random bits determined by seed alone.  The bits
+// come from interleaved xoshiro256** generators, which the vector kernels
+// run several at a time.
+void bitarray_randfill_with_seed(bitarray_t* const bitarray,
+                                 const uint64_t seed);
+
+// Fills the bit array exactly like bitarray_randfill_with_seed, splitting
+// the work across up to thread_count threads (including the calling one).
+// The bits are the same whatever thread_count is.
+void bitarray_randfill_parallel(bitarray_t* const bitarray,
+                                const uint64_t seed,
+                                const size_t thread_count);
+
 // Indexes into a bit array, retreiving the bit at the specified zero-based
 // index.
 bool bitarray_get(const bitarray_t* const bitarray, const size_t bit_index);
@@ -56,6 +290,52 @@ void bitarray_set(bitarray_t* const bitarray,
                   const size_t bit_index,
                   const bool value);
 
+// Copies the bit_length bits starting at bit_offset into words, packed so
+// that bit bit_offset + i of the array lands in bit (i mod 64) of
+// words[i / 64].  words must have room for ceil(bit_length / 64) words; the
+// unused high bits of the last one are zeroed.
+void bitarray_get_range(const bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        uint64_t* const words);
+
+// Overwrites the bit_length bits starting at bit_offset with bits packed as
+// bitarray_get_range produces them.  The unused high bits of the last word
+// are ignored.
+void bitarray_set_range(bitarray_t* const bitarray,
+                        const size_t bit_offset,
+                        const size_t bit_length,
+                        const uint64_t* const words);
+
+// Sets every bit of the bit_length bits starting at bit_offset to value.
+void bitarray_fill(bitarray_t* const bitarray,
+                   const size_t bit_offset,
+                   const size_t bit_length,
+                   const bool value);
+
+// Copies the bit_length bits starting at src_offset in src to dst_offset in
+// dst.  src and dst may be the same bit array, in which case the copy
+// behaves like memmove: overlapping ranges end up holding what the source
+// range held beforehand.
+void bitarray_copy(bitarray_t* const dst,
+                   const size_t dst_offset,
+                   const bitarray_t* const src,
+                   const size_t src_offset,
+                   const size_t bit_length);
+
+// Returns the number of set bits among the bit_length bits starting at
+// bit_offset.
+size_t bitarray_count(const bitarray_t* const bitarray,
+                      const size_t bit_offset,
+                      const size_t bit_length);
+
+// Returns the index of the first bit at or after bit_index that equals
+// value, or bitarray_get_bit_sz(bitarray) if there is none.  bit_index may
+// be anything up to and including the size of the array.
+size_t bitarray_find_next(const bitarray_t* const bitarray,
+                          const size_t bit_index,
+                          const bool value);
+
 // Rotates a subarray.
 //
 // bit_offset is the index of the start of the subarray
@@ -85,4 +365,235 @@ void bitarray_rotate(bitarray_t* const bitarray,
                      const size_t bit_length,
                      const ssize_t bit_right_amount);
 
+// Rotates a subarray exactly like bitarray_rotate, but with the given
+// strategy rather than the one bitarray_rotate would pick.  (With
+// BITARRAY_ROTATE_AUTO, subarrays of up to 128 bits skip the strategies
+// altogether and are rotated in registers, on compilers with 128-bit
+// integers; otherwise up to 64 bits.)
+void bitarray_rotate_with_strategy(bitarray_t* const bitarray,
+                                   const size_t bit_offset,
+                                   const size_t bit_length,
+                                   const ssize_t bit_right_amount,
+                                   bitarray_rotate_strategy_t strategy);
+
+// Rotates a subarray exactly like bitarray_rotate, splitting the work
+// across up to thread_count threads (including the calling one).
+//
+// Every thread works on its own cache-line-aligned bands of the subarray, so
+// the speedup is close to linear until memory bandwidth runs out.  Short
+// subarrays, and thread_count of 0 or 1, fall back to bitarray_rotate on the
+// calling thread.  No other thread may access the bit array meanwhile.
+void bitarray_rotate_parallel(bitarray_t* const bitarray,
+                              const size_t bit_offset,
+                              const size_t bit_length,
+                              const ssize_t bit_right_amount,
+                              const size_t thread_count);
+
+// Rotates count fields of field_len bits each right by bit_right_amount, as
+// count calls to bitarray_rotate would: field i spans
+// [first_offset + i * stride, first_offset + i * stride + field_len).  The
+// fields must not overlap, so stride is at least field_len unless count is 1.
+//
+// This suits arrays of packed records, rotating one field of every record.
+// When the stride divides 64 and no field straddles a word, whole words are
+// rewritten at once, rotating every field in them together.
+void bitarray_rotate_strided(bitarray_t* const bitarray,
+                             const size_t first_offset,
+                             const size_t field_len,
+                             const size_t stride,
+                             const size_t count,
+                             const ssize_t bit_right_amount);
+
+// Like bitarray_rotate_strided, but splits the fields among up to
+// thread_count threads when there are enough bits in them to be worth it.
+void bitarray_rotate_strided_parallel(bitarray_t* const bitarray,
+                                      const size_t first_offset,
+                                      const size_t field_len,
+                                      const size_t stride,
+                                      const size_t count,
+                                      const ssize_t bit_right_amount,
+                                      const size_t thread_count);
+
+// Performs count rotations, leaving the bit array exactly as calling
+// bitarray_rotate on each of them in order would.
+//
+// The batch is planned before anything moves: consecutive rotations of the
+// same subarray are folded into one, and rotations of disjoint subarrays are
+// reordered to sweep through memory once from front to back.
+void bitarray_rotate_batch(bitarray_t* const bitarray,
+                           const bitarray_rotation_t* const rotations,
+                           const size_t count);
+
+// Like bitarray_rotate_batch, but runs rotations of disjoint subarrays on up
+// to thread_count threads at once, and splits large lone rotations as
+// bitarray_rotate_parallel does.  The rotations of a lazy or segmented bit
+// array run on one thread: each of them only records a view in the array,
+// or splices its segments.
+void bitarray_rotate_batch_parallel(bitarray_t* const bitarray,
+                                    const bitarray_rotation_t* const rotations,
+                                    const size_t count,
+                                    const size_t thread_count);
+
+// Queues the rotation that bitarray_rotate(bitarray, bit_offset, bit_length,
+// bit_right_amount) would carry out, and returns without waiting for it.
+// A pool of worker threads, started by the first call, carries the queued
+// rotations out; done, unless it is NULL, is then called on the worker with
+// context.  Returns a ticket for bitarray_async_wait and bitarray_async_poll.
+//
+// The rotations of one array are carried out, and their callbacks called,
+// in the order they were submitted, so the array ends up as if each had been
+// performed by the call that submitted it.  Whatever is queued for an array
+// by the time a worker gets to it goes through bitarray_rotate_batch at
+// once; arrays are served by different workers at the same time.
+//
+// While an array has rotations in flight, nothing else may be done with it
+// but submitting more; bitarray_async_drain waits for them, and must be
+// called before the array is freed.  Callbacks must not wait for rotations.
+// Without the memory or threads to queue the rotation, it is carried out
+// before this returns.
+bitarray_ticket_t bitarray_rotate_async(bitarray_t* const bitarray,
+                                        const size_t bit_offset,
+                                        const size_t bit_length,
+                                        const ssize_t bit_right_amount,
+                                        const bitarray_rotate_callback_t done,
+                                        void* const context);
+
+// Returns whether the rotation of bitarray with the given ticket, and every
+// one submitted for it before, has been carried out and had its callback
+// called.
+bool bitarray_async_poll(const bitarray_t* const bitarray,
+                         const bitarray_ticket_t ticket);
+
+// Waits until bitarray_async_poll(bitarray, ticket) would return true.
+void bitarray_async_wait(const bitarray_t* const bitarray,
+                         const bitarray_ticket_t ticket);
+
+// Waits until every rotation submitted for bitarray is done.  The array may
+// then be used, and freed, as usual.
+void bitarray_async_drain(bitarray_t* const bitarray);
+
+// Waits until every rotation submitted for any array is done, and stops the
+// worker pool.  The next submission starts it again.  Must not be called
+// while rotations are being submitted.
+void bitarray_async_shutdown(void);
+
+// Makes a bit array lazy, or eager again.
+//
+// A lazy bit array does not move any bits when bitarray_rotate is called;
+// it records the rotation as a view of the subarray and remaps the indices
+// bitarray_get and bitarray_set are given through it instead.  Further
+// rotations of the same subarray just adjust the view, and rotations of
+// disjoint subarrays get views of their own.  The array is physically
+// rotated when bitarray_materialize is called, when a rotation overlaps a
+// recorded one without matching it, when more than a handful of views pile
+// up, or when an operation needs the bits in place (such as
+// bitarray_rotate_parallel or an explicit rotation strategy).
+//
+// Making an array eager materializes it.  New arrays are eager.
+void bitarray_set_lazy(bitarray_t* const bitarray, const bool lazy);
+
+// Returns whether a bit array is lazy.
+bool bitarray_get_lazy(const bitarray_t* const bitarray);
+
+// Carries out every rotation a lazy bit array has recorded, and compacts a
+// segmented one, so that its memory holds the bits in order.  Does nothing
+// to an eager flat array.
+void bitarray_materialize(bitarray_t* const bitarray);
+
+// Makes a bit array segmented, or flat again.
+//
+// A segmented bit array keeps its bits as a sequence of segments, runs of
+// its buffer in any order.  bitarray_rotate (and bitarray_rotate_parallel)
+// of a long subarray moves no bits: it splits the segments at the ends of
+// the subarray and where the rotation wraps around, and swaps the two sides.
+// A rotation costs time in the number of segments, however long it is.
+// Short rotations within one segment still move the bits in the buffer.
+//
+// Every other access binary-searches for the segments holding its bits, so
+// random access gets slower as segments pile up.  Past a few thousand of
+// them the array is compacted: its bits are gathered in order into a new
+// buffer, or into a temporary one for arrays in files and arenas.  An
+// operation that needs the bits in order (bitarray_rotate_strided, an
+// explicit rotation strategy, bitarray_copy within one array) compacts the
+// array too, and so does making it flat.  New arrays are flat.  A segmented
+// array is never lazy as well; its rotations are spliced instead.
+void bitarray_set_segmented(bitarray_t* const bitarray, const bool segmented);
+
+// Returns whether a bit array is segmented.
+bool bitarray_get_segmented(const bitarray_t* const bitarray);
+
+// Makes a bit array concurrent, or not.
+//
+// Any number of threads may call bitarray_rotate,
+// bitarray_rotate_with_strategy and bitarray_rotate_parallel on one
+// concurrent bit array at once.  Each rotation waits only for the rotations
+// in flight whose subarrays overlap its own, and then runs alongside the
+// others.  Subarrays that merely share a word, one ending in it and the
+// next starting in it, do not wait for each other: the bits of such words
+// are written with compare-and-swap, and the words in between belong to
+// the one rotation.  Rotations of disjoint subarrays scale with the cores
+// that run them.
+//
+// Nothing else is synchronized: every other call on the array, including
+// reads and this one, needs it to itself.  Making an array concurrent makes
+// it eager and flat, since views and segments would be shared by every
+// rotation, and a concurrent array cannot be made lazy or segmented.  New
+// arrays are not concurrent.
+void bitarray_set_concurrent(bitarray_t* const bitarray,
+                             const bool concurrent);
+
+// Sets the most scratch space, in bits, bitarray_rotate may use to hold the
+// shorter side of a rotation for BITARRAY_ROTATE_SHIFT_COPY.  Rotations whose
+// shorter side is longer than this use another strategy.  A few thousand
+// bits are kept on the stack; larger limits are served from the heap.
+//
+// This limit only affects the choice bitarray_rotate makes;
+// bitarray_rotate_with_strategy always honors an explicit
+// BITARRAY_ROTATE_SHIFT_COPY.
+void bitarray_set_scratch_limit(const size_t bit_limit);
+
+// Returns the limit set by bitarray_set_scratch_limit.
+size_t bitarray_get_scratch_limit(void);
+
+// Sets how bitarray_new allocates the buffers of bit arrays made from now
+// on.  Huge pages cut the TLB misses of rotations over large arrays.
+// Requests the system cannot honor, such as huge pages or NUMA placement on
+// a platform without them, quietly fall back to the default.  The default
+// policy is all defaults.
+void bitarray_set_alloc_policy(const bitarray_alloc_policy_t* const policy);
+
+// Returns the policy set by bitarray_set_alloc_policy.
+bitarray_alloc_policy_t bitarray_get_alloc_policy(void);
+
+// Returns the name of the word kernels the rotations run on: "avx512",
+// "avx2", "neon" or "portable".  The best set the CPU supports is picked
+// when the program starts; the EVERYBIT_KERNELS environment variable can name
+// a different one.
+const char* bitarray_get_kernels(void);
+
+// Switches to the named word kernels.  Returns false, and changes nothing, if
+// this build has no such set or the CPU cannot run it.  Must not be called
+// while another thread is operating on a bit array.
+bool bitarray_set_kernels(const char* const name);
+
+// Writes to stream what the rotations since the program started, or since
+// the last bitarray_stats_reset, were carried out with: for each strategy,
+// the number of calls, bits rotated, bytes touched, time spent in each
+// phase, word alignment of the subarrays and a histogram of their lengths.
+// Returns false, and writes nothing, unless the library was built with
+// BITARRAY_STATS defined ("make STATS=1"); gathering the statistics costs a
+// few clock reads per rotation.
+bool bitarray_stats_dump(FILE* const stream);
+
+// Clears the statistics reported by bitarray_stats_dump.
+void bitarray_stats_reset(void);
+
+#ifdef __GNUC__
+  #pragma GCC visibility pop
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif  // BITARRAY_H
@@ -0,0 +1,364 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements bitarray_rotate_async, and the calls that wait for it, on top
+// of the API in bitarray.h, with a pool of worker threads started by the
+// first submission.
+//
+// Every bit array with rotations submitted has a stream: the rotations
+// waiting to be carried out, in the order they were submitted.  One worker
+// at a time serves a stream.  It takes everything queued so far, up to
+// ASYNC_MAX_BATCH rotations, and carries it out with one call to
+// bitarray_rotate_batch, which leaves the array as the rotations one after
+// another would.  Then it runs their callbacks in order, and puts the
+// stream back at the end of the ready list if more has been queued since.
+// Different arrays are served by different workers at once.
+
+#include "./bitarray.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+
+
+// ********************************* Macros *********************************
+
+// The threads of the worker pool.
+#define ASYNC_WORKER_COUNT 4
+
+// A worker takes no more than this many rotations of a stream at a time,
+// so that the callbacks of the first ones are not held up too long.
+#define ASYNC_MAX_BATCH 256
+
+
+// ********************************* Types **********************************
+
+// A rotation submitted with bitarray_rotate_async, waiting in its stream.
+typedef struct async_request {
+  bitarray_rotation_t rotation;
+  bitarray_ticket_t ticket;
+  bitarray_rotate_callback_t done;
+  void* context;
+  struct async_request* next;
+} async_request_t;
+
+// The rotations of one bit array that are queued or being carried out.
+typedef struct async_stream {
+  bitarray_t* bitarray;
+  // The queued rotations, oldest first, and the link to the next one.
+  async_request_t* head;
+  async_request_t** tail;
+  // The tickets of the last rotation of the array submitted, and of the
+  // last one carried out with its callback run.  Every ticket of the array
+  // up to completed is done.
+  bitarray_ticket_t submitted;
+  bitarray_ticket_t completed;
+  // Whether a worker is serving the stream, and whether it is waiting on
+  // the ready list for one.
+  bool busy;
+  bool ready;
+  struct async_stream* next_ready;
+  struct async_stream* next;
+} async_stream_t;
+
+
+// ******************************** Globals *********************************
+
+// Guards everything below.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled when a stream is put on the ready list, and broadcast when the
+// pool is stopping.
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+
+// Broadcast whenever a worker has finished rotations of a stream.
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+
+// Every stream, and the streams with rotations queued that no worker is
+// serving, in the order they will be served.
+static async_stream_t* streams;
+static async_stream_t* ready_head;
+static async_stream_t* ready_tail;
+
+// The ticket handed out last, to whichever array.
+static bitarray_ticket_t last_ticket;
+
+// The workers running, and whether they have been told to stop.
+static pthread_t workers[ASYNC_WORKER_COUNT];
+static size_t worker_count;
+static bool stopping;
+
+
+// ******************** Prototypes for static functions *********************
+
+// Serves streams from the ready list until the pool stops and the list is
+// empty.
+static void* async_worker(void* const arg);
+
+// Starts the workers if none are running.  Called with pool_lock held.
+static void start_workers(void);
+
+// Returns the stream of bitarray, or NULL if it has none.  Called with
+// pool_lock held.
+static async_stream_t* find_stream(const bitarray_t* const bitarray);
+
+// Waits until every rotation submitted for bitarray is done, and frees its
+// stream.  Called with pool_lock held.
+static void drain_locked(bitarray_t* const bitarray);
+
+// Appends stream to the ready list and wakes a worker for it.  Called with
+// pool_lock held.
+static void make_ready(async_stream_t* const stream);
+
+
+// ******************************* Functions ********************************
+
+bitarray_ticket_t bitarray_rotate_async(bitarray_t* const bitarray,
+                                        const size_t bit_offset,
+                                        const size_t bit_length,
+                                        const ssize_t bit_right_amount,
+                                        const bitarray_rotate_callback_t done,
+                                        void* const context) {
+  assert(bit_offset + bit_length <= bitarray_get_bit_sz(bitarray));
+  async_request_t* const request = malloc(sizeof(async_request_t));
+  pthread_mutex_lock(&pool_lock);
+  start_workers();
+  async_stream_t* stream = find_stream(bitarray);
+  if (stream == NULL && request != NULL && worker_count != 0) {
+    stream = malloc(sizeof(async_stream_t));
+    if (stream != NULL) {
+      stream->bitarray = bitarray;
+      stream->head = NULL;
+      stream->tail = &stream->head;
+      stream->submitted = last_ticket;
+      stream->completed = last_ticket;
+      stream->busy = false;
+      stream->ready = false;
+      stream->next = streams;
+      streams = stream;
+    }
+  }
+  const bitarray_ticket_t ticket = ++last_ticket;
+
+  if (request == NULL || stream == NULL || worker_count == 0) {
+    // Without the memory or the threads to queue the rotation, carry it
+    // out here, once the ones before it are done.  Nobody can submit
+    // another in the meantime.
+    free(request);
+    drain_locked(bitarray);
+    bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    pthread_mutex_unlock(&pool_lock);
+    if (done != NULL) {
+      done(context);
+    }
+    return ticket;
+  }
+
+  request->rotation.bit_offset = bit_offset;
+  request->rotation.bit_length = bit_length;
+  request->rotation.bit_right_amount = bit_right_amount;
+  request->ticket = ticket;
+  request->done = done;
+  request->context = context;
+  request->next = NULL;
+  *stream->tail = request;
+  stream->tail = &request->next;
+  stream->submitted = ticket;
+  if (!stream->busy && !stream->ready) {
+    make_ready(stream);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return ticket;
+}
+
+bool bitarray_async_poll(const bitarray_t* const bitarray,
+                         const bitarray_ticket_t ticket) {
+  pthread_mutex_lock(&pool_lock);
+  const async_stream_t* const stream = find_stream(bitarray);
+  const bool done = stream == NULL || stream->completed >= ticket;
+  pthread_mutex_unlock(&pool_lock);
+  return done;
+}
+
+void bitarray_async_wait(const bitarray_t* const bitarray,
+                         const bitarray_ticket_t ticket) {
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    const async_stream_t* const stream = find_stream(bitarray);
+    if (stream == NULL || stream->completed >= ticket) {
+      break;
+    }
+    pthread_cond_wait(&work_done, &pool_lock);
+  }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void bitarray_async_drain(bitarray_t* const bitarray) {
+  pthread_mutex_lock(&pool_lock);
+  drain_locked(bitarray);
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void bitarray_async_shutdown(void) {
+  pthread_mutex_lock(&pool_lock);
+  while (streams != NULL) {
+    drain_locked(streams->bitarray);
+  }
+  stopping = true;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&pool_lock);
+
+  for (size_t w = 0; w < worker_count; w++) {
+    pthread_join(workers[w], NULL);
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  worker_count = 0;
+  stopping = false;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+static void* async_worker(void* const arg) {
+  (void) arg;
+  bitarray_rotation_t rotations[ASYNC_MAX_BATCH];
+  pthread_mutex_lock(&pool_lock);
+  for (;;) {
+    while (ready_head == NULL && !stopping) {
+      pthread_cond_wait(&work_ready, &pool_lock);
+    }
+    async_stream_t* const stream = ready_head;
+    if (stream == NULL) {
+      break;
+    }
+    ready_head = stream->next_ready;
+    if (ready_head == NULL) {
+      ready_tail = NULL;
+    }
+    stream->ready = false;
+    stream->busy = true;
+
+    // Take the oldest rotations, leaving the rest queued.
+    async_request_t* const first = stream->head;
+    async_request_t* last = first;
+    size_t count = 0;
+    for (async_request_t* request = first;
+         request != NULL && count < ASYNC_MAX_BATCH;
+         request = request->next) {
+      rotations[count++] = request->rotation;
+      last = request;
+    }
+    stream->head = last->next;
+    if (stream->head == NULL) {
+      stream->tail = &stream->head;
+    }
+    last->next = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    // Only this worker touches the array until the stream is no longer
+    // busy.
+    bitarray_t* const bitarray = stream->bitarray;
+    if (count == 1) {
+      bitarray_rotate(bitarray, rotations[0].bit_offset,
+                      rotations[0].bit_length, rotations[0].bit_right_amount);
+    } else {
+      bitarray_rotate_batch(bitarray, rotations, count);
+    }
+    const bitarray_ticket_t completed = last->ticket;
+    for (async_request_t* request = first; request != NULL;) {
+      async_request_t* const next = request->next;
+      if (request->done != NULL) {
+        request->done(request->context);
+      }
+      free(request);
+      request = next;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    stream->completed = completed;
+    stream->busy = false;
+    if (stream->head != NULL) {
+      make_ready(stream);
+    }
+    pthread_cond_broadcast(&work_done);
+  }
+  pthread_mutex_unlock(&pool_lock);
+  return NULL;
+}
+
+static void start_workers(void) {
+  if (worker_count != 0) {
+    return;
+  }
+  // Whatever threads we can get will do; with none at all, submissions are
+  // carried out as they come.
+  for (size_t w = 0; w < ASYNC_WORKER_COUNT; w++) {
+    if (pthread_create(&workers[worker_count], NULL, async_worker,
+                       NULL) == 0) {
+      worker_count++;
+    }
+  }
+}
+
+static async_stream_t* find_stream(const bitarray_t* const bitarray) {
+  // Only arrays with rotations in flight, or not drained yet, have
+  // streams, so there are few to look through.
+  async_stream_t* stream = streams;
+  while (stream != NULL && stream->bitarray != bitarray) {
+    stream = stream->next;
+  }
+  return stream;
+}
+
+static void drain_locked(bitarray_t* const bitarray) {
+  for (;;) {
+    async_stream_t* const stream = find_stream(bitarray);
+    if (stream == NULL) {
+      return;
+    }
+    if (stream->completed == stream->submitted && !stream->busy) {
+      async_stream_t** link = &streams;
+      while (*link != stream) {
+        link = &(*link)->next;
+      }
+      *link = stream->next;
+      free(stream);
+      return;
+    }
+    pthread_cond_wait(&work_done, &pool_lock);
+  }
+}
+
+static void make_ready(async_stream_t* const stream) {
+  stream->ready = true;
+  stream->next_ready = NULL;
+  if (ready_tail == NULL) {
+    ready_head = stream;
+  } else {
+    ready_tail->next_ready = stream;
+  }
+  ready_tail = stream;
+  pthread_cond_signal(&work_ready);
+}
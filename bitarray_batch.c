@@ -0,0 +1,284 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements bitarray_rotate_batch and bitarray_rotate_batch_parallel on top
+// of the single-rotation API in bitarray.h.
+//
+// A batch is cut into runs of rotations on pairwise disjoint subarrays.  No
+// rotation in a run can affect another, so a run may be executed in any
+// order: here, in order of offset, so that memory is swept once from front
+// to back, or split across threads.  The runs themselves execute in batch
+// order.  A rotation of exactly the subarray of one already in the current
+// run is folded into it, the amounts adding modulo the length, so repeated
+// rotations of a range touch its memory only once.
+
+#include "./bitarray.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/types.h>
+
+
+// ********************************* Macros *********************************
+
+// Rotations run on different threads must be at least this many bits apart.
+// A rotation rewrites the partial words at the ends of its
+// subarray as a whole, so two subarrays that are merely disjoint may still
+// share memory that both write.
+#define BATCH_GAP_BITS 1024
+
+// bitarray_rotate_batch_parallel never runs more threads than this.
+#define BATCH_MAX_THREADS 64
+
+
+// ********************************* Types **********************************
+
+// A rotation in normalized form: left by left_amount, with
+// left_amount < bit_length.
+typedef struct {
+  size_t bit_offset;
+  size_t bit_length;
+  size_t left_amount;
+} pending_rotation_t;
+
+// A slice of a run that one thread executes.
+typedef struct {
+  bitarray_t* bitarray;
+  const pending_rotation_t* rotations;
+  size_t count;
+} batch_slice_t;
+
+
+// ******************** Prototypes for static functions *********************
+
+// Executes count rotations on pairwise disjoint subarrays, sorted by offset,
+// splitting them across up to thread_count threads.
+static void execute_run(bitarray_t* const bitarray,
+                        const pending_rotation_t* const run,
+                        const size_t count,
+                        size_t thread_count);
+
+// Executes one slice of a run in order; arg is a batch_slice_t.
+static void* execute_slice(void* const arg);
+
+// Executes a single normalized rotation.
+static void execute_rotation(bitarray_t* const bitarray,
+                             const pending_rotation_t* const rotation,
+                             const size_t thread_count);
+
+// Returns the index of the first rotation in run[0, count) whose offset is
+// not less than bit_offset.
+static size_t find_position(const pending_rotation_t* const run,
+                            const size_t count,
+                            const size_t bit_offset);
+
+// Returns the rotation amount in the range [0, m) that is equivalent to a
+// right rotation by n of a subarray of m bits, expressed as a left rotation.
+static size_t left_amount(const ssize_t n, const size_t m);
+
+
+// ******************************* Functions ********************************
+
+void bitarray_rotate_batch(bitarray_t* const bitarray,
+                           const bitarray_rotation_t* const rotations,
+                           const size_t count) {
+  bitarray_rotate_batch_parallel(bitarray, rotations, count, 1);
+}
+
+void bitarray_rotate_batch_parallel(bitarray_t* const bitarray,
+                                    const bitarray_rotation_t* const rotations,
+                                    const size_t count,
+                                    const size_t thread_count) {
+  // The views of a lazy array and the segment table of a segmented one are
+  // not synchronized, so their rotations cannot update them from several
+  // threads at once.
+  const size_t run_threads =
+    bitarray_get_lazy(bitarray) || bitarray_get_segmented(bitarray) ?
+    1 : thread_count;
+  pending_rotation_t* const run = malloc(count * sizeof(pending_rotation_t));
+  if (run == NULL) {
+    // Without room to plan, just do as we were told.
+    for (size_t i = 0; i < count; i++) {
+      bitarray_rotate(bitarray, rotations[i].bit_offset,
+                      rotations[i].bit_length, rotations[i].bit_right_amount);
+    }
+    return;
+  }
+
+  // The current run, kept sorted by offset.  Its subarrays are disjoint, so
+  // only the neighbors of a new subarray's position can overlap it.
+  size_t run_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    const bitarray_rotation_t* const rotation = &rotations[i];
+    assert(rotation->bit_offset + rotation->bit_length <=
+           bitarray_get_bit_sz(bitarray));
+    if (rotation->bit_length == 0) {
+      continue;
+    }
+    const size_t offset = rotation->bit_offset;
+    const size_t end = offset + rotation->bit_length;
+    const size_t amount = left_amount(rotation->bit_right_amount,
+                                      rotation->bit_length);
+
+    size_t position = find_position(run, run_count, offset);
+    if (position < run_count && run[position].bit_offset == offset &&
+        run[position].bit_length == rotation->bit_length) {
+      // Same subarray again: fold the amounts together.
+      pending_rotation_t* const same = &run[position];
+      same->left_amount = (same->left_amount + amount) % same->bit_length;
+      continue;
+    }
+    if (amount == 0) {
+      continue;
+    }
+
+    const bool overlaps_previous =
+      position > 0 &&
+      run[position - 1].bit_offset + run[position - 1].bit_length > offset;
+    const bool overlaps_next =
+      position < run_count && run[position].bit_offset < end;
+    if (overlaps_previous || overlaps_next) {
+      // This rotation depends on the current run; finish the run first.
+      execute_run(bitarray, run, run_count, run_threads);
+      run_count = 0;
+      position = 0;
+    }
+
+    memmove(&run[position + 1], &run[position],
+            (run_count - position) * sizeof(pending_rotation_t));
+    run[position].bit_offset = offset;
+    run[position].bit_length = rotation->bit_length;
+    run[position].left_amount = amount;
+    run_count++;
+  }
+  execute_run(bitarray, run, run_count, run_threads);
+  free(run);
+}
+
+static void execute_run(bitarray_t* const bitarray,
+                        const pending_rotation_t* const run,
+                        const size_t count,
+                        size_t thread_count) {
+  if (thread_count > BATCH_MAX_THREADS) {
+    thread_count = BATCH_MAX_THREADS;
+  }
+  if (count <= 1 || thread_count <= 1) {
+    // A lone rotation may still be split across threads by itself.
+    for (size_t i = 0; i < count; i++) {
+      execute_rotation(bitarray, &run[i], thread_count);
+    }
+    return;
+  }
+
+  // Cut the run into slices of about equal total length, but only where
+  // the gap between two neighboring subarrays is wide enough.
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    total += run[i].bit_length;
+  }
+  batch_slice_t slices[BATCH_MAX_THREADS];
+  size_t slice_count = 0;
+  size_t first = 0;
+  size_t done = 0;
+  for (size_t i = 0; i < count; i++) {
+    done += run[i].bit_length;
+    const bool last = i + 1 == count;
+    const bool full = done >= total / thread_count * (slice_count + 1);
+    const bool gap = !last &&
+                     run[i + 1].bit_offset >=
+                     run[i].bit_offset + run[i].bit_length + BATCH_GAP_BITS;
+    if (last || (full && gap && slice_count + 1 < thread_count)) {
+      slices[slice_count].bitarray = bitarray;
+      slices[slice_count].rotations = &run[first];
+      slices[slice_count].count = i + 1 - first;
+      slice_count++;
+      first = i + 1;
+    }
+  }
+
+  pthread_t threads[BATCH_MAX_THREADS];
+  bool started[BATCH_MAX_THREADS];
+  for (size_t s = 1; s < slice_count; s++) {
+    started[s] = pthread_create(&threads[s], NULL, execute_slice,
+                                &slices[s]) == 0;
+    if (!started[s]) {
+      execute_slice(&slices[s]);
+    }
+  }
+  execute_slice(&slices[0]);
+  for (size_t s = 1; s < slice_count; s++) {
+    if (started[s]) {
+      pthread_join(threads[s], NULL);
+    }
+  }
+}
+
+static void* execute_slice(void* const arg) {
+  const batch_slice_t* const slice = arg;
+  for (size_t i = 0; i < slice->count; i++) {
+    execute_rotation(slice->bitarray, &slice->rotations[i], 1);
+  }
+  return NULL;
+}
+
+static void execute_rotation(bitarray_t* const bitarray,
+                             const pending_rotation_t* const rotation,
+                             const size_t thread_count) {
+  if (rotation->left_amount == 0) {
+    return;
+  }
+  // A right rotation by length - k is a left rotation by k.
+  const ssize_t right_amount =
+    (ssize_t)(rotation->bit_length - rotation->left_amount);
+  if (thread_count > 1) {
+    bitarray_rotate_parallel(bitarray, rotation->bit_offset,
+                             rotation->bit_length, right_amount, thread_count);
+  } else {
+    bitarray_rotate(bitarray, rotation->bit_offset, rotation->bit_length,
+                    right_amount);
+  }
+}
+
+static size_t find_position(const pending_rotation_t* const run,
+                            const size_t count,
+                            const size_t bit_offset) {
+  size_t low = 0;
+  size_t high = count;
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (run[middle].bit_offset < bit_offset) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+static size_t left_amount(const ssize_t n, const size_t m) {
+  const ssize_t signed_m = (ssize_t)m;
+  return (size_t)((((-n) % signed_m) + signed_m) % signed_m);
+}
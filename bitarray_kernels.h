@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Word kernels the bit array operations are built from.  Each kernel has a
+// portable implementation and, where the hardware allows, vectorized ones;
+// bitarray_simd.c picks the best set the CPU supports when the program
+// starts.
+//
+// This header is internal to the bit array implementation.
+
+#ifndef BITARRAY_KERNELS_H
+#define BITARRAY_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// ********************************* Macros *********************************
+
+// Number of xoshiro256** generators the fill_random kernel runs side by
+// side.  Every kernel set produces the same words for the same states, so
+// this is part of what a seed means, not a tuning knob.
+#define RANDOM_LANES 8
+
+
+// ********************************* Types **********************************
+
+// A set of word kernels.
+//
+// The shift kernels read and write "word streams": the word at byte 8i of
+// the stream is the little-endian 64-bit value stored there, whatever the
+// alignment of the stream.
+typedef struct {
+  // The name by which bitarray_get_kernels reports this set.
+  const char* name;
+
+  // Reverses the order of the bits of a block of word_count words in place:
+  // word i becomes the bit reversal of what was word word_count - 1 - i.
+  void (*reverse_block)(uint64_t* const words, const size_t word_count);
+
+  // Funnel-shifts a word stream right into a block of words:
+  //   dst[i] = (src[i] >> shift) | (src[i + 1] << (64 - shift))
+  // for 0 <= i < word_count, reading word_count + 1 source words.
+  // Requires 0 < shift < 64.
+  void (*shift_right)(uint64_t* const dst,
+                      const void* const src,
+                      const unsigned shift,
+                      const size_t word_count);
+
+  // Funnel-shifts a block of words left into a word stream:
+  //   dst[i] = (src[i] >> (64 - shift)) | (src[i + 1] << shift)
+  // for 0 <= i < word_count, reading word_count + 1 source words.
+  // Requires 0 < shift < 64.
+  void (*shift_left)(void* const dst,
+                     const uint64_t* const src,
+                     const unsigned shift,
+                     const size_t word_count);
+
+  // Returns the number of set bits in a block of word_count words.
+  size_t (*count_ones)(const uint64_t* const words, const size_t word_count);
+
+  // Fills word_count words, a multiple of RANDOM_LANES, from RANDOM_LANES
+  // interleaved xoshiro256** generators: word i is the next output of
+  // generator i mod RANDOM_LANES.  state[j][lane] is word j of generator
+  // lane's state, and is advanced past the words produced.
+  void (*fill_random)(uint64_t* const words,
+                      const size_t word_count,
+                      uint64_t state[4][RANDOM_LANES]);
+} bitarray_kernels_t;
+
+
+// ******************************** Globals *********************************
+
+// The kernels currently in use.  Never NULL.
+extern const bitarray_kernels_t* bitarray_kernels;
+
+
+// ***************************** Inline helpers *****************************
+
+// Reverses the order of the bits of a word.
+static inline uint64_t reverse_word(uint64_t word) {
+  // Swap adjacent bits, then adjacent pairs, then adjacent nibbles; what is
+  // left is a byte swap.
+  word = ((word >> 1) & 0x5555555555555555ULL) |
+         ((word & 0x5555555555555555ULL) << 1);
+  word = ((word >> 2) & 0x3333333333333333ULL) |
+         ((word & 0x3333333333333333ULL) << 2);
+  word = ((word >> 4) & 0x0F0F0F0F0F0F0F0FULL) |
+         ((word & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return __builtin_bswap64(word);
+}
+
+#endif  // BITARRAY_KERNELS_H
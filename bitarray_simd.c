@@ -0,0 +1,625 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements the word kernels declared in bitarray_kernels.h: a portable
+// set, AVX2 and AVX-512 sets for x86-64 and a NEON set for AArch64.  The
+// vector sets are compiled with per-function target attributes, so a single
+// binary carries all of them and picks one at startup according to what the
+// CPU reports.  Setting the EVERYBIT_KERNELS environment variable to a set's
+// name overrides the choice, as long as the CPU supports that set.
+
+// We need _POSIX_C_SOURCE for getenv to be declared strictly.
+#define _POSIX_C_SOURCE 200112L
+
+#include "./bitarray_kernels.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define BITARRAY_X86_KERNELS 1
+  #include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+  #define BITARRAY_NEON_KERNELS 1
+  #include <arm_neon.h>
+#endif
+
+#include "./bitarray.h"
+
+
+// ************************** Portable kernels *****************************
+
+static inline uint64_t load_stream_word(const void* const stream,
+                                        const size_t i) {
+  uint64_t word;
+  memcpy(&word, (const char*)stream + i * sizeof(word), sizeof(word));
+  return word;
+}
+
+static inline void store_stream_word(void* const stream,
+                                     const size_t i,
+                                     const uint64_t word) {
+  memcpy((char*)stream + i * sizeof(word), &word, sizeof(word));
+}
+
+static void portable_reverse_block(uint64_t* const words,
+                                   const size_t word_count) {
+  if (word_count == 0) {
+    return;
+  }
+  size_t i, j;
+  for (i = 0, j = word_count - 1; i < j; i++, j--) {
+    const uint64_t tmp = words[i];
+    words[i] = reverse_word(words[j]);
+    words[j] = reverse_word(tmp);
+  }
+  if (i == j) {
+    words[i] = reverse_word(words[i]);
+  }
+}
+
+static void portable_shift_right(uint64_t* const dst,
+                                 const void* const src,
+                                 const unsigned shift,
+                                 const size_t word_count) {
+  uint64_t low = load_stream_word(src, 0);
+  for (size_t i = 0; i < word_count; i++) {
+    const uint64_t high = load_stream_word(src, i + 1);
+    dst[i] = (low >> shift) | (high << (64 - shift));
+    low = high;
+  }
+}
+
+static void portable_shift_left(void* const dst,
+                                const uint64_t* const src,
+                                const unsigned shift,
+                                const size_t word_count) {
+  for (size_t i = 0; i < word_count; i++) {
+    store_stream_word(dst, i, (src[i] >> (64 - shift)) | (src[i + 1] << shift));
+  }
+}
+
+static size_t portable_count_ones(const uint64_t* const words,
+                                  const size_t word_count) {
+  size_t count = 0;
+  for (size_t i = 0; i < word_count; i++) {
+    count += __builtin_popcountll(words[i]);
+  }
+  return count;
+}
+
+static inline uint64_t rotate_word_left(const uint64_t word,
+                                        const unsigned amount) {
+  return (word << amount) | (word >> (64 - amount));
+}
+
+static void portable_fill_random(uint64_t* const words,
+                                 const size_t word_count,
+                                 uint64_t state[4][RANDOM_LANES]) {
+  for (size_t i = 0; i < word_count; i += RANDOM_LANES) {
+    for (size_t lane = 0; lane < RANDOM_LANES; lane++) {
+      uint64_t* const s0 = &state[0][lane];
+      uint64_t* const s1 = &state[1][lane];
+      uint64_t* const s2 = &state[2][lane];
+      uint64_t* const s3 = &state[3][lane];
+      words[i + lane] = rotate_word_left(*s1 * 5, 7) * 9;
+      const uint64_t t = *s1 << 17;
+      *s2 ^= *s0;
+      *s3 ^= *s1;
+      *s1 ^= *s2;
+      *s0 ^= *s3;
+      *s2 ^= t;
+      *s3 = rotate_word_left(*s3, 45);
+    }
+  }
+}
+
+static const bitarray_kernels_t portable_kernels = {
+  .name = "portable",
+  .reverse_block = portable_reverse_block,
+  .shift_right = portable_shift_right,
+  .shift_left = portable_shift_left,
+  .count_ones = portable_count_ones,
+  .fill_random = portable_fill_random,
+};
+
+
+// **************************** x86-64 kernels *****************************
+
+#ifdef BITARRAY_X86_KERNELS
+
+// Bit reversal uses the nibble lookup trick: pshufb looks each nibble up in
+// a 16-entry table of reversed nibbles, and the two halves of every byte
+// swap places on the way.  A byte shuffle then reverses the bytes of each
+// 64-bit lane, and a lane permutation reverses the lanes.
+
+// REV_LOW[x] is x's bit reversal placed in the high nibble; REV_HIGH[x] is
+// x's bit reversal in the low nibble.
+#define REV_LOW_NIBBLES                                                  \
+  0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0,                        \
+  0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0
+#define REV_HIGH_NIBBLES                                                 \
+  0x00, 0x08, 0x04, 0x0C, 0x02, 0x0A, 0x06, 0x0E,                        \
+  0x01, 0x09, 0x05, 0x0D, 0x03, 0x0B, 0x07, 0x0F
+// Shuffle indices reversing the eight bytes of each 64-bit lane.
+#define BSWAP64_INDICES                                                  \
+  7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_reverse_vector(const __m256i v) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i rev_low = _mm256_setr_epi8(REV_LOW_NIBBLES, REV_LOW_NIBBLES);
+  const __m256i rev_high = _mm256_setr_epi8(REV_HIGH_NIBBLES, REV_HIGH_NIBBLES);
+  const __m256i bswap = _mm256_setr_epi8(BSWAP64_INDICES, BSWAP64_INDICES);
+
+  const __m256i low = _mm256_and_si256(v, nibble);
+  const __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+  const __m256i bytes = _mm256_or_si256(_mm256_shuffle_epi8(rev_low, low),
+                                        _mm256_shuffle_epi8(rev_high, high));
+  const __m256i lanes = _mm256_shuffle_epi8(bytes, bswap);
+  return _mm256_permute4x64_epi64(lanes, _MM_SHUFFLE(0, 1, 2, 3));
+}
+
+__attribute__((target("avx2")))
+static void avx2_reverse_block(uint64_t* const words, const size_t word_count) {
+  size_t left = 0;
+  size_t right = word_count;
+  while (right - left >= 8) {
+    const __m256i head = _mm256_loadu_si256((const __m256i*)(words + left));
+    const __m256i tail = _mm256_loadu_si256((const __m256i*)(words + right - 4));
+    _mm256_storeu_si256((__m256i*)(words + left), avx2_reverse_vector(tail));
+    _mm256_storeu_si256((__m256i*)(words + right - 4), avx2_reverse_vector(head));
+    left += 4;
+    right -= 4;
+  }
+  portable_reverse_block(words + left, right - left);
+}
+
+__attribute__((target("avx2")))
+static void avx2_shift_right(uint64_t* const dst,
+                             const void* const src,
+                             const unsigned shift,
+                             const size_t word_count) {
+  const char* const bytes = src;
+  const __m128i right = _mm_cvtsi32_si128(shift);
+  const __m128i left = _mm_cvtsi32_si128(64 - shift);
+  size_t i = 0;
+  for (; i + 4 <= word_count; i += 4) {
+    const __m256i low = _mm256_loadu_si256((const __m256i*)(bytes + 8 * i));
+    const __m256i high = _mm256_loadu_si256((const __m256i*)(bytes + 8 * i + 8));
+    _mm256_storeu_si256((__m256i*)(dst + i),
+                        _mm256_or_si256(_mm256_srl_epi64(low, right),
+                                        _mm256_sll_epi64(high, left)));
+  }
+  portable_shift_right(dst + i, bytes + 8 * i, shift, word_count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_shift_left(void* const dst,
+                            const uint64_t* const src,
+                            const unsigned shift,
+                            const size_t word_count) {
+  char* const bytes = dst;
+  const __m128i left = _mm_cvtsi32_si128(shift);
+  const __m128i right = _mm_cvtsi32_si128(64 - shift);
+  size_t i = 0;
+  for (; i + 4 <= word_count; i += 4) {
+    const __m256i low = _mm256_loadu_si256((const __m256i*)(src + i));
+    const __m256i high = _mm256_loadu_si256((const __m256i*)(src + i + 1));
+    _mm256_storeu_si256((__m256i*)(bytes + 8 * i),
+                        _mm256_or_si256(_mm256_srl_epi64(low, right),
+                                        _mm256_sll_epi64(high, left)));
+  }
+  portable_shift_left(bytes + 8 * i, src + i, shift, word_count - i);
+}
+
+// Population counts use the same nibble lookup: pshufb counts the bits of
+// every nibble, and psadbw sums each lane's bytes into a 64-bit total.
+// NIBBLE_COUNTS[x] is the number of bits set in x.
+#define NIBBLE_COUNTS                                                    \
+  0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+
+// The words left over after the vector loops are counted with the popcnt
+// instruction, which every CPU with AVX2 has.
+__attribute__((target("popcnt")))
+static size_t popcnt_count_ones(const uint64_t* const words,
+                                const size_t word_count) {
+  size_t count = 0;
+  for (size_t i = 0; i < word_count; i++) {
+    count += __builtin_popcountll(words[i]);
+  }
+  return count;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t avx2_count_ones(const uint64_t* const words,
+                              const size_t word_count) {
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i counts = _mm256_setr_epi8(NIBBLE_COUNTS, NIBBLE_COUNTS);
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 4 <= word_count; i += 4) {
+    const __m256i v = _mm256_loadu_si256((const __m256i*)(words + i));
+    const __m256i low = _mm256_and_si256(v, nibble);
+    const __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    const __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(counts, low),
+                                          _mm256_shuffle_epi8(counts, high));
+    total = _mm256_add_epi64(total,
+                             _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  const size_t count = (size_t)_mm256_extract_epi64(total, 0) +
+                       (size_t)_mm256_extract_epi64(total, 1) +
+                       (size_t)_mm256_extract_epi64(total, 2) +
+                       (size_t)_mm256_extract_epi64(total, 3);
+  return count + popcnt_count_ones(words + i, word_count - i);
+}
+
+// The xoshiro256** multiplications by 5 and 9 are a shift and an add.
+__attribute__((target("avx2")))
+static inline __m256i avx2_rotl(const __m256i v, const int amount) {
+  return _mm256_or_si256(_mm256_slli_epi64(v, amount),
+                         _mm256_srli_epi64(v, 64 - amount));
+}
+
+__attribute__((target("avx2")))
+static void avx2_fill_random(uint64_t* const words,
+                             const size_t word_count,
+                             uint64_t state[4][RANDOM_LANES]) {
+  // Each half of the lanes is one vector per state word.
+  for (size_t half = 0; half < RANDOM_LANES; half += 4) {
+    __m256i s0 = _mm256_loadu_si256((const __m256i*)&state[0][half]);
+    __m256i s1 = _mm256_loadu_si256((const __m256i*)&state[1][half]);
+    __m256i s2 = _mm256_loadu_si256((const __m256i*)&state[2][half]);
+    __m256i s3 = _mm256_loadu_si256((const __m256i*)&state[3][half]);
+    for (size_t i = 0; i < word_count; i += RANDOM_LANES) {
+      const __m256i times5 = _mm256_add_epi64(_mm256_slli_epi64(s1, 2), s1);
+      const __m256i rotated = avx2_rotl(times5, 7);
+      _mm256_storeu_si256((__m256i*)(words + i + half),
+                          _mm256_add_epi64(_mm256_slli_epi64(rotated, 3),
+                                           rotated));
+      const __m256i t = _mm256_slli_epi64(s1, 17);
+      s2 = _mm256_xor_si256(s2, s0);
+      s3 = _mm256_xor_si256(s3, s1);
+      s1 = _mm256_xor_si256(s1, s2);
+      s0 = _mm256_xor_si256(s0, s3);
+      s2 = _mm256_xor_si256(s2, t);
+      s3 = avx2_rotl(s3, 45);
+    }
+    _mm256_storeu_si256((__m256i*)&state[0][half], s0);
+    _mm256_storeu_si256((__m256i*)&state[1][half], s1);
+    _mm256_storeu_si256((__m256i*)&state[2][half], s2);
+    _mm256_storeu_si256((__m256i*)&state[3][half], s3);
+  }
+}
+
+static const bitarray_kernels_t avx2_kernels = {
+  .name = "avx2",
+  .reverse_block = avx2_reverse_block,
+  .shift_right = avx2_shift_right,
+  .shift_left = avx2_shift_left,
+  .count_ones = avx2_count_ones,
+  .fill_random = avx2_fill_random,
+};
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i avx512_reverse_vector(const __m512i v) {
+  const __m512i nibble = _mm512_set1_epi8(0x0F);
+  const __m512i rev_low = _mm512_broadcast_i32x4(
+      _mm_setr_epi8(REV_LOW_NIBBLES));
+  const __m512i rev_high = _mm512_broadcast_i32x4(
+      _mm_setr_epi8(REV_HIGH_NIBBLES));
+  const __m512i bswap = _mm512_broadcast_i32x4(
+      _mm_setr_epi8(BSWAP64_INDICES));
+  const __m512i lane_order = _mm512_setr_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+
+  const __m512i low = _mm512_and_si512(v, nibble);
+  const __m512i high = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble);
+  const __m512i bytes = _mm512_or_si512(_mm512_shuffle_epi8(rev_low, low),
+                                        _mm512_shuffle_epi8(rev_high, high));
+  const __m512i lanes = _mm512_shuffle_epi8(bytes, bswap);
+  return _mm512_permutexvar_epi64(lane_order, lanes);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_reverse_block(uint64_t* const words,
+                                 const size_t word_count) {
+  size_t left = 0;
+  size_t right = word_count;
+  while (right - left >= 16) {
+    const __m512i head = _mm512_loadu_si512(words + left);
+    const __m512i tail = _mm512_loadu_si512(words + right - 8);
+    _mm512_storeu_si512(words + left, avx512_reverse_vector(tail));
+    _mm512_storeu_si512(words + right - 8, avx512_reverse_vector(head));
+    left += 8;
+    right -= 8;
+  }
+  // A single vector in the middle can be reversed in place.
+  if (right - left == 8) {
+    const __m512i middle = _mm512_loadu_si512(words + left);
+    _mm512_storeu_si512(words + left, avx512_reverse_vector(middle));
+    return;
+  }
+  avx2_reverse_block(words + left, right - left);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_shift_right(uint64_t* const dst,
+                               const void* const src,
+                               const unsigned shift,
+                               const size_t word_count) {
+  const char* const bytes = src;
+  const __m128i right = _mm_cvtsi32_si128(shift);
+  const __m128i left = _mm_cvtsi32_si128(64 - shift);
+  size_t i = 0;
+  for (; i + 8 <= word_count; i += 8) {
+    const __m512i low = _mm512_loadu_si512(bytes + 8 * i);
+    const __m512i high = _mm512_loadu_si512(bytes + 8 * i + 8);
+    _mm512_storeu_si512(dst + i, _mm512_or_si512(_mm512_srl_epi64(low, right),
+                                                 _mm512_sll_epi64(high, left)));
+  }
+  avx2_shift_right(dst + i, bytes + 8 * i, shift, word_count - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void avx512_shift_left(void* const dst,
+                              const uint64_t* const src,
+                              const unsigned shift,
+                              const size_t word_count) {
+  char* const bytes = dst;
+  const __m128i left = _mm_cvtsi32_si128(shift);
+  const __m128i right = _mm_cvtsi32_si128(64 - shift);
+  size_t i = 0;
+  for (; i + 8 <= word_count; i += 8) {
+    const __m512i low = _mm512_loadu_si512(src + i);
+    const __m512i high = _mm512_loadu_si512(src + i + 1);
+    _mm512_storeu_si512(bytes + 8 * i,
+                        _mm512_or_si512(_mm512_srl_epi64(low, right),
+                                        _mm512_sll_epi64(high, left)));
+  }
+  avx2_shift_left(bytes + 8 * i, src + i, shift, word_count - i);
+}
+
+__attribute__((target("avx512f,avx512bw,avx2,popcnt")))
+static size_t avx512_count_ones(const uint64_t* const words,
+                                const size_t word_count) {
+  const __m512i nibble = _mm512_set1_epi8(0x0F);
+  const __m512i counts = _mm512_broadcast_i32x4(_mm_setr_epi8(NIBBLE_COUNTS));
+  __m512i total = _mm512_setzero_si512();
+  size_t i = 0;
+  for (; i + 8 <= word_count; i += 8) {
+    const __m512i v = _mm512_loadu_si512(words + i);
+    const __m512i low = _mm512_and_si512(v, nibble);
+    const __m512i high = _mm512_and_si512(_mm512_srli_epi16(v, 4), nibble);
+    const __m512i bytes = _mm512_add_epi8(_mm512_shuffle_epi8(counts, low),
+                                          _mm512_shuffle_epi8(counts, high));
+    total = _mm512_add_epi64(total,
+                             _mm512_sad_epu8(bytes, _mm512_setzero_si512()));
+  }
+  return (size_t)_mm512_reduce_add_epi64(total) +
+         avx2_count_ones(words + i, word_count - i);
+}
+
+// All eight lanes fit one vector per state word, and AVX-512 rotates.
+__attribute__((target("avx512f")))
+static void avx512_fill_random(uint64_t* const words,
+                               const size_t word_count,
+                               uint64_t state[4][RANDOM_LANES]) {
+  __m512i s0 = _mm512_loadu_si512(state[0]);
+  __m512i s1 = _mm512_loadu_si512(state[1]);
+  __m512i s2 = _mm512_loadu_si512(state[2]);
+  __m512i s3 = _mm512_loadu_si512(state[3]);
+  for (size_t i = 0; i < word_count; i += RANDOM_LANES) {
+    const __m512i times5 = _mm512_add_epi64(_mm512_slli_epi64(s1, 2), s1);
+    const __m512i rotated = _mm512_rol_epi64(times5, 7);
+    _mm512_storeu_si512(words + i,
+                        _mm512_add_epi64(_mm512_slli_epi64(rotated, 3),
+                                         rotated));
+    const __m512i t = _mm512_slli_epi64(s1, 17);
+    s2 = _mm512_xor_si512(s2, s0);
+    s3 = _mm512_xor_si512(s3, s1);
+    s1 = _mm512_xor_si512(s1, s2);
+    s0 = _mm512_xor_si512(s0, s3);
+    s2 = _mm512_xor_si512(s2, t);
+    s3 = _mm512_rol_epi64(s3, 45);
+  }
+  _mm512_storeu_si512(state[0], s0);
+  _mm512_storeu_si512(state[1], s1);
+  _mm512_storeu_si512(state[2], s2);
+  _mm512_storeu_si512(state[3], s3);
+}
+
+static const bitarray_kernels_t avx512_kernels = {
+  .name = "avx512",
+  .reverse_block = avx512_reverse_block,
+  .shift_right = avx512_shift_right,
+  .shift_left = avx512_shift_left,
+  .count_ones = avx512_count_ones,
+  .fill_random = avx512_fill_random,
+};
+
+#endif  // BITARRAY_X86_KERNELS
+
+
+// ***************************** NEON kernels ******************************
+
+#ifdef BITARRAY_NEON_KERNELS
+
+// NEON reverses the bits of each byte in one instruction; a byte reversal
+// within each 64-bit lane and a swap of the two lanes finish the job.
+static inline uint64x2_t neon_reverse_vector(const uint64x2_t v) {
+  const uint8x16_t bytes = vrev64q_u8(vrbitq_u8(vreinterpretq_u8_u64(v)));
+  const uint64x2_t lanes = vreinterpretq_u64_u8(bytes);
+  return vextq_u64(lanes, lanes, 1);
+}
+
+static inline uint64x2_t neon_load(const void* const p) {
+  return vreinterpretq_u64_u8(vld1q_u8((const uint8_t*)p));
+}
+
+static inline void neon_store(void* const p, const uint64x2_t v) {
+  vst1q_u8((uint8_t*)p, vreinterpretq_u8_u64(v));
+}
+
+static void neon_reverse_block(uint64_t* const words, const size_t word_count) {
+  size_t left = 0;
+  size_t right = word_count;
+  while (right - left >= 4) {
+    const uint64x2_t head = neon_load(words + left);
+    const uint64x2_t tail = neon_load(words + right - 2);
+    neon_store(words + left, neon_reverse_vector(tail));
+    neon_store(words + right - 2, neon_reverse_vector(head));
+    left += 2;
+    right -= 2;
+  }
+  portable_reverse_block(words + left, right - left);
+}
+
+static void neon_shift_right(uint64_t* const dst,
+                             const void* const src,
+                             const unsigned shift,
+                             const size_t word_count) {
+  const char* const bytes = src;
+  const int64x2_t right = vdupq_n_s64(-(int64_t)shift);
+  const int64x2_t left = vdupq_n_s64(64 - (int64_t)shift);
+  size_t i = 0;
+  for (; i + 2 <= word_count; i += 2) {
+    const uint64x2_t low = neon_load(bytes + 8 * i);
+    const uint64x2_t high = neon_load(bytes + 8 * i + 8);
+    neon_store(dst + i, vorrq_u64(vshlq_u64(low, right), vshlq_u64(high, left)));
+  }
+  portable_shift_right(dst + i, bytes + 8 * i, shift, word_count - i);
+}
+
+static void neon_shift_left(void* const dst,
+                            const uint64_t* const src,
+                            const unsigned shift,
+                            const size_t word_count) {
+  char* const bytes = dst;
+  const int64x2_t left = vdupq_n_s64((int64_t)shift);
+  const int64x2_t right = vdupq_n_s64((int64_t)shift - 64);
+  size_t i = 0;
+  for (; i + 2 <= word_count; i += 2) {
+    const uint64x2_t low = neon_load(src + i);
+    const uint64x2_t high = neon_load(src + i + 1);
+    neon_store(bytes + 8 * i,
+               vorrq_u64(vshlq_u64(low, right), vshlq_u64(high, left)));
+  }
+  portable_shift_left(bytes + 8 * i, src + i, shift, word_count - i);
+}
+
+// cnt counts the bits of every byte; pairwise widening adds fold the byte
+// counts into one total per 64-bit lane.
+static size_t neon_count_ones(const uint64_t* const words,
+                              const size_t word_count) {
+  uint64x2_t total = vdupq_n_u64(0);
+  size_t i = 0;
+  for (; i + 2 <= word_count; i += 2) {
+    const uint8x16_t bytes =
+      vcntq_u8(vreinterpretq_u8_u64(neon_load(words + i)));
+    total = vpadalq_u32(total, vpaddlq_u16(vpaddlq_u8(bytes)));
+  }
+  return (size_t)vaddvq_u64(total) +
+         portable_count_ones(words + i, word_count - i);
+}
+
+static const bitarray_kernels_t neon_kernels = {
+  .name = "neon",
+  .reverse_block = neon_reverse_block,
+  .shift_right = neon_shift_right,
+  .shift_left = neon_shift_left,
+  .count_ones = neon_count_ones,
+  .fill_random = portable_fill_random,
+};
+
+#endif  // BITARRAY_NEON_KERNELS
+
+
+// ******************************* Dispatch ********************************
+
+const bitarray_kernels_t* bitarray_kernels = &portable_kernels;
+
+// Returns whether the CPU we are running on can execute the given set.
+static bool kernels_supported(const bitarray_kernels_t* const kernels) {
+#ifdef BITARRAY_X86_KERNELS
+  if (kernels == &avx512_kernels) {
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+  }
+  if (kernels == &avx2_kernels) {
+    return __builtin_cpu_supports("avx2") &&
+           __builtin_cpu_supports("popcnt");
+  }
+#endif
+  return true;
+}
+
+// Every set built into this binary, best first.
+static const bitarray_kernels_t* const all_kernels[] = {
+#ifdef BITARRAY_X86_KERNELS
+  &avx512_kernels,
+  &avx2_kernels,
+#endif
+#ifdef BITARRAY_NEON_KERNELS
+  &neon_kernels,
+#endif
+  &portable_kernels,
+};
+
+#define KERNEL_SET_COUNT (sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+// Runs before main, so the kernels never change under a running rotation
+// unless the program asks for it.
+__attribute__((constructor))
+static void select_kernels(void) {
+#ifdef BITARRAY_X86_KERNELS
+  __builtin_cpu_init();
+#endif
+  const char* const requested = getenv("EVERYBIT_KERNELS");
+  if (requested != NULL && bitarray_set_kernels(requested)) {
+    return;
+  }
+  for (size_t i = 0; i < KERNEL_SET_COUNT; i++) {
+    if (kernels_supported(all_kernels[i])) {
+      bitarray_kernels = all_kernels[i];
+      return;
+    }
+  }
+}
+
+const char* bitarray_get_kernels(void) {
+  return bitarray_kernels->name;
+}
+
+bool bitarray_set_kernels(const char* const name) {
+  for (size_t i = 0; i < KERNEL_SET_COUNT; i++) {
+    if (strcmp(name, all_kernels[i]->name) == 0 &&
+        kernels_supported(all_kernels[i])) {
+      bitarray_kernels = all_kernels[i];
+      return true;
+    }
+  }
+  return false;
+}
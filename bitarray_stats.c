@@ -0,0 +1,252 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements the dispatch statistics of bitarray_stats.h and
+// bitarray_stats_dump.  Rotations of disjoint subarrays may run on several
+// threads at once (bitarray_rotate_batch_parallel does just that), so the
+// counters are only ever updated atomically.
+
+// We need _POSIX_C_SOURCE >= 199309L for clock_gettime.
+#define _POSIX_C_SOURCE 200112L
+
+#include "./bitarray.h"
+#include "./bitarray_stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+
+// ********************************* Macros *********************************
+
+#define WORD_BITS 64
+
+// Length histograms have a bucket for each power of two.
+#define LENGTH_BUCKETS 64
+
+
+// ********************************* Types **********************************
+
+// Where a rotated subarray starts and ends relative to word boundaries.
+typedef enum {
+  ALIGN_BOTH,
+  ALIGN_START,
+  ALIGN_END,
+  ALIGN_NEITHER,
+  ALIGN_CLASS_COUNT,
+} align_class_t;
+
+// Everything gathered about one kind of rotation.
+typedef struct {
+  uint64_t calls;
+  uint64_t bits;
+  uint64_t bytes;
+  uint64_t phase_ns[STATS_PHASE_COUNT];
+  uint64_t alignment[ALIGN_CLASS_COUNT];
+  // lengths[b] counts rotations of 2^b to 2^(b+1) - 1 bits.
+  uint64_t lengths[LENGTH_BUCKETS];
+} kind_stats_t;
+
+
+// ******************************** Globals *********************************
+
+static const char* const kind_names[STATS_KIND_COUNT] = {
+  [STATS_REVERSAL] = "reversal",
+  [STATS_CYCLE_LEADER] = "cycle-leader",
+  [STATS_SHIFT_COPY] = "shift-copy",
+  [STATS_PARALLEL_REVERSAL] = "parallel-reversal",
+  [STATS_REGISTER] = "register",
+  [STATS_STRIDED] = "strided",
+  [STATS_SPLICE] = "segment-splice",
+  [STATS_CONCURRENT] = "concurrent",
+  [STATS_LAZY_VIEW] = "lazy-view",
+};
+
+#ifdef BITARRAY_STATS
+
+static kind_stats_t stats[STATS_KIND_COUNT];
+
+// The timer of the rotation in progress on this thread, if any.  Worker
+// threads have none; their time is charged to the thread waiting on them.
+static __thread stats_timer_t* current_timer = NULL;
+
+
+// ******************** Prototypes for static functions *********************
+
+// Returns the monotonic clock in nanoseconds.
+static uint64_t now_ns();
+
+// Returns how many bytes a rotation of the given kind reads and writes in
+// the bit array, counting each pass its access pattern makes.
+static uint64_t bytes_touched(const stats_kind_t kind,
+                              const size_t bit_length);
+
+static void add(uint64_t* const counter, const uint64_t amount);
+
+static uint64_t load(const uint64_t* const counter);
+
+#endif  // BITARRAY_STATS
+
+
+// ******************************* Functions ********************************
+
+bool bitarray_stats_dump(FILE* const stream) {
+#ifdef BITARRAY_STATS
+  fprintf(stream, "rotation statistics (kernels %s)\n",
+          bitarray_get_kernels());
+  fprintf(stream, "%-18s %10s %14s %14s %13s %13s %13s %9s %9s %9s %9s\n",
+          "kind", "calls", "bits", "bytes", "head_ns", "bulk_ns", "tail_ns",
+          "aligned", "start", "end", "neither");
+  for (int k = 0; k < STATS_KIND_COUNT; k++) {
+    const kind_stats_t* const s = &stats[k];
+    fprintf(stream, "%-18s %10" PRIu64 " %14" PRIu64 " %14" PRIu64
+            " %13" PRIu64 " %13" PRIu64 " %13" PRIu64
+            " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+            kind_names[k], load(&s->calls), load(&s->bits), load(&s->bytes),
+            load(&s->phase_ns[STATS_HEAD]), load(&s->phase_ns[STATS_BULK]),
+            load(&s->phase_ns[STATS_TAIL]), load(&s->alignment[ALIGN_BOTH]),
+            load(&s->alignment[ALIGN_START]), load(&s->alignment[ALIGN_END]),
+            load(&s->alignment[ALIGN_NEITHER]));
+  }
+  // Then the length histogram of every kind that ran, as bucket:count for
+  // each bucket that is not empty.
+  for (int k = 0; k < STATS_KIND_COUNT; k++) {
+    if (load(&stats[k].calls) == 0) {
+      continue;
+    }
+    fprintf(stream, "%s lengths:", kind_names[k]);
+    for (int b = 0; b < LENGTH_BUCKETS; b++) {
+      const uint64_t count = load(&stats[k].lengths[b]);
+      if (count > 0) {
+        fprintf(stream, " 2^%d:%" PRIu64, b, count);
+      }
+    }
+    fprintf(stream, "\n");
+  }
+  return true;
+#else
+  (void) stream;
+  (void) kind_names;
+  return false;
+#endif
+}
+
+void bitarray_stats_reset(void) {
+#ifdef BITARRAY_STATS
+  for (int k = 0; k < STATS_KIND_COUNT; k++) {
+    uint64_t* const counters = (uint64_t*) &stats[k];
+    for (size_t i = 0; i < sizeof(kind_stats_t) / sizeof(uint64_t); i++) {
+      __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+    }
+  }
+#endif
+}
+
+#ifdef BITARRAY_STATS
+
+void stats_rotation_begin(stats_timer_t* const timer) {
+  for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+    timer->phase_ns[p] = 0;
+  }
+  timer->outer = current_timer;
+  current_timer = timer;
+  timer->mark_ns = now_ns();
+}
+
+void stats_phase(const stats_phase_t phase) {
+  stats_timer_t* const timer = current_timer;
+  if (timer == NULL) {
+    return;
+  }
+  const uint64_t now = now_ns();
+  timer->phase_ns[phase] += now - timer->mark_ns;
+  timer->mark_ns = now;
+}
+
+void stats_rotation_end(stats_timer_t* const timer,
+                        const stats_kind_t kind,
+                        const size_t bit_offset,
+                        const size_t bit_length) {
+  // Whatever came after the last phase belongs to the tail.
+  stats_phase(STATS_TAIL);
+  current_timer = timer->outer;
+  // A nested rotation's time already counts toward its outer one.
+  if (current_timer != NULL) {
+    current_timer->mark_ns = now_ns();
+  }
+
+  kind_stats_t* const s = &stats[kind];
+  add(&s->calls, 1);
+  add(&s->bits, bit_length);
+  add(&s->bytes, bytes_touched(kind, bit_length));
+  for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+    add(&s->phase_ns[p], timer->phase_ns[p]);
+  }
+
+  const bool start_aligned = bit_offset % WORD_BITS == 0;
+  const bool end_aligned = (bit_offset + bit_length) % WORD_BITS == 0;
+  const align_class_t align =
+    start_aligned ? (end_aligned ? ALIGN_BOTH : ALIGN_START) :
+                    (end_aligned ? ALIGN_END : ALIGN_NEITHER);
+  add(&s->alignment[align], 1);
+
+  int bucket = 0;
+  while (bucket + 1 < LENGTH_BUCKETS && bit_length >> (bucket + 1) != 0) {
+    bucket++;
+  }
+  add(&s->lengths[bucket], 1);
+}
+
+static uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint64_t bytes_touched(const stats_kind_t kind,
+                              const size_t bit_length) {
+  switch (kind) {
+  case STATS_REVERSAL:
+  case STATS_PARALLEL_REVERSAL:
+    // Three reversals, covering the subarray twice, each reading and
+    // writing every bit it covers.
+    return bit_length / 2;
+  case STATS_CYCLE_LEADER:
+  case STATS_SHIFT_COPY:
+  case STATS_REGISTER:
+  case STATS_STRIDED:
+    // Every bit is read once and written once.
+    return bit_length / 4;
+  default:
+    return 0;
+  }
+}
+
+static void add(uint64_t* const counter, const uint64_t amount) {
+  __atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static uint64_t load(const uint64_t* const counter) {
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+#endif  // BITARRAY_STATS
@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Counters and histograms of what the rotations dispatch to, for tuning the
+// dispatch thresholds against a real mix of offsets and lengths.  They are
+// only gathered when the library is built with BITARRAY_STATS defined
+// ("make STATS=1"); otherwise the macros below compile to nothing and
+// bitarray_stats_dump has nothing to report.
+//
+// A rotation is timed in three phases.  What each one covers depends on the
+// strategy:
+//   - shift copy: the head is setting the short side aside, the bulk is
+//     sliding the long side over and the tail is putting the short side back;
+//   - reversal, serial or parallel: the bulk is swapping whole words, or the
+//     bands of the parallel reversal, and the tail is fixing up the partial
+//     words where the two ends meet, or the margins between bands;
+//   - cycle leader and rotations in registers: everything is bulk;
+//   - segment splice: the head is splitting the segments, the bulk is
+//     reordering them and the tail is merging them and compacting the array
+//     if they are too many;
+//   - strided: the bulk is rotating the fields, all the bands of them when
+//     run in parallel, and the tail is the fields at the seams of bands;
+//   - concurrent: the head is waiting for the subarray and reading the
+//     partial words at its ends, the bulk is moving their bits into the
+//     whole words between and the tail is storing the partial words back.
+//
+// This header is internal to the bit array implementation.
+
+#ifndef BITARRAY_STATS_H
+#define BITARRAY_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// ********************************* Types **********************************
+
+// What a rotation was carried out with.
+typedef enum {
+  STATS_REVERSAL,
+  STATS_CYCLE_LEADER,
+  STATS_SHIFT_COPY,
+  STATS_PARALLEL_REVERSAL,
+  // Loaded into registers, rotated there and stored back.
+  STATS_REGISTER,
+  // The fields of a strided rotation, counted as one rotation of all their
+  // bits.
+  STATS_STRIDED,
+  // Spliced from the segments of a segmented bit array.
+  STATS_SPLICE,
+  // Rotated while other threads may rotate other subarrays of the same
+  // concurrent bit array; the words wholly inside the subarray are rotated,
+  // and counted, as a nested rotation or two.
+  STATS_CONCURRENT,
+  // Recorded as a view of a lazy bit array, to be carried out later.
+  STATS_LAZY_VIEW,
+  STATS_KIND_COUNT,
+} stats_kind_t;
+
+typedef enum {
+  STATS_HEAD,
+  STATS_BULK,
+  STATS_TAIL,
+  STATS_PHASE_COUNT,
+} stats_phase_t;
+
+// The phase times of the rotation in progress on a thread.
+typedef struct stats_timer {
+  // When the last phase ended.
+  uint64_t mark_ns;
+  uint64_t phase_ns[STATS_PHASE_COUNT];
+  // The timer of the rotation this one is nested in, if any.
+  struct stats_timer* outer;
+} stats_timer_t;
+
+
+// ********************************* Macros *********************************
+
+#ifdef BITARRAY_STATS
+
+// Starts timing a rotation in the current block.
+#define STATS_ROTATION_BEGIN(timer) \
+  stats_timer_t timer;              \
+  stats_rotation_begin(&timer)
+
+// Charges the time since the last phase ended to the given phase.
+#define STATS_PHASE(phase) stats_phase(phase)
+
+// Records a rotation of bit_length bits at bit_offset with the given kind,
+// with the phase times gathered since STATS_ROTATION_BEGIN.
+#define STATS_ROTATION_END(timer, kind, bit_offset, bit_length) \
+  stats_rotation_end(&timer, (kind), (bit_offset), (bit_length))
+
+#else
+
+#define STATS_ROTATION_BEGIN(timer) do {} while (0)
+#define STATS_PHASE(phase) do {} while (0)
+#define STATS_ROTATION_END(timer, kind, bit_offset, bit_length) \
+  do {} while (0)
+
+#endif  // BITARRAY_STATS
+
+
+// ******************************* Prototypes *******************************
+
+#ifdef BITARRAY_STATS
+
+void stats_rotation_begin(stats_timer_t* const timer);
+
+void stats_phase(const stats_phase_t phase);
+
+void stats_rotation_end(stats_timer_t* const timer,
+                        const stats_kind_t kind,
+                        const size_t bit_offset,
+                        const size_t bit_length);
+
+#endif  // BITARRAY_STATS
+
+#endif  // BITARRAY_STATS_H
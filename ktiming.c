@@ -37,10 +37,20 @@
 // We need _POSIX_C_SOURCES to pick up 'struct timespec' and clock_gettime.
 #define _POSIX_C_SOURCE 200112L
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+  #define KTIMING_TSC 1
+  #include <cpuid.h>
+  #include <x86intrin.h>
+#elif defined(__aarch64__) && (defined(__GNUC__) || defined(__clang__))
+  #define KTIMING_CNTVCT 1
+#endif
+
 #ifndef __APPLE__
   #include <time.h>
 #else
@@ -63,8 +73,63 @@
 #endif
 
 
+// ktiming_getticks is calibrated against the monotonic clock over this many
+// nanoseconds.
+#define KTIMING_CALIBRATION_NSEC (10 * 1000 * 1000)
+
+// The cost of reading the clock is the least of this many back-to-back
+// readings.
+#define KTIMING_OVERHEAD_SAMPLES 1000
+
+
+// ******************************** Globals *********************************
+
+// Whether ktiming_getticks reads a hardware counter; if not, it reads the
+// monotonic clock in nanoseconds.
+static bool ticks_from_counter = false;
+
+// Set once by calibrate: the length of a tick, and what reading the clock
+// twice costs, in ticks.
+static pthread_once_t calibration = PTHREAD_ONCE_INIT;
+static double nsec_per_tick = 1.0;
+static uint64_t overhead_ticks = 0;
+
+
+// ******************** Prototypes for static functions *********************
+
+// Reads CLOCK_MONOTONIC, in nanoseconds.
+static uint64_t monotonic_nsec();
+
+// Measures nsec_per_tick and overhead_ticks.  Run through pthread_once.
+static void calibrate();
+
+
 // ******************************* Functions ********************************
 
+// Checking for a usable counter is cheap, so it is done at startup; the
+// calibration takes a while and waits until a reading is first converted.
+__attribute__((constructor))
+static void detect_counter() {
+#if defined(KTIMING_TSC)
+  // The time stamp counter only measures time if it is invariant, ticking
+  // at one rate in every power state on every core.  rdtscp also waits for
+  // the instructions before it, so the region's own work is not cut short.
+  unsigned int eax, ebx, ecx, edx;
+  bool rdtscp = false;
+  bool invariant = false;
+  if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+    rdtscp = (edx >> 27) & 1;
+  }
+  if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+    invariant = (edx >> 8) & 1;
+  }
+  ticks_from_counter = rdtscp && invariant;
+#elif defined(KTIMING_CNTVCT)
+  // The generic timer's virtual count is always there and always constant.
+  ticks_from_counter = true;
+#endif
+}
+
 clockmark_t ktiming_getmark() {
 #ifdef __APPLE__
   const uint64_t now = mach_absolute_time();
@@ -97,13 +162,117 @@ clockmark_t ktiming_getmark() {
 #endif
 }
 
-uint64_t ktiming_diff_usec(const clockmark_t* const start,
+clockmark_t ktiming_getmark_wall() {
+#if defined(__APPLE__) || defined(__CYGWIN__)
+  // ktiming_getmark already reports wall time here.
+  return ktiming_getmark();
+#else
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+    perror("ktiming_getmark_wall()");
+    exit(-1);
+  }
+  return now.tv_nsec + ((uint64_t)now.tv_sec) * 1000 * 1000 * 1000;
+#endif
+}
+
+uint64_t ktiming_diff_nsec(const clockmark_t* const start,
                            const clockmark_t* const end) {
   return *end - *start;
 }
 
+uint64_t ktiming_diff_usec(const clockmark_t* const start,
+                           const clockmark_t* const end) {
+  return ktiming_diff_nsec(start, end);
+}
+
 float ktiming_diff_sec(const clockmark_t* const start,
                        const clockmark_t* const end) {
-  return (float)ktiming_diff_usec(start, end) / 1000000000.0f;
+  return (float)ktiming_diff_nsec(start, end) / 1000000000.0f;
+}
+
+uint64_t ktiming_getticks() {
+#if defined(KTIMING_TSC)
+  if (ticks_from_counter) {
+    unsigned int core;
+    return __rdtscp(&core);
+  }
+#elif defined(KTIMING_CNTVCT)
+  uint64_t ticks;
+  __asm__ __volatile__("isb\n\tmrs %0, cntvct_el0" : "=r"(ticks) :: "memory");
+  return ticks;
+#endif
+  return monotonic_nsec();
+}
+
+uint64_t ktiming_elapsed_nsec(const uint64_t start_ticks,
+                              const uint64_t end_ticks) {
+  pthread_once(&calibration, calibrate);
+  const uint64_t ticks = end_ticks - start_ticks;
+  if (ticks <= overhead_ticks) {
+    return 0;
+  }
+  return (uint64_t)((ticks - overhead_ticks) * nsec_per_tick + 0.5);
+}
+
+uint64_t ktiming_overhead_nsec() {
+  pthread_once(&calibration, calibrate);
+  return (uint64_t)(overhead_ticks * nsec_per_tick + 0.5);
+}
+
+ktiming_region_t ktiming_region_begin() {
+  ktiming_region_t region;
+  region.done = false;
+  region.start_ticks = ktiming_getticks();
+  return region;
+}
+
+uint64_t ktiming_region_end(ktiming_region_t* const region) {
+  const uint64_t end_ticks = ktiming_getticks();
+  region->done = true;
+  return ktiming_elapsed_nsec(region->start_ticks, end_ticks);
+}
+
+static uint64_t monotonic_nsec() {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+    perror("ktiming_getticks()");
+    exit(-1);
+  }
+  return now.tv_nsec + ((uint64_t)now.tv_sec) * 1000 * 1000 * 1000;
+}
+
+static void calibrate() {
+  if (ticks_from_counter) {
+#if defined(KTIMING_CNTVCT)
+    // The counter reports its own frequency.
+    uint64_t frequency;
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+    nsec_per_tick = 1e9 / (double)frequency;
+#else
+    // Count ticks across a stretch of the monotonic clock.
+    const uint64_t start_nsec = monotonic_nsec();
+    const uint64_t start_ticks = ktiming_getticks();
+    uint64_t end_nsec;
+    do {
+      end_nsec = monotonic_nsec();
+    } while (end_nsec - start_nsec < KTIMING_CALIBRATION_NSEC);
+    const uint64_t end_ticks = ktiming_getticks();
+    nsec_per_tick = (double)(end_nsec - start_nsec) /
+                    (double)(end_ticks - start_ticks);
+#endif
+  }
+
+  // A region timed with nothing in it still reports the cost of reading
+  // the clock; the least of many tries is that cost with no noise on top.
+  uint64_t least = UINT64_MAX;
+  for (int i = 0; i < KTIMING_OVERHEAD_SAMPLES; i++) {
+    const uint64_t start_ticks = ktiming_getticks();
+    const uint64_t end_ticks = ktiming_getticks();
+    if (end_ticks - start_ticks < least) {
+      least = end_ticks - start_ticks;
+    }
+  }
+  overhead_ticks = least;
 }
 
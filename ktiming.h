@@ -35,6 +35,7 @@
 #ifndef _KTIMING_H_
 #define _KTIMING_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 
@@ -43,11 +44,40 @@
 // A clock time.
 typedef uint64_t clockmark_t;
 
+// A region being timed; see KTIMING_REGION.
+typedef struct {
+  uint64_t start_ticks;
+  bool done;
+} ktiming_region_t;
+
+
+// ********************************* Macros *********************************
+
+// Times the statement or block that follows, storing the elapsed wall time
+// in nanoseconds, less the cost of the timing itself, in the uint64_t
+// lvalue nsec:
+//
+//   uint64_t nsec;
+//   KTIMING_REGION(nsec) {
+//     bitarray_rotate(ba, 0, n, 1);
+//   }
+//
+// The block runs exactly once.  Leaving it with break, return or goto skips
+// storing the time.
+#define KTIMING_REGION(nsec)                                          \
+  for (ktiming_region_t ktiming_region_ = ktiming_region_begin();     \
+       !ktiming_region_.done;                                         \
+       (nsec) = ktiming_region_end(&ktiming_region_))
+
 
 // ******************************* Prototypes *******************************
 
 // Returns the difference between two clockmark_t in nanoseconds.  In
 // particular, returns *end - *start.
+uint64_t ktiming_diff_nsec(const clockmark_t* const start,
+                           const clockmark_t* const end);
+
+// The old name of ktiming_diff_nsec.
 //
 // Warning: Although the function is called ktiming_diff_usec, it returns a
 // value in nanoseconds, not microseconds!
@@ -62,4 +92,31 @@ float ktiming_diff_sec(const clockmark_t* const start,
 // Gets the current clock time.
 clockmark_t ktiming_getmark();
 
+// Gets the current wall-clock time.  On Linux, ktiming_getmark measures the
+// CPU time of the whole process, which adds up the time of every thread; use
+// this instead to time code that runs on several threads at once.
+clockmark_t ktiming_getmark_wall();
+
+// Reads the fastest clock available, in ticks of unspecified length: the
+// invariant time stamp counter through rdtscp on x86-64, the virtual
+// counter on AArch64, and the monotonic clock in nanoseconds elsewhere.
+// It measures wall time, and costs a few tens of cycles to read.
+uint64_t ktiming_getticks();
+
+// Returns the nanoseconds between two readings of ktiming_getticks, less
+// what reading the clock costs, so that a region can be timed down to a few
+// nanoseconds.  The first call calibrates the ticks against the monotonic
+// clock, which takes about 10 milliseconds.
+uint64_t ktiming_elapsed_nsec(const uint64_t start_ticks,
+                              const uint64_t end_ticks);
+
+// Returns what ktiming_elapsed_nsec subtracts, in nanoseconds.
+uint64_t ktiming_overhead_nsec();
+
+// Start and end a timed region by hand; KTIMING_REGION is usually more
+// convenient.  ktiming_region_end returns the region's time as
+// ktiming_elapsed_nsec does.
+ktiming_region_t ktiming_region_begin();
+uint64_t ktiming_region_end(ktiming_region_t* const region);
+
 #endif  // _KTIMING_H_
@@ -47,16 +47,107 @@ int main(int argc, char** argv) {
   char optchar;
   opterr = 0;
   int selected_test = -1;
-  while ((optchar = getopt(argc, argv, "n:t:sml")) != -1) {
+  bool dump_stats = false;
+  const char* binary_output = NULL;
+  while ((optchar = getopt(argc, argv, "abB:cdF:gj:k:n:o:O:p:t:T:vsml")) != -1) {
     switch (optchar) {
+    case 'a':
+      // -a submits the rotations in the test files that follow
+      // asynchronously.
+      select_async_rotations(true);
+      break;
+    case 'b':
+      // -b batches consecutive rotations in the test files that follow.
+      select_rotate_batching(true);
+      break;
+    case 'B':
+      // -B format runs the benchmark sweep, reporting in that format.
+      if (!benchmark_rotations(optarg)) {
+        fprintf(stderr, "Unknown benchmark format %s.\n", optarg);
+        retval = EXIT_FAILURE;
+      }
+      goto cleanup;
+    case 'c':
+      // -c reports hardware counters in the performance tests that follow.
+      if (!select_perf_counters(true)) {
+        fprintf(stderr, "Hardware counters are not available here.\n");
+      }
+      break;
+    case 'd':
+      // -d dumps the rotation statistics once the tests that follow finish.
+      dump_stats = true;
+      break;
+    case 'F':
+      // -F count[,seed] fuzzes that many random rotations.
+      {
+        char* seed_text = NULL;
+        const size_t case_count = strtoul(optarg, &seed_text, 10);
+        const unsigned int seed = *seed_text == ',' ?
+                                  strtoul(seed_text + 1, NULL, 10) : 6172;
+        retval = fuzz_rotations(case_count, seed) ? EXIT_SUCCESS :
+                                                    EXIT_FAILURE;
+      }
+      goto cleanup;
+    case 'g':
+      // -g makes the bit arrays in the tests that follow segmented.
+      select_segmented_arrays(true);
+      break;
+    case 'j':
+      // -j jobs runs the blocks of the test files that follow on that many
+      // threads.
+      select_test_jobs(atoi(optarg) > 0 ? atoi(optarg) : 1);
+      break;
+    case 'k':
+      // -k strategy forces the rotation strategy for the tests that follow.
+      if (!select_rotate_strategy(optarg)) {
+        fprintf(stderr, "Unknown rotation strategy %s.\n", optarg);
+        retval = EXIT_FAILURE;
+        goto cleanup;
+      }
+      break;
     case 'n':
       selected_test = atoi(optarg);
       break;
+    case 'o':
+      // -o file makes the -t that follows convert its test file into a
+      // binary one instead of running it.
+      binary_output = optarg;
+      break;
+    case 'O':
+      // -O count[,seed] checks the other operations on that many random
+      // bit arrays.
+      {
+        char* seed_text = NULL;
+        const size_t case_count = strtoul(optarg, &seed_text, 10);
+        const unsigned int seed = *seed_text == ',' ?
+                                  strtoul(seed_text + 1, NULL, 10) : 6172;
+        retval = check_operations(case_count, seed) ? EXIT_SUCCESS :
+                                                      EXIT_FAILURE;
+      }
+      goto cleanup;
+    case 'p':
+      // -p threads rotates with that many threads in the tests that follow.
+      select_rotate_threads(atoi(optarg) > 0 ? atoi(optarg) : 1);
+      break;
+    case 'v':
+      // -v makes the bit arrays in the tests that follow lazy.
+      select_lazy_arrays(true);
+      break;
     case 't':
       // -t file runs functional tests in the provided file
+      if (binary_output != NULL) {
+        retval = convert_test_file(optarg, binary_output) ? EXIT_SUCCESS :
+                                                            EXIT_FAILURE;
+        goto cleanup;
+      }
       parse_and_run_tests(optarg, selected_test);
       retval = EXIT_SUCCESS;
       goto cleanup;
+    case 'T':
+      // -T file runs functional tests in the provided binary test file
+      parse_and_run_binary_tests(optarg, selected_test);
+      retval = EXIT_SUCCESS;
+      goto cleanup;
     case 's':
       // -s runs the short rotation performance test.
       printf("---- RESULTS ----\n");
@@ -90,6 +181,10 @@ int main(int argc, char** argv) {
   retval = EXIT_SUCCESS;
 
 cleanup:
+  bitarray_async_shutdown();
+  if (dump_stats && !bitarray_stats_dump(stderr)) {
+    fprintf(stderr, "Rotation statistics need a build with STATS=1.\n");
+  }
   return retval;
 }
 
@@ -99,7 +194,22 @@ void print_usage(const char* const argv_0) {
           "\t -m Run a sample medium (0.1s) rotation operation\n"
           "\t -l Run a sample large (1s) rotation operation\n"
           "\t    (note: the provided -[s/m/l] options only test performance and NOT correctness.)\n"
+          "\t -B csv\tRun the benchmark sweep, reporting as text, csv or json\n"
+          "\t -F 1000,6172\tCheck 1000 random rotations (seed 6172) against a reference\n"
+          "\t -O 1000,6172\tCheck the other operations on 1000 random bit arrays (seed 6172)\n"
           "\t -t tests/default\tRun alltests in the testfile tests/default\n"
-          "\t -n 1 -t tests/default\tRun test 1 in the testfile tests/default\n",
+          "\t -n 1 -t tests/default\tRun test 1 in the testfile tests/default\n"
+          "\t -o default.bin -t tests/default\tConvert the testfile to a binary one\n"
+          "\t -T default.bin\tRun all tests in the binary testfile default.bin\n"
+          "\t -k cycle -t tests/default\tRun the tests with the given rotation strategy\n"
+          "\t    (one of auto, reversal, cycle, shift; must come before -t, -s, -m, -l or -B)\n"
+          "\t -p 4 -l\tRun the tests with rotations split across 4 threads\n"
+          "\t -j 8 -t tests/default\tRun the tests in the file on 8 threads\n"
+          "\t -b -t tests/default\tRun consecutive rotations in each test as one batch\n"
+          "\t -a -t tests/default\tSubmit the rotations with bitarray_rotate_async\n"
+          "\t -v -t tests/default\tRun the tests on lazy bit arrays\n"
+          "\t -g -t tests/default\tRun the tests on segmented bit arrays\n"
+          "\t -c -s\tAlso report cycles, instructions and cache, TLB and branch misses\n"
+          "\t -d -t tests/default\tThen dump the rotation statistics (needs make STATS=1)\n",
           argv_0);
 }
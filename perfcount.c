@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Implements perfcount.h on top of perf_event_open.  Every event is opened
+// on its own rather than as a group, so that one the hardware lacks (dTLB
+// misses are often missing under virtualization) does not take the others
+// with it.
+
+// perf_event_open has no C library wrapper; we need syscall.
+#define _GNU_SOURCE
+
+#include "./perfcount.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+#endif
+
+
+// ******************************** Globals *********************************
+
+// The file descriptor counting each event, or -1.
+static int event_fds[PERFCOUNT_EVENT_COUNT] = {-1, -1, -1, -1, -1};
+
+static const char* const event_names[PERFCOUNT_EVENT_COUNT] = {
+  [PERFCOUNT_CYCLES] = "cycles",
+  [PERFCOUNT_INSTRUCTIONS] = "instr",
+  [PERFCOUNT_LLC_MISSES] = "llc-miss",
+  [PERFCOUNT_DTLB_MISSES] = "dtlb-miss",
+  [PERFCOUNT_BRANCH_MISSES] = "br-miss",
+};
+
+
+// ******************************* Functions ********************************
+
+bool perfcount_open() {
+#ifdef __linux__
+  // The perf_event_attr type and config of each event.
+  static const uint32_t types[PERFCOUNT_EVENT_COUNT] = {
+    [PERFCOUNT_CYCLES] = PERF_TYPE_HARDWARE,
+    [PERFCOUNT_INSTRUCTIONS] = PERF_TYPE_HARDWARE,
+    [PERFCOUNT_LLC_MISSES] = PERF_TYPE_HW_CACHE,
+    [PERFCOUNT_DTLB_MISSES] = PERF_TYPE_HW_CACHE,
+    [PERFCOUNT_BRANCH_MISSES] = PERF_TYPE_HARDWARE,
+  };
+  static const uint64_t configs[PERFCOUNT_EVENT_COUNT] = {
+    [PERFCOUNT_CYCLES] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERFCOUNT_INSTRUCTIONS] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERFCOUNT_LLC_MISSES] = PERF_COUNT_HW_CACHE_LL |
+                             (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                             (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    [PERFCOUNT_DTLB_MISSES] = PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+    [PERFCOUNT_BRANCH_MISSES] = PERF_COUNT_HW_BRANCH_MISSES,
+  };
+
+  bool any = false;
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = types[e];
+    attr.config = configs[e];
+    attr.disabled = 1;
+    // Threads started by a parallel rotation count too.
+    attr.inherit = 1;
+    // Counting only user space works at the default paranoia level.
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    event_fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    any = any || event_fds[e] >= 0;
+  }
+  return any;
+#else
+  return false;
+#endif
+}
+
+void perfcount_close() {
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    if (event_fds[e] >= 0) {
+      close(event_fds[e]);
+      event_fds[e] = -1;
+    }
+  }
+}
+
+void perfcount_start() {
+#ifdef __linux__
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    if (event_fds[e] >= 0) {
+      ioctl(event_fds[e], PERF_EVENT_IOC_RESET, 0);
+      ioctl(event_fds[e], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#endif
+}
+
+void perfcount_stop(perfcount_sample_t* const sample) {
+#ifdef __linux__
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    if (event_fds[e] >= 0) {
+      ioctl(event_fds[e], PERF_EVENT_IOC_DISABLE, 0);
+    }
+  }
+#endif
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    uint64_t value;
+    sample->valid[e] = event_fds[e] >= 0 &&
+                       read(event_fds[e], &value, sizeof(value)) ==
+                       sizeof(value);
+    sample->values[e] = sample->valid[e] ? value : 0;
+  }
+}
+
+const char* perfcount_event_name(const perfcount_event_t event) {
+  return event_names[event];
+}
+
+void perfcount_fprint(FILE* const stream,
+                      const perfcount_sample_t* const sample,
+                      const uint64_t divisor) {
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    if (sample->valid[e]) {
+      fprintf(stream, " %s=%" PRIu64, event_names[e],
+              sample->values[e] / (divisor > 0 ? divisor : 1));
+    }
+  }
+}
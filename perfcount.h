@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2012 MIT License by 6.172 Staff
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ **/
+
+// Reads hardware performance counters through Linux's perf_event_open, so
+// that a rotation can be charged not just for its time but for the cycles,
+// instructions and misses it cost.  The counters only count user-space
+// events of the calling process, including threads it starts while they
+// run.  On other platforms, or where the kernel refuses, nothing is counted.
+
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+// ********************************* Types **********************************
+
+// The events counted.
+typedef enum {
+  PERFCOUNT_CYCLES,
+  PERFCOUNT_INSTRUCTIONS,
+  PERFCOUNT_LLC_MISSES,
+  PERFCOUNT_DTLB_MISSES,
+  PERFCOUNT_BRANCH_MISSES,
+  PERFCOUNT_EVENT_COUNT,
+} perfcount_event_t;
+
+// The counts between a perfcount_start and a perfcount_stop.  valid[e] is
+// false for events this machine could not count.
+typedef struct {
+  uint64_t values[PERFCOUNT_EVENT_COUNT];
+  bool valid[PERFCOUNT_EVENT_COUNT];
+} perfcount_sample_t;
+
+
+// ******************************* Prototypes *******************************
+
+// Opens the counters.  Returns false if none of them can be counted here.
+bool perfcount_open();
+
+// Closes the counters opened by perfcount_open.
+void perfcount_close();
+
+// Resets the counters and starts counting.
+void perfcount_start();
+
+// Stops counting and stores the counts since perfcount_start in sample.
+void perfcount_stop(perfcount_sample_t* const sample);
+
+// Returns the short name of an event, such as "llc-miss".
+const char* perfcount_event_name(const perfcount_event_t event);
+
+// Prints the valid counts of a sample, divided by divisor, as
+// " name=value" pairs.
+void perfcount_fprint(FILE* const stream,
+                      const perfcount_sample_t* const sample,
+                      const uint64_t divisor);
+
+#endif  // PERFCOUNT_H
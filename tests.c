@@ -21,15 +21,23 @@
  **/
 #define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "./bitarray.h"
 #include "./ktiming.h"
+#include "./perfcount.h"
 #include "./tests.h"
 
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -40,42 +48,218 @@
 #define ANSI_COLOR_CYAN    "\x1b[36m"
 #define ANSI_COLOR_RESET   "\x1b[0m"
 
+// ********************************* Types **********************************
+
+// Output formats accepted by benchmark_rotations.
+typedef enum {
+  BENCHMARK_TEXT,
+  BENCHMARK_CSV,
+  BENCHMARK_JSON,
+} benchmark_format_t;
+
+// Everything a test changes as it runs.  Each thread running tests has its
+// own, so that tests can run side by side.
+typedef struct {
+  // The bit array currently under test.
+  bitarray_t* bitarray;
+  // The arena bitarray is allocated in.  It only ever holds that one array,
+  // so every new test case simply resets it.
+  bitarray_arena_t* arena;
+  // Rotations queued by testutil_queue_rotate.
+  bitarray_rotation_t* queue;
+  size_t queue_count;
+  size_t queue_capacity;
+  // Where bit arrays are printed, and where test results are reported.
+  FILE* out;
+  FILE* err;
+} test_context_t;
+
+// A block of a test file: everything from one "t" line up to the next.
+typedef struct {
+  // The lines of the block, each one ending in its newline and then a NUL.
+  char* text;
+  size_t text_len;
+  // The line number of the block's first line in the file.
+  int first_line;
+  // What the block printed to the context's out and err, if it ran on a
+  // thread of its own.
+  char* out_text;
+  size_t out_len;
+  char* err_text;
+  size_t err_len;
+} test_block_t;
+
+// Reads a test file a line at a time, keeping a line that has been read but
+// not used for the next read.
+typedef struct {
+  FILE* file;
+  // The line read, with its length, or a negative length once it is used.
+  char* text;
+  size_t text_size;
+  ssize_t text_len;
+  // The number of lines used so far.
+  int line;
+} test_reader_t;
+
+// A binary test file starts with this header, followed by records that are
+// each a binary_record_t and then, depending on the kind of record:
+//   - 't': the test number, an int64_t;
+//   - 'n' and 'e': the length of the bit array in bits, a uint64_t, and
+//     then its bits packed as bitarray_get_range packs them;
+//   - 'r': the offset, length and right amount of the rotation, as int64_t.
+// Everything is stored in native byte order and lies on an 8-byte boundary,
+// so that a mapped file can be read in place.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  // BINARY_BYTE_ORDER as the writer stored it.
+  uint32_t byte_order;
+} binary_header_t;
+
+typedef struct {
+  // The command, as its letter in the text format.
+  uint32_t kind;
+  // The line of the text file the record was converted from.
+  uint32_t line;
+} binary_record_t;
+
+// Runs the commands of a test block in a context.
+typedef void (*test_block_runner_t)(test_context_t* const context,
+                                    const test_block_t* const block,
+                                    const char* const filename,
+                                    const int selected_test);
+
+// A batch of test blocks for the threads of parse_and_run_tests to share.
+typedef struct {
+  const char* filename;
+  int selected_test;
+  test_block_t* blocks;
+  size_t block_count;
+  // The index of the next block nobody is running yet.
+  size_t* next_block;
+  test_block_runner_t run;
+} test_worker_t;
+
+// A case of fuzz_rotations: one rotation of a subarray, and one strided
+// rotation of fields spread over the same array.
+typedef struct {
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+  size_t first_offset;
+  size_t field_len;
+  size_t stride;
+  size_t field_count;
+  ssize_t field_right_amount;
+} fuzz_case_t;
+
+// A thread the concurrent fuzz variant runs beside its rotation: it rotates
+// the bit_length bits at bit_offset, next to the subarray of the case, back
+// and forth, leaving them as they were.
+typedef struct {
+  bitarray_t* bitarray;
+  size_t bit_offset;
+  size_t bit_length;
+} fuzz_neighbour_t;
+
+// A check of check_operations: does something to bitarray, which holds the
+// bit_sz bits packed in model, drawing what from *state, and returns whether
+// the array, and anything made from it, held the bits the reference says,
+// with model updated to what bitarray should hold now.  path names a
+// scratch file the check may use.
+typedef bool (*check_runner_t)(bitarray_t* const bitarray,
+                               uint64_t* const model,
+                               uint64_t* const state,
+                               const char* const path);
+
+typedef struct {
+  const char* name;
+  check_runner_t run;
+} check_kind_t;
+
+// A change to a file written by bitarray_save: value_bytes bytes of value
+// written at offset, counted from the start of the payload if in_payload.
+// A value_bytes of 0 changes nothing.
+typedef struct {
+  size_t offset;
+  bool in_payload;
+  uint64_t value;
+  size_t value_bytes;
+} check_patch_t;
+
+// A saved file bitarray_load must turn down: one saved with codec, then
+// patched and cut short by cut_bytes.
+typedef struct {
+  const char* name;
+  bitarray_codec_t codec;
+  size_t cut_bytes;
+  check_patch_t patches[2];
+} check_malformed_t;
+
+// A thread of the concurrent check: it rotates random subarrays of the
+// bit_length bits at bit_offset, drawing them from seed.
+typedef struct {
+  bitarray_t* bitarray;
+  size_t bit_offset;
+  size_t bit_length;
+  uint64_t seed;
+} check_rotator_t;
+
+
 // ******************************* Prototypes *******************************
 
-// Creates a new bit array in test_bitarray by parsing a string of 0s
+// Creates a new bit array in context->bitarray by parsing a string of 0s
 // and 1s.  For instance, "0101011011" is a suitable argument.
-void testutil_frmstr(const char* const bitstring);
+void testutil_frmstr(test_context_t* const context,
+                     const char* const bitstring);
 
-// Rotates test_bitarray in place.
-// Requires that test_bitarray is not NULL.
-void testutil_rotate(const size_t bit_offset,
+// Rotates context->bitarray in place.
+// Requires that context->bitarray is not NULL.
+void testutil_rotate(test_context_t* const context,
+                     const size_t bit_offset,
                      const size_t bit_length,
                      const ssize_t bit_right_shift_amount);
 
-// Checks that the rotation is valid given the size of test_bitarray.
+// Checks that the rotation is valid given the size of context->bitarray.
 // Causes a test suite failure if the input is invalid.
-void testutil_require_valid_input(const size_t bit_offset,
+void testutil_require_valid_input(test_context_t* const context,
+                                  const size_t bit_offset,
                                   const size_t bit_length,
                                   const ssize_t bit_right_shift_amount,
                                   const char* const func_name,
                                   const int line);
 
-// Creates a new bit array in test_bitarray of the specified size and
-// fills it with random data based on the seed given.  For a given seed number,
-// the pseudorandom data will be the same (at least on the same glibc
-// implementation).
-static void testutil_newrand(const size_t bit_sz, const unsigned int seed);
+// Sets up a context with no bit array, reporting to the given streams.
+static void testutil_context_init(test_context_t* const context,
+                                  FILE* const out,
+                                  FILE* const err);
+
+// Releases everything a context holds.
+static void testutil_context_destroy(test_context_t* const context);
+
+// Allocates a bit array of the specified size in context->arena, releasing
+// whatever context->bitarray was there before.
+static bitarray_t* testutil_new(test_context_t* const context,
+                                const size_t bit_sz);
+
+// Creates a new bit array in context->bitarray of the specified size and
+// fills it with random data based on the seed given.  For a given seed
+// number, the pseudorandom data will be the same.
+static void testutil_newrand(test_context_t* const context,
+                             const size_t bit_sz,
+                             const unsigned int seed);
 
 // Prints a string representation of a bit array.
 static void bitarray_fprint(FILE* const stream,
                             const bitarray_t* const bitarray);
 
-// Verifies that test_bitarray has the expected content.
+// Verifies that context->bitarray has the expected content.
 // Outputs FAIL or PASS as appropriate.
 // Note: You can call this function directly, but it's much cleaner to use the
 // testutil_expect macro instead.
-// Requires that test_bitarray is not NULL.
-static void testutil_expect_internal(const char* const bitstring,
+// Requires that context->bitarray is not NULL.
+static void testutil_expect_internal(test_context_t* const context,
+                                     const char* const bitstring,
                                      const char* const func_name,
                                      const int line);
 
@@ -83,105 +267,567 @@ static void testutil_expect_internal(const char* const bitstring,
 // the character '0' converts to false.
 static bool boolfromchar(const char c);
 
-// Retrieves a char* argument from a buffer in strtok.
-char* next_arg_char();
+// Retrieves a char* argument from a line being split by strtok_r with the
+// given save pointer.
+char* next_arg_char(char** const save);
+
+// Queues a rotation of context->bitarray for the next
+// testutil_flush_rotations, or submits it with bitarray_rotate_async if the
+// tests rotate asynchronously.
+static void testutil_queue_rotate(test_context_t* const context,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_shift_amount);
 
+// Performs all queued rotations as one batch, and waits for the ones
+// submitted.
+static void testutil_flush_rotations(test_context_t* const context);
 
-// ******************************** Globals *********************************
-// Some global variables make it easier to run individual tests.
+// Reads the next blocks of a test file into blocks, up to max_blocks of
+// them, and returns how many it read.
+static size_t read_test_blocks(test_reader_t* const reader,
+                               test_block_t* const blocks,
+                               const size_t max_blocks);
+
+// Runs the blocks of a batch, on test_jobs threads if there are more than
+// one, and prints what they printed in order.  Uses context when running
+// them all on this thread.
+static void run_test_blocks(test_context_t* const context,
+                            test_block_t* const blocks,
+                            const size_t block_count,
+                            const char* const filename,
+                            const int selected_test,
+                            const test_block_runner_t run);
+
+// Runs the commands of a test block of a text test file in a context.
+static void run_test_block(test_context_t* const context,
+                           const test_block_t* const block,
+                           const char* const filename,
+                           const int selected_test);
+
+// Creates a new bit array of bit_sz bits in context->bitarray, filled with
+// bits packed as bitarray_get_range packs them.
+static void testutil_frmwords(test_context_t* const context,
+                              const size_t bit_sz,
+                              const uint64_t* const words);
+
+// Verifies that context->bitarray has bit_sz bits and the packed content
+// words, by comparing their packed words.  Outputs FAIL or PASS as
+// appropriate.
+static void testutil_expect_words(test_context_t* const context,
+                                  const size_t bit_sz,
+                                  const uint64_t* const words,
+                                  const char* const func_name,
+                                  const int line);
+
+// Returns a string of 0s and 1s of the bit_sz packed bits of words, for
+// the caller to free.
+static char* bitstring_from_words(const uint64_t* const words,
+                                  const size_t bit_sz);
 
-// The bit array currently under test.
-static bitarray_t* test_bitarray = NULL;
+// Returns the size in bytes of the binary record at record, or 0 if it does
+// not end by end or is not a record at all.
+static size_t binary_record_size(const char* const record,
+                                 const char* const end);
+
+// Runs the records of a test block of a binary test file in a context.
+static void run_binary_block(test_context_t* const context,
+                             const test_block_t* const block,
+                             const char* const filename,
+                             const int selected_test);
+
+// Writes a bit string from a text test file to a binary one as its length
+// and packed bits.  Returns false if the string is not all 0s and 1s.
+static bool write_binary_bits(FILE* const f, const char* const bitstring);
+
+// Runs blocks of a worker's batch in a context of the thread's own, keeping
+// what each block prints in the block, until there are none left.
+static void* run_test_worker(void* const arg);
+
+// Times the rotation of one benchmark case on context->bitarray: warmup
+// rotations first, then
+// trials until BENCHMARK_CASE_SECONDS have passed (within the trial count
+// limits).  Stores the trial times, in nanoseconds, in sorted order in
+// times and returns how many there are.  With hardware counters selected,
+// also stores the counts summed over the trials in counts.
+static size_t benchmark_case(test_context_t* const context,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             const ssize_t bit_right_amount,
+                             uint64_t* const times,
+                             perfcount_sample_t* const counts);
+
+// Prints the counts of a benchmark case, per rotation, as extra fields of
+// its line in the given format.
+static void benchmark_print_counts(const benchmark_format_t format,
+                                   const perfcount_sample_t* const counts,
+                                   const size_t trials);
+
+// Orders two uint64_t, for qsort.
+static int compare_times(const void* const a, const void* const b);
+
+// Returns the next number of a SplitMix64 sequence kept in *state.
+static uint64_t fuzz_next(uint64_t* const state);
+
+// The reference rotation the fuzzer checks against: rotates the bit_length
+// bits at bit_offset of the packed bits in src right by bit_right_amount,
+// into dst, one bit at a time.  dst must hold a copy of src on entry.
+static void reference_rotate(uint64_t* const dst,
+                             const uint64_t* const src,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             const ssize_t bit_right_amount);
+
+// Draws a fuzz case for a bit array of bit_sz bits from *state.
+static fuzz_case_t fuzz_draw_case(uint64_t* const state, const size_t bit_sz);
+
+// Rotates context->bitarray as fuzz variant v (one of fuzz_variant_names)
+// does for fuzz_case, timing only the rotation itself.  Returns the time
+// in nanoseconds.
+static uint64_t fuzz_rotate(test_context_t* const context,
+                            const size_t v,
+                            const fuzz_case_t* const fuzz_case);
+
+// Runs the rotations of a fuzz_neighbour_t.
+static void* fuzz_neighbour_worker(void* const arg);
+
+// Counts a rotation of the async fuzz variant done, in the size_t at
+// context.
+static void fuzz_count_done(void* const context);
+
+// Returns whether bitarray holds exactly the bits packed in model.
+static bool check_matches(const bitarray_t* const bitarray,
+                          const uint64_t* const model);
+
+// Returns bit i of the bits packed in model.
+static bool check_model_get(const uint64_t* const model, const size_t i);
+
+// Sets bit i of the bits packed in model to value.
+static void check_model_set(uint64_t* const model,
+                            const size_t i,
+                            const bool value);
+
+// Makes a bit array of bit_sz random bits drawn from *state, packed into
+// model as well, in form f of check_form_names.  Any rotation that takes is
+// applied to model too.
+static bitarray_t* check_new(const size_t bit_sz,
+                             const size_t f,
+                             uint64_t* const model,
+                             uint64_t* const state);
+
+// Draws a rotation of some of the bit_sz bits from *state, as
+// fuzz_draw_case draws the rotation of its case.
+static void check_draw_rotation(uint64_t* const state,
+                                const size_t bit_sz,
+                                size_t* const bit_offset,
+                                size_t* const bit_length,
+                                ssize_t* const bit_right_amount);
+
+// Rotates the bit_sz bits packed in model as bitarray_rotate would.
+static void check_rotate_model(uint64_t* const model,
+                               const size_t bit_sz,
+                               const size_t bit_offset,
+                               const size_t bit_length,
+                               const ssize_t bit_right_amount);
+
+// Saves bitarray with codec and loads the file back with bitarray_load,
+// and with bitarray_load_mmap, which only takes raw files.
+static bool check_save(bitarray_t* const bitarray,
+                       const uint64_t* const model,
+                       const bitarray_codec_t codec,
+                       const char* const path);
+
+// The check kinds, as check_runner_t.
+static bool check_count(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path);
+static bool check_find(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path);
+static bool check_range(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path);
+static bool check_fill(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path);
+static bool check_copy(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path);
+static bool check_snapshot(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path);
+static bool check_mmap(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path);
+static bool check_concurrent(bitarray_t* const bitarray,
+                             uint64_t* const model,
+                             uint64_t* const state,
+                             const char* const path);
+static bool check_async(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path);
+static bool check_save_raw(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path);
+static bool check_save_rle(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path);
+
+// Runs the rotations of a check_rotator_t.
+static void* check_rotator_worker(void* const arg);
+
+// Saves a small random bit array to path as malformed says and spoils the
+// file.  Returns whether bitarray_load and bitarray_load_mmap both turn it
+// down with EINVAL.
+static bool check_rejects(const check_malformed_t* const malformed,
+                          const char* const path);
+
+
+// ******************************** Globals *********************************
+// These select how the tests run; the tests themselves keep everything they
+// change in a test_context_t.
 
 // Whether or not tests should be verbose.
 static bool test_verbose = false;
 
+// The rotation strategy testutil_rotate asks for.
+static bitarray_rotate_strategy_t test_strategy = BITARRAY_ROTATE_AUTO;
+
+// The number of threads testutil_rotate asks for.
+static size_t test_threads = 1;
+
+// Whether parse_and_run_tests hands runs of rotations to
+// bitarray_rotate_batch instead of performing them one at a time.
+static bool test_batch = false;
+
+// The number of threads parse_and_run_tests runs test blocks on.
+static size_t test_jobs = 1;
+
+// Whether the bit arrays under test are lazy.
+static bool test_lazy = false;
+
+// Whether the bit arrays under test are segmented.
+static bool test_segmented = false;
+
+// Whether parse_and_run_tests submits rotations with bitarray_rotate_async,
+// waiting for them only when something else is done with the array.
+static bool test_async = false;
+
+// Whether the performance tests read the hardware counters around each
+// rotation.
+static bool test_counters = false;
+
+// The ways fuzz_rotations rotates: each strategy through
+// bitarray_rotate_with_strategy, bitarray_rotate_parallel, a lazy view that
+// is materialized afterwards, a splice of a segmented array that is then
+// compacted, a rotation of a concurrent array while other threads rotate
+// the bits on either side, three asynchronous rotations that add up to the
+// case's, and the strided rotation of the case's fields on one thread and
+// on several.
+#define FUZZ_VARIANT_COUNT 11
+static const char* const fuzz_variant_names[FUZZ_VARIANT_COUNT] = {
+  "auto", "reversal", "cycle", "shift", "parallel", "lazy", "segmented",
+  "concurrent", "async", "strided", "strided-p",
+};
+
+// fuzz_variant_names from this one on rotate the case's fields.
+#define FUZZ_FIRST_STRIDED 9
+
+// The word kernel sets fuzz_rotations tries, where the CPU has them.
+#define FUZZ_KERNEL_COUNT 4
+static const char* const fuzz_kernel_names[FUZZ_KERNEL_COUNT] = {
+  "portable", "avx2", "avx512", "neon",
+};
+
+static const char* const benchmark_format_names[] = {
+  [BENCHMARK_TEXT] = "text",
+  [BENCHMARK_CSV] = "csv",
+  [BENCHMARK_JSON] = "json",
+};
+
+// Names accepted by select_rotate_strategy, indexed by strategy.
+static const char* const strategy_names[] = {
+  [BITARRAY_ROTATE_AUTO] = "auto",
+  [BITARRAY_ROTATE_REVERSAL] = "reversal",
+  [BITARRAY_ROTATE_CYCLE_LEADER] = "cycle",
+  [BITARRAY_ROTATE_SHIFT_COPY] = "shift",
+};
+
 
 // ********************************* Macros *********************************
 
-// Marks a test as successful, outputting its name and line.
-#define TEST_PASS() TEST_PASS_WITH_NAME(__func__, __LINE__)
+// Marks a test in a context as successful, outputting its name and line.
+#define TEST_PASS(context) TEST_PASS_WITH_NAME(context, __func__, __LINE__)
 
-// Marks a test as successful, outputting the specified name and line.
-#define TEST_PASS_WITH_NAME(name, line)          \
-  fprintf(stderr, " --> %s at line %d: PASS\n", (name), (line))
+// Marks a test in a context as successful, outputting the specified name and
+// line.
+#define TEST_PASS_WITH_NAME(context, name, line)          \
+  fprintf((context)->err, " --> %s at line %d: PASS\n", (name), (line))
 
-// Marks a test as unsuccessful, outputting its name, line, and the specified
-// failure message.
+// Marks a test in a context as unsuccessful, outputting its name, line, and
+// the specified failure message.
 //
 // Use this macro just like you would call printf.
-#define TEST_FAIL(failure_msg, args...)          \
-  TEST_FAIL_WITH_NAME(__func__, __LINE__, failure_msg, ##args)
+#define TEST_FAIL(context, failure_msg, args...)          \
+  TEST_FAIL_WITH_NAME(context, __func__, __LINE__, failure_msg, ##args)
 
-// Marks a test as unsuccessful, outputting the specified name, line, and the
-// failure message.
+// Marks a test in a context as unsuccessful, outputting the specified name,
+// line, and the failure message.
 //
 // Use this macro just like you would call printf.
-#define TEST_FAIL_WITH_NAME(name, line, failure_msg, args...)    \
+#define TEST_FAIL_WITH_NAME(context, name, line, failure_msg, args...)    \
   do {                \
-    fprintf(stderr, " --> %s at line %d: FAIL\n    Reason:", \
+    fprintf((context)->err, " --> %s at line %d: FAIL\n    Reason:", \
       (name), (line));        \
-    fprintf(stderr, (failure_msg), ##args);      \
-    fprintf(stderr, "\n");          \
+    fprintf((context)->err, (failure_msg), ##args);      \
+    fprintf((context)->err, "\n");          \
   } while (0)
 
 // Calls testutil_expect_internal with the current function and line
 // number.
-// Requires that test_bitarray is not NULL.
-#define testutil_expect(bitstring)        \
-  testutil_expect_internal((bitstring), __func__, __LINE__)
+// Requires that context->bitarray is not NULL.
+#define testutil_expect(context, bitstring)        \
+  testutil_expect_internal((context), (bitstring), __func__, __LINE__)
+
+// parse_and_run_tests reads a test file this many blocks at a time, runs
+// them, and reports their results before reading more.
+#define TEST_BATCH_BLOCKS 1024
+
+// The most threads parse_and_run_tests runs test blocks on.
+#define TEST_MAX_JOBS 64
+
+// What tells binary test files apart; see binary_header_t.
+#define BINARY_MAGIC "EVBTESTS"
+#define BINARY_VERSION 1
+#define BINARY_BYTE_ORDER 0x01020304
+
+// The benchmark sweeps every combination of these subarray lengths (in
+// bits), offsets of the subarray from a word boundary, and rotation
+// amounts.  Lengths straddle powers of two so that both whole and partial
+// words are timed.
+#define BENCHMARK_LENGTH_COUNT 7
+#define BENCHMARK_OFFSET_COUNT 3
+#define BENCHMARK_AMOUNT_COUNT 4
+static const size_t benchmark_lengths[BENCHMARK_LENGTH_COUNT] = {
+  64, 1009, 65536, 1048573, 8388608, 33554467, 134217728,
+};
+static const size_t benchmark_offsets[BENCHMARK_OFFSET_COUNT] = {0, 1, 37};
+
+// The amount classes: small, a third, near half and near full, as right
+// rotations of a subarray of length n.
+static const char* const benchmark_amount_names[BENCHMARK_AMOUNT_COUNT] = {
+  "small", "third", "half", "full",
+};
+#define BENCHMARK_AMOUNT(class, n)                                  \
+  ((class) == 0 ? 3 : (class) == 1 ? (n) / 3 :                      \
+   (class) == 2 ? (n) / 2 + 1 : (n) - 3)
+
+// Rotations run before timing starts for each case.
+#define BENCHMARK_WARMUP 3
+
+// Each case runs trials until this much time has passed, but no fewer than
+// BENCHMARK_MIN_TRIALS and no more than BENCHMARK_MAX_TRIALS of them.
+#define BENCHMARK_CASE_SECONDS 0.05
+#define BENCHMARK_MIN_TRIALS 5
+#define BENCHMARK_MAX_TRIALS 1000
+
+// Most fuzz cases have arrays of up to 2^FUZZ_SMALL_LOG bits; one in
+// FUZZ_LARGE_EVERY has up to 2^FUZZ_LARGE_LOG, enough for the parallel and
+// cycle-leader rotations to do their real work.
+#define FUZZ_SMALL_LOG 14
+#define FUZZ_LARGE_LOG 25
+#define FUZZ_LARGE_EVERY 256
+
+// The threads the parallel fuzz variant rotates with.
+#define FUZZ_THREADS 4
+
+// The concurrent fuzz variant's neighbours rotate up to this many bits on
+// either side of the subarray, back and forth this many times.
+#define FUZZ_NEIGHBOUR_BITS 200
+#define FUZZ_NEIGHBOUR_ROUNDS 64
+
+// fuzz_rotations describes no more than this many mismatches in detail.
+#define FUZZ_MAX_REPORTS 10
+
+// Most check_operations cases have arrays of up to 2^CHECK_SMALL_LOG bits;
+// one in CHECK_LARGE_EVERY has up to 2^CHECK_LARGE_LOG, enough to cross the
+// 4 KB chunks of snapshots and several pages of a file.
+#define CHECK_SMALL_LOG 12
+#define CHECK_LARGE_LOG 18
+#define CHECK_LARGE_EVERY 64
+
+// The forms check_operations puts every array in: flat, lazy with a
+// recorded rotation, and segmented by a few spliced ones.
+#define CHECK_FORM_COUNT 3
+static const char* const check_form_names[CHECK_FORM_COUNT] = {
+  "flat", "lazy", "segmented",
+};
+
+static const check_kind_t check_kinds[] = {
+  {"range", check_range},
+  {"fill", check_fill},
+  {"copy", check_copy},
+  {"count", check_count},
+  {"find", check_find},
+  {"snapshot", check_snapshot},
+  {"mmap", check_mmap},
+  {"save-raw", check_save_raw},
+  {"save-rle", check_save_rle},
+  {"concurrent", check_concurrent},
+  {"async", check_async},
+};
+#define CHECK_KIND_COUNT (sizeof(check_kinds) / sizeof(check_kinds[0]))
+
+// Where bitarray_save puts the fields of its header.
+#define SAVE_AT_VERSION 8
+#define SAVE_AT_BYTE_ORDER 12
+#define SAVE_AT_BIT_SZ 16
+#define SAVE_AT_CODEC 24
+#define SAVE_AT_PAYLOAD_OFFSET 32
+#define SAVE_AT_PAYLOAD_BYTES 40
+
+// The concurrent check rotates on this many threads, this many times on
+// each.
+#define CHECK_THREADS 4
+#define CHECK_ROUNDS 32
+
+// The async check submits this many rotations of each array.
+#define CHECK_ASYNC_ROTATIONS 64
+
+// The count and find checks make this many queries of each array.
+#define CHECK_QUERIES 8
+
+// The size of the arrays check_rejects spoils the files of.
+#define CHECK_MALFORMED_BITS 1000
+
+// A size that wraps the buffer size of an array around.
+#define CHECK_HUGE_BITS (UINT64_MAX - 10)
+
+static const check_malformed_t check_malformed_files[] = {
+  {"magic", BITARRAY_CODEC_RAW, 0, {{0, false, 0, 8}}},
+  {"version", BITARRAY_CODEC_RAW, 0, {{SAVE_AT_VERSION, false, 2, 4}}},
+  {"byte-order", BITARRAY_CODEC_RLE, 0,
+   {{SAVE_AT_BYTE_ORDER, false, 0x04030201, 4}}},
+  {"codec", BITARRAY_CODEC_RAW, 0, {{SAVE_AT_CODEC, false, 7, 4}}},
+  {"offset", BITARRAY_CODEC_RLE, 0,
+   {{SAVE_AT_PAYLOAD_OFFSET, false, 0, 8}}},
+  {"raw-length", BITARRAY_CODEC_RAW, 0,
+   {{SAVE_AT_PAYLOAD_BYTES, false, CHECK_MALFORMED_BITS / 8 + 8, 8}}},
+  {"raw-huge", BITARRAY_CODEC_RAW, 0,
+   {{SAVE_AT_BIT_SZ, false, CHECK_HUGE_BITS, 8},
+    {SAVE_AT_PAYLOAD_BYTES, false, CHECK_HUGE_BITS / 8 + 1, 8}}},
+  {"rle-huge", BITARRAY_CODEC_RLE, 0,
+   {{SAVE_AT_BIT_SZ, false, CHECK_HUGE_BITS, 8}}},
+  {"rle-past-end", BITARRAY_CODEC_RLE, 0,
+   {{SAVE_AT_PAYLOAD_BYTES, false, 1 << 20, 8}}},
+  {"raw-cut", BITARRAY_CODEC_RAW, 1, {{0}}},
+  {"rle-cut", BITARRAY_CODEC_RLE, 8, {{0}}},
+  {"rle-token", BITARRAY_CODEC_RLE, 0,
+   {{0, true, UINT64_C(1) << 63 | 1, 8}}},
+};
+#define CHECK_MALFORMED_COUNT \
+  (sizeof(check_malformed_files) / sizeof(check_malformed_files[0]))
 
-// Retrieves an integer from the strtok buffer.
-#define NEXT_ARG_LONG() atol(strtok(NULL, " "))
+// Retrieves an integer from a line being split by strtok_r with the given
+// save pointer.
+#define NEXT_ARG_LONG(save) atol(strtok_r(NULL, " ", (save)))
 
 // ******************************* Functions ********************************
 
-static void testutil_newrand(const size_t bit_sz, const unsigned int seed) {
-  // If we somehow managed to avoid freeing test_bitarray after a previous
-  // test, go free it now.
-  if (test_bitarray != NULL) {
-    bitarray_free(test_bitarray);
+static void testutil_context_init(test_context_t* const context,
+                                  FILE* const out,
+                                  FILE* const err) {
+  context->bitarray = NULL;
+  context->arena = NULL;
+  context->queue = NULL;
+  context->queue_count = 0;
+  context->queue_capacity = 0;
+  context->out = out;
+  context->err = err;
+}
+
+static void testutil_context_destroy(test_context_t* const context) {
+  if (context->arena != NULL) {
+    bitarray_arena_free(context->arena);
   }
+  free(context->queue);
+  testutil_context_init(context, context->out, context->err);
+}
 
-  test_bitarray = bitarray_new(bit_sz);
-  assert(test_bitarray != NULL);
+static bitarray_t* testutil_new(test_context_t* const context,
+                                const size_t bit_sz) {
+  if (context->arena == NULL) {
+    context->arena = bitarray_arena_new(0);
+    assert(context->arena != NULL);
+  }
+  // The old bit array goes away with the reset.
+  context->bitarray = NULL;
+  bitarray_arena_reset(context->arena);
+  return bitarray_new_in(context->arena, bit_sz);
+}
 
-  // Reseed the RNG with whatever we were passed; this ensures that we can
-  // repeat the test deterministically by specifying the same seed.
-  srand(seed);
+static void testutil_newrand(test_context_t* const context,
+                             const size_t bit_sz,
+                             const unsigned int seed) {
+  // If we somehow managed to avoid freeing the bit array after a previous
+  // test, go free it now.
+  if (context->bitarray != NULL) {
+    bitarray_free(context->bitarray);
+  }
 
-  bitarray_randfill(test_bitarray);
+  context->bitarray = testutil_new(context, bit_sz);
+  assert(context->bitarray != NULL);
+  bitarray_set_lazy(context->bitarray, test_lazy);
+  bitarray_set_segmented(context->bitarray, test_segmented);
+
+  // The fill is determined by the seed alone; this ensures that we can
+  // repeat the test deterministically by specifying the same seed, however
+  // many threads do the filling.
+  bitarray_randfill_parallel(context->bitarray, seed, test_threads);
 
   // If we were asked to be verbose, go ahead and show the bit array and
   // the random seed.
   if (test_verbose) {
-    bitarray_fprint(stdout, test_bitarray);
-    fprintf(stdout, " newrand sz=%zu, seed=%u\n",
+    bitarray_fprint(context->out, context->bitarray);
+    fprintf(context->out, " newrand sz=%zu, seed=%u\n",
             bit_sz, seed);
   }
 }
 
-void testutil_frmstr(const char* const bitstring) {
+void testutil_frmstr(test_context_t* const context,
+                     const char* const bitstring) {
   const size_t bitstring_length = strlen(bitstring);
 
-  // If we somehow managed to avoid freeing test_bitarray after a previous
+  // If we somehow managed to avoid freeing the bit array after a previous
   // test, go free it now.
-  if (test_bitarray != NULL) {
-    bitarray_free(test_bitarray);
+  if (context->bitarray != NULL) {
+    bitarray_free(context->bitarray);
   }
 
-  test_bitarray = bitarray_new(bitstring_length);
-  assert(test_bitarray != NULL);
+  context->bitarray = testutil_new(context, bitstring_length);
+  assert(context->bitarray != NULL);
+  bitarray_set_lazy(context->bitarray, test_lazy);
+  bitarray_set_segmented(context->bitarray, test_segmented);
 
   bool current_bit;
   for (size_t i = 0; i < bitstring_length; i++) {
     current_bit = boolfromchar(bitstring[i]);
-    bitarray_set(test_bitarray, i, current_bit);
+    bitarray_set(context->bitarray, i, current_bit);
   }
-  bitarray_fprint(stdout, test_bitarray);
+  bitarray_fprint(context->out, context->bitarray);
   if (test_verbose) {
-    fprintf(stdout, " newstr lit=%s\n", bitstring);
-    testutil_expect(bitstring);
+    fprintf(context->out, " newstr lit=%s\n", bitstring);
+    testutil_expect(context, bitstring);
   }
 }
 
@@ -192,33 +838,35 @@ static void bitarray_fprint(FILE* const stream,
   }
 }
 
-static void testutil_expect_internal(const char* bitstring,
+static void testutil_expect_internal(test_context_t* const context,
+                                     const char* bitstring,
                                      const char* const func_name,
                                      const int line) {
   // The reason why the test fails.  If the test passes, this will stay
   // NULL.
   const char* bad = NULL;
 
-  assert(test_bitarray != NULL);
+  const bitarray_t* const bitarray = context->bitarray;
+  assert(bitarray != NULL);
 
   // Check the length of the bit array under test.
   const size_t bitstring_length = strlen(bitstring);
-  if (bitstring_length != bitarray_get_bit_sz(test_bitarray)) {
+  if (bitstring_length != bitarray_get_bit_sz(bitarray)) {
     bad = "bitarray size";
   }
 
   // Check the content.
   for (size_t i = 0; i < bitstring_length; i++) {
-    if (bitarray_get(test_bitarray, i) != boolfromchar(bitstring[i])) {
+    if (bitarray_get(bitarray, i) != boolfromchar(bitstring[i])) {
       bad = "bitarray content";
     }
   }
 
   // Obtain a string for the actual bitstring.
-  const size_t actual_bitstring_length = bitarray_get_bit_sz(test_bitarray);
+  const size_t actual_bitstring_length = bitarray_get_bit_sz(bitarray);
   char* actual_bitstring = calloc(sizeof(char), bitstring_length + 1);
   for (size_t i = 0; i < actual_bitstring_length; i++) {
-    if (bitarray_get(test_bitarray, i)) {
+    if (bitarray_get(bitarray, i)) {
       actual_bitstring[i] = '1';
     } else {
       actual_bitstring[i] = '0';
@@ -226,38 +874,94 @@ static void testutil_expect_internal(const char* bitstring,
   }
 
   if (bad != NULL) {
-    bitarray_fprint(stdout, test_bitarray);
-    fprintf(stdout, " expect bits=%s \n", bitstring);
-    TEST_FAIL_WITH_NAME(func_name, line, " Incorrect %s.\n    Expected: %s\n    Actual:   %s",
+    bitarray_fprint(context->out, bitarray);
+    fprintf(context->out, " expect bits=%s \n", bitstring);
+    TEST_FAIL_WITH_NAME(context, func_name, line, " Incorrect %s.\n    Expected: %s\n    Actual:   %s",
                         bad, bitstring, actual_bitstring);
   } else {
-    TEST_PASS_WITH_NAME(func_name, line);
+    TEST_PASS_WITH_NAME(context, func_name, line);
   }
   free(actual_bitstring);
 }
 
-void testutil_rotate(const size_t bit_offset,
+void testutil_rotate(test_context_t* const context,
+                     const size_t bit_offset,
                      const size_t bit_length,
                      const ssize_t bit_right_shift_amount) {
-  assert(test_bitarray != NULL);
-  bitarray_rotate(test_bitarray, bit_offset, bit_length, bit_right_shift_amount);
+  assert(context->bitarray != NULL);
+  if (test_threads > 1) {
+    bitarray_rotate_parallel(context->bitarray, bit_offset, bit_length,
+                             bit_right_shift_amount, test_threads);
+  } else {
+    bitarray_rotate_with_strategy(context->bitarray, bit_offset, bit_length,
+                                  bit_right_shift_amount, test_strategy);
+  }
   if (test_verbose) {
-    bitarray_fprint(stdout, test_bitarray);
-    fprintf(stdout, " rotate off=%zu, len=%zu, amnt=%zd\n",
+    bitarray_fprint(context->out, context->bitarray);
+    fprintf(context->out, " rotate off=%zu, len=%zu, amnt=%zd\n",
             bit_offset, bit_length, bit_right_shift_amount);
   }
 }
 
-void testutil_require_valid_input(const size_t bit_offset,
+static void testutil_queue_rotate(test_context_t* const context,
+                                  const size_t bit_offset,
+                                  const size_t bit_length,
+                                  const ssize_t bit_right_shift_amount) {
+  if (test_async) {
+    const bitarray_ticket_t ticket =
+      bitarray_rotate_async(context->bitarray, bit_offset, bit_length,
+                            bit_right_shift_amount, NULL, NULL);
+    if (test_verbose) {
+      bitarray_async_wait(context->bitarray, ticket);
+      bitarray_fprint(context->out, context->bitarray);
+      fprintf(context->out, " rotate off=%zu, len=%zu, amnt=%zd\n",
+              bit_offset, bit_length, bit_right_shift_amount);
+    }
+    return;
+  }
+  if (context->queue_count == context->queue_capacity) {
+    context->queue_capacity = context->queue_capacity ?
+                              2 * context->queue_capacity : 64;
+    context->queue = realloc(context->queue,
+                             context->queue_capacity *
+                             sizeof(bitarray_rotation_t));
+    assert(context->queue != NULL);
+  }
+  bitarray_rotation_t* const rotation = &context->queue[context->queue_count];
+  rotation->bit_offset = bit_offset;
+  rotation->bit_length = bit_length;
+  rotation->bit_right_amount = bit_right_shift_amount;
+  context->queue_count++;
+}
+
+static void testutil_flush_rotations(test_context_t* const context) {
+  if (test_async && context->bitarray != NULL) {
+    bitarray_async_drain(context->bitarray);
+  }
+  if (context->queue_count == 0) {
+    return;
+  }
+  assert(context->bitarray != NULL);
+  bitarray_rotate_batch_parallel(context->bitarray, context->queue,
+                                 context->queue_count, test_threads);
+  if (test_verbose) {
+    bitarray_fprint(context->out, context->bitarray);
+    fprintf(context->out, " rotate batch of %zu\n", context->queue_count);
+  }
+  context->queue_count = 0;
+}
+
+void testutil_require_valid_input(test_context_t* const context,
+                                  const size_t bit_offset,
                                   const size_t bit_length,
                                   const ssize_t bit_right_shift_amount,
                                   const char* const func_name,
                                   const int line) {
-  size_t bitarray_length = bitarray_get_bit_sz(test_bitarray);
+  size_t bitarray_length = bitarray_get_bit_sz(context->bitarray);
   if (bit_offset >= bitarray_length || bit_length > bitarray_length ||
       bit_offset + bit_length > bitarray_length) {
     // invalid input
-    TEST_FAIL_WITH_NAME(func_name, line, " TEST SUITE ERROR - " \
+    TEST_FAIL_WITH_NAME(context, func_name, line, " TEST SUITE ERROR - " \
                         "bit_offset + bit_length > bitarray_length");
   }
 }
@@ -270,6 +974,8 @@ int timed_rotation(const double time_limit_seconds) {
   // We're going to be doing a bunch of rotations; we probably shouldn't
   // let the user see all the verbose output.
   test_verbose = false;
+  test_context_t context;
+  testutil_context_init(&context, stdout, stderr);
 
   // Continue until the rotation exceeds time_limits_seconds
   int tier_num = 0;
@@ -284,13 +990,29 @@ int timed_rotation(const double time_limit_seconds) {
     assert(bit_sz > bit_offset + bit_length);
 
     // Initialize a new bit_array
-    testutil_newrand(bit_sz, 6172);
+    testutil_newrand(&context, bit_sz, 6172);
  
-    // Time the duration of a rotation
-    const clockmark_t start_time = ktiming_getmark();
-    testutil_rotate(bit_offset, bit_length, bit_right_shift_amount);
-    const clockmark_t end_time = ktiming_getmark();
-    double diff_seconds = ktiming_diff_usec(&start_time, &end_time) / 1000000000.0;
+    // Time the duration of a rotation.  The region timer reads the wall
+    // clock, so a parallel rotation is not charged for every thread, and
+    // subtracts its own cost, so the small tiers do not read as noise.
+    // The counters, if any, are started outside the region so that their
+    // system calls are not timed.
+    uint64_t diff_nsec = 0;
+    perfcount_sample_t counts;
+    if (test_counters) {
+      perfcount_start();
+    }
+    KTIMING_REGION(diff_nsec) {
+      testutil_rotate(&context, bit_offset, bit_length,
+                      bit_right_shift_amount);
+      if (test_lazy) {
+        bitarray_materialize(context.bitarray);
+      }
+    }
+    if (test_counters) {
+      perfcount_stop(&counts);
+    }
+    double diff_seconds = diff_nsec / 1000000000.0;
 
     //char *str_size = NULL;
     char buf[20];
@@ -306,26 +1028,1181 @@ int timed_rotation(const double time_limit_seconds) {
     if (diff_seconds < time_limit_seconds){
       printf("Tier %d (≈%s) completed in " ANSI_COLOR_GREEN "%.6fs" ANSI_COLOR_RESET "\n",
         tier_num, buf, diff_seconds);
+      if (test_counters) {
+        printf("       ");
+        perfcount_fprint(stdout, &counts, 1);
+        printf("\n");
+      }
       tier_num++;
     } else {
       printf("Tier %d (≈%s) exceeded %.2fs cutoff with time" ANSI_COLOR_RED " %.6fs" ANSI_COLOR_RESET "\n",
          tier_num, buf, time_limit_seconds, diff_seconds);
-      // Return the last tier that was succesful.
-      return tier_num - 1;
+      break;
     }
   }
+  testutil_context_destroy(&context);
 
   // Return the last tier that was succesful.
   return tier_num - 1;
 }
 
+bool benchmark_rotations(const char* const format_name) {
+  benchmark_format_t format = BENCHMARK_TEXT;
+  const size_t format_count =
+    sizeof(benchmark_format_names) / sizeof(benchmark_format_names[0]);
+  size_t f = 0;
+  while (f < format_count && strcmp(format_name, benchmark_format_names[f])) {
+    f++;
+  }
+  if (f == format_count) {
+    return false;
+  }
+  format = (benchmark_format_t) f;
+  test_verbose = false;
+  test_context_t context;
+  testutil_context_init(&context, stdout, stderr);
+
+  uint64_t* const times = malloc(BENCHMARK_MAX_TRIALS * sizeof(uint64_t));
+  assert(times != NULL);
+  perfcount_sample_t counts;
+  const char* const strategy = strategy_names[test_strategy];
+  const char* const kernels = bitarray_get_kernels();
+  if (format == BENCHMARK_CSV) {
+    printf("length,offset,amount_class,amount,strategy,kernels,threads,lazy,"
+           "trials,median_ns,p99_ns,min_ns,gb_per_s");
+    for (int e = 0; test_counters && e < PERFCOUNT_EVENT_COUNT; e++) {
+      printf(",%s", perfcount_event_name(e));
+    }
+    printf("\n");
+  } else if (format == BENCHMARK_JSON) {
+    printf("[\n");
+  } else {
+    printf("%10s %6s %6s %10s %8s %12s %12s %12s %9s%s\n", "length", "offset",
+           "class", "amount", "trials", "median_ns", "p99_ns", "min_ns", "GB/s",
+           test_counters ? "  counts per rotation" : "");
+  }
+
+  bool first = true;
+  for (size_t l = 0; l < BENCHMARK_LENGTH_COUNT; l++) {
+    for (size_t o = 0; o < BENCHMARK_OFFSET_COUNT; o++) {
+      const size_t bit_length = benchmark_lengths[l];
+      const size_t bit_offset = benchmark_offsets[o];
+      // Some slack past the subarray keeps its last word from being the
+      // last word of the array.
+      testutil_newrand(&context, bit_offset + bit_length + 128, 6172);
+      for (size_t a = 0; a < BENCHMARK_AMOUNT_COUNT; a++) {
+        const ssize_t amount = BENCHMARK_AMOUNT(a, bit_length);
+        const size_t trials = benchmark_case(&context, bit_offset,
+                                             bit_length, amount, times,
+                                             &counts);
+        const uint64_t median = times[trials / 2];
+        const uint64_t p99 = times[(trials * 99 + 99) / 100 - 1];
+        const uint64_t fastest = times[0];
+        // Bytes of the subarray per nanosecond are gigabytes per second.
+        const double gb_per_s = median > 0 ? bit_length / 8.0 / median : 0;
+
+        if (format == BENCHMARK_CSV) {
+          printf("%zu,%zu,%s,%zd,%s,%s,%zu,%d,%zu,%" PRIu64 ",%" PRIu64
+                 ",%" PRIu64 ",%.3f",
+                 bit_length, bit_offset, benchmark_amount_names[a], amount,
+                 strategy, kernels, test_threads, test_lazy ? 1 : 0, trials,
+                 median, p99, fastest, gb_per_s);
+          benchmark_print_counts(format, &counts, trials);
+          printf("\n");
+        } else if (format == BENCHMARK_JSON) {
+          printf("%s  {\"length\": %zu, \"offset\": %zu, "
+                 "\"amount_class\": \"%s\", \"amount\": %zd, "
+                 "\"strategy\": \"%s\", \"kernels\": \"%s\", "
+                 "\"threads\": %zu, \"lazy\": %s, \"trials\": %zu, "
+                 "\"median_ns\": %" PRIu64 ", \"p99_ns\": %" PRIu64 ", "
+                 "\"min_ns\": %" PRIu64 ", \"gb_per_s\": %.3f",
+                 first ? "" : ",\n", bit_length, bit_offset,
+                 benchmark_amount_names[a], amount, strategy, kernels,
+                 test_threads, test_lazy ? "true" : "false", trials, median,
+                 p99, fastest, gb_per_s);
+          benchmark_print_counts(format, &counts, trials);
+          printf("}");
+        } else {
+          printf("%10zu %6zu %6s %10zd %8zu %12" PRIu64 " %12" PRIu64
+                 " %12" PRIu64 " %9.3f",
+                 bit_length, bit_offset, benchmark_amount_names[a], amount,
+                 trials, median, p99, fastest, gb_per_s);
+          benchmark_print_counts(format, &counts, trials);
+          printf("\n");
+        }
+        first = false;
+        fflush(stdout);
+      }
+    }
+  }
+  if (format == BENCHMARK_JSON) {
+    printf("\n]\n");
+  }
+  free(times);
+  testutil_context_destroy(&context);
+  return true;
+}
+
+static size_t benchmark_case(test_context_t* const context,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             const ssize_t bit_right_amount,
+                             uint64_t* const times,
+                             perfcount_sample_t* const counts) {
+  for (size_t i = 0; i < BENCHMARK_WARMUP; i++) {
+    testutil_rotate(context, bit_offset, bit_length, bit_right_amount);
+  }
+  if (test_lazy) {
+    bitarray_materialize(context->bitarray);
+  }
+
+  // Trials are timed by the wall clock, which is what a parallel rotation
+  // saves, one rotation at a time so that the spread shows.  The timer's
+  // own cost is taken off each.
+  const uint64_t budget_ns = BENCHMARK_CASE_SECONDS * 1e9;
+  uint64_t total_ns = 0;
+  size_t trials = 0;
+  memset(counts, 0, sizeof(*counts));
+  while (trials < BENCHMARK_MAX_TRIALS &&
+         (trials < BENCHMARK_MIN_TRIALS || total_ns < budget_ns)) {
+    perfcount_sample_t trial_counts;
+    if (test_counters) {
+      perfcount_start();
+    }
+    // A lazy array only records the rotation as a view, so carrying the
+    // view out is part of what is timed.
+    KTIMING_REGION(times[trials]) {
+      testutil_rotate(context, bit_offset, bit_length, bit_right_amount);
+      if (test_lazy) {
+        bitarray_materialize(context->bitarray);
+      }
+    }
+    if (test_counters) {
+      perfcount_stop(&trial_counts);
+      for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+        counts->values[e] += trial_counts.values[e];
+        counts->valid[e] = trial_counts.valid[e];
+      }
+    }
+    total_ns += times[trials];
+    trials++;
+  }
+  qsort(times, trials, sizeof(uint64_t), compare_times);
+  return trials;
+}
+
+static void benchmark_print_counts(const benchmark_format_t format,
+                                   const perfcount_sample_t* const counts,
+                                   const size_t trials) {
+  if (!test_counters) {
+    return;
+  }
+  if (format == BENCHMARK_TEXT) {
+    printf(" ");
+    perfcount_fprint(stdout, counts, trials);
+    return;
+  }
+  for (int e = 0; e < PERFCOUNT_EVENT_COUNT; e++) {
+    const char* const name = perfcount_event_name(e);
+    const uint64_t value = counts->values[e] / trials;
+    if (format == BENCHMARK_CSV) {
+      // An event this machine cannot count leaves its column empty.
+      if (counts->valid[e]) {
+        printf(",%" PRIu64, value);
+      } else {
+        printf(",");
+      }
+    } else if (counts->valid[e]) {
+      printf(", \"%s\": %" PRIu64, name, value);
+    } else {
+      printf(", \"%s\": null", name);
+    }
+  }
+}
+
+static int compare_times(const void* const a, const void* const b) {
+  const uint64_t x = *(const uint64_t*)a;
+  const uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+bool fuzz_rotations(const size_t case_count, const unsigned int seed) {
+  test_verbose = false;
+  test_context_t context;
+  testutil_context_init(&context, stdout, stderr);
+  const char* const original_kernels = bitarray_get_kernels();
+
+  bool kernel_ok[FUZZ_KERNEL_COUNT];
+  for (size_t k = 0; k < FUZZ_KERNEL_COUNT; k++) {
+    kernel_ok[k] = bitarray_set_kernels(fuzz_kernel_names[k]);
+  }
+  uint64_t mismatches[FUZZ_KERNEL_COUNT][FUZZ_VARIANT_COUNT] = {{0}};
+  uint64_t total_ns[FUZZ_KERNEL_COUNT][FUZZ_VARIANT_COUNT] = {{0}};
+  uint64_t total_bits = 0;
+  uint64_t total_field_bits = 0;
+  size_t reports = 0;
+
+  uint64_t state = seed;
+  for (size_t c = 0; c < case_count; c++) {
+    // Draw a case: the array size on a log scale, so that short and long
+    // rotations, whole words and partial ones all come up.
+    const unsigned max_log = c % FUZZ_LARGE_EVERY == FUZZ_LARGE_EVERY - 1 ?
+                             FUZZ_LARGE_LOG : FUZZ_SMALL_LOG;
+    const size_t bit_sz = 1 + fuzz_next(&state) %
+                          ((size_t) 1 << (fuzz_next(&state) % max_log + 1));
+    const fuzz_case_t fuzz_case = fuzz_draw_case(&state, bit_sz);
+    total_bits += fuzz_case.bit_length;
+    total_field_bits += fuzz_case.field_count * fuzz_case.field_len;
+
+    testutil_newrand(&context, bit_sz, seed + c);
+    const size_t words = (bit_sz + 63) / 64;
+    uint64_t* const initial = malloc(words * sizeof(uint64_t));
+    uint64_t* const expected = malloc(words * sizeof(uint64_t));
+    uint64_t* const expected_fields = malloc(words * sizeof(uint64_t));
+    uint64_t* const actual = malloc(words * sizeof(uint64_t));
+    assert(initial != NULL && expected != NULL && expected_fields != NULL &&
+           actual != NULL);
+    bitarray_get_range(context.bitarray, 0, bit_sz, initial);
+    memcpy(expected, initial, words * sizeof(uint64_t));
+    reference_rotate(expected, initial, fuzz_case.bit_offset,
+                     fuzz_case.bit_length, fuzz_case.bit_right_amount);
+    // The fields are disjoint, so each one can be rotated from initial.
+    memcpy(expected_fields, initial, words * sizeof(uint64_t));
+    for (size_t f = 0; f < fuzz_case.field_count; f++) {
+      reference_rotate(expected_fields, initial,
+                       fuzz_case.first_offset + f * fuzz_case.stride,
+                       fuzz_case.field_len, fuzz_case.field_right_amount);
+    }
+
+    for (size_t k = 0; k < FUZZ_KERNEL_COUNT; k++) {
+      if (!kernel_ok[k]) {
+        continue;
+      }
+      bitarray_set_kernels(fuzz_kernel_names[k]);
+      for (size_t v = 0; v < FUZZ_VARIANT_COUNT; v++) {
+        bitarray_set_range(context.bitarray, 0, bit_sz, initial);
+        total_ns[k][v] += fuzz_rotate(&context, v, &fuzz_case);
+        bitarray_get_range(context.bitarray, 0, bit_sz, actual);
+        const bool strided = v >= FUZZ_FIRST_STRIDED;
+        if (memcmp(actual, strided ? expected_fields : expected,
+                   words * sizeof(uint64_t)) != 0) {
+          mismatches[k][v]++;
+          if (reports++ >= FUZZ_MAX_REPORTS) {
+            continue;
+          }
+          if (strided) {
+            fprintf(stderr, "MISMATCH kernels=%s variant=%s seed=%u "
+                    "size=%zu first=%zu field=%zu stride=%zu count=%zu "
+                    "amount=%zd\n",
+                    fuzz_kernel_names[k], fuzz_variant_names[v],
+                    (unsigned int) (seed + c), bit_sz,
+                    fuzz_case.first_offset, fuzz_case.field_len,
+                    fuzz_case.stride, fuzz_case.field_count,
+                    fuzz_case.field_right_amount);
+          } else {
+            fprintf(stderr, "MISMATCH kernels=%s variant=%s seed=%u "
+                    "size=%zu offset=%zu length=%zu amount=%zd\n",
+                    fuzz_kernel_names[k], fuzz_variant_names[v],
+                    (unsigned int) (seed + c), bit_sz,
+                    fuzz_case.bit_offset, fuzz_case.bit_length,
+                    fuzz_case.bit_right_amount);
+          }
+        }
+      }
+    }
+    free(initial);
+    free(expected);
+    free(expected_fields);
+    free(actual);
+  }
+  bitarray_set_kernels(original_kernels);
+  testutil_context_destroy(&context);
+
+  printf("%zu cases, %" PRIu64 " bits rotated per variant and %" PRIu64
+         " per strided variant, seed %u\n",
+         case_count, total_bits, total_field_bits, seed);
+  printf("%-9s %-10s %10s %12s %10s\n", "kernels", "variant", "mismatches",
+         "ops_per_s", "GB/s");
+  bool ok = true;
+  for (size_t k = 0; k < FUZZ_KERNEL_COUNT; k++) {
+    for (size_t v = 0; kernel_ok[k] && v < FUZZ_VARIANT_COUNT; v++) {
+      const double seconds = total_ns[k][v] / 1e9;
+      const uint64_t bits = v >= FUZZ_FIRST_STRIDED ? total_field_bits :
+                                                      total_bits;
+      printf("%-9s %-10s %10" PRIu64 " %12.0f %10.3f\n",
+             fuzz_kernel_names[k], fuzz_variant_names[v], mismatches[k][v],
+             seconds > 0 ? case_count / seconds : 0,
+             total_ns[k][v] > 0 ? bits / 8.0 / total_ns[k][v] : 0);
+      ok = ok && mismatches[k][v] == 0;
+    }
+  }
+  return ok;
+}
+
+static uint64_t fuzz_next(uint64_t* const state) {
+  uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+static void reference_rotate(uint64_t* const dst,
+                             const uint64_t* const src,
+                             const size_t bit_offset,
+                             const size_t bit_length,
+                             const ssize_t bit_right_amount) {
+  // Bit i of the subarray moves to bit (i + right) mod length.
+  const ssize_t length = bit_length;
+  const size_t right = ((bit_right_amount % length) + length) % length;
+  for (size_t i = 0; i < bit_length; i++) {
+    const size_t from = bit_offset + i;
+    size_t to = i + right;
+    if (to >= bit_length) {
+      to -= bit_length;
+    }
+    to += bit_offset;
+    const uint64_t bit = (src[from / 64] >> (from % 64)) & 1;
+    dst[to / 64] = (dst[to / 64] & ~(UINT64_C(1) << (to % 64))) |
+                   bit << (to % 64);
+  }
+}
+
+static void* fuzz_neighbour_worker(void* const arg) {
+  const fuzz_neighbour_t* const neighbour = arg;
+  for (size_t r = 0; neighbour->bit_length > 1 &&
+                     r < FUZZ_NEIGHBOUR_ROUNDS; r++) {
+    const ssize_t amount = 1 + r % (neighbour->bit_length - 1);
+    bitarray_rotate(neighbour->bitarray, neighbour->bit_offset,
+                    neighbour->bit_length, amount);
+    bitarray_rotate(neighbour->bitarray, neighbour->bit_offset,
+                    neighbour->bit_length, -amount);
+  }
+  return NULL;
+}
+
+static void fuzz_count_done(void* const context) {
+  (*(size_t*) context)++;
+}
+
+static fuzz_case_t fuzz_draw_case(uint64_t* const state,
+                                  const size_t bit_sz) {
+  fuzz_case_t fuzz_case;
+  fuzz_case.bit_offset = fuzz_next(state) % bit_sz;
+  fuzz_case.bit_length = 1 + fuzz_next(state) %
+                         (bit_sz - fuzz_case.bit_offset);
+  fuzz_case.bit_right_amount =
+    (ssize_t) (fuzz_next(state) % (4 * fuzz_case.bit_length + 1)) -
+    (ssize_t) (2 * fuzz_case.bit_length);
+  // A quarter of the subarrays of a few words or more are cut to a
+  // multiple of a factor of at least a word, and rotated by a multiple of
+  // it, so that the cycle leader walks blocks of cycles rather than handing
+  // the rotation to the reversal.
+  if (fuzz_case.bit_length >= 128 && fuzz_next(state) % 4 == 0) {
+    const size_t factor = 64 + fuzz_next(state) %
+                               (fuzz_case.bit_length / 2 - 63);
+    const size_t multiple = fuzz_case.bit_length / factor;
+    fuzz_case.bit_length = factor * multiple;
+    fuzz_case.bit_right_amount =
+      (ssize_t) (factor * (fuzz_next(state) % (4 * multiple + 1))) -
+      (ssize_t) (2 * fuzz_case.bit_length);
+  }
+
+  // Fields of up to a few words, some of them packed at a stride that
+  // divides the word, and as many of them as fit half of the time.
+  const size_t max_field = bit_sz < 256 ? bit_sz : 256;
+  const size_t field_len = 1 + fuzz_next(state) % max_field;
+  size_t stride = field_len + fuzz_next(state) % (field_len + 64);
+  if (field_len <= 64 && fuzz_next(state) % 2 == 0) {
+    stride = 1;
+    while (stride < field_len) {
+      stride *= 2;
+    }
+  }
+  fuzz_case.field_len = field_len;
+  fuzz_case.stride = stride;
+  fuzz_case.first_offset = fuzz_next(state) % (bit_sz - field_len + 1);
+  const size_t room =
+    (bit_sz - fuzz_case.first_offset - field_len) / stride + 1;
+  fuzz_case.field_count = fuzz_next(state) % 2 == 0 ?
+                          room : 1 + fuzz_next(state) % room;
+  fuzz_case.field_right_amount =
+    (ssize_t) (fuzz_next(state) % (4 * field_len + 1)) -
+    (ssize_t) (2 * field_len);
+  return fuzz_case;
+}
+
+static uint64_t fuzz_rotate(test_context_t* const context,
+                            const size_t v,
+                            const fuzz_case_t* const fuzz_case) {
+  const size_t bit_offset = fuzz_case->bit_offset;
+  const size_t bit_length = fuzz_case->bit_length;
+  const ssize_t bit_right_amount = fuzz_case->bit_right_amount;
+  static const bitarray_rotate_strategy_t strategies[] = {
+    BITARRAY_ROTATE_AUTO, BITARRAY_ROTATE_REVERSAL,
+    BITARRAY_ROTATE_CYCLE_LEADER, BITARRAY_ROTATE_SHIFT_COPY,
+  };
+  bitarray_t* const bitarray = context->bitarray;
+  uint64_t nsec = 0;
+  if (v < sizeof(strategies) / sizeof(strategies[0])) {
+    KTIMING_REGION(nsec) {
+      bitarray_rotate_with_strategy(bitarray, bit_offset, bit_length,
+                                    bit_right_amount, strategies[v]);
+    }
+  } else if (strcmp(fuzz_variant_names[v], "parallel") == 0) {
+    KTIMING_REGION(nsec) {
+      bitarray_rotate_parallel(bitarray, bit_offset, bit_length,
+                               bit_right_amount, FUZZ_THREADS);
+    }
+  } else if (strcmp(fuzz_variant_names[v], "segmented") == 0) {
+    // The splice is timed; putting the bits back in order is checked too.
+    bitarray_set_segmented(bitarray, true);
+    KTIMING_REGION(nsec) {
+      bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    }
+    bitarray_set_segmented(bitarray, false);
+  } else if (strcmp(fuzz_variant_names[v], "concurrent") == 0) {
+    // The neighbours share the words at the ends of the subarray with it.
+    const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+    const size_t end = bit_offset + bit_length;
+    fuzz_neighbour_t neighbours[2] = {
+      {bitarray, bit_offset < FUZZ_NEIGHBOUR_BITS ?
+                 0 : bit_offset - FUZZ_NEIGHBOUR_BITS,
+       bit_offset < FUZZ_NEIGHBOUR_BITS ? bit_offset : FUZZ_NEIGHBOUR_BITS},
+      {bitarray, end, bit_sz - end < FUZZ_NEIGHBOUR_BITS ?
+                      bit_sz - end : FUZZ_NEIGHBOUR_BITS},
+    };
+    bitarray_set_concurrent(bitarray, true);
+    pthread_t threads[2];
+    bool started[2];
+    for (size_t n = 0; n < 2; n++) {
+      started[n] = pthread_create(&threads[n], NULL, fuzz_neighbour_worker,
+                                  &neighbours[n]) == 0;
+    }
+    KTIMING_REGION(nsec) {
+      bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    }
+    for (size_t n = 0; n < 2; n++) {
+      if (started[n]) {
+        pthread_join(threads[n], NULL);
+      }
+    }
+    bitarray_set_concurrent(bitarray, false);
+  } else if (strcmp(fuzz_variant_names[v], "async") == 0) {
+    // Submitting and waiting are both timed.  The worker should fold the
+    // three back into one.
+    const ssize_t first = bit_right_amount / 2;
+    const ssize_t second = bit_right_amount / 3;
+    size_t done = 0;
+    KTIMING_REGION(nsec) {
+      bitarray_rotate_async(bitarray, bit_offset, bit_length, first,
+                            fuzz_count_done, &done);
+      bitarray_rotate_async(bitarray, bit_offset, bit_length, second,
+                            fuzz_count_done, &done);
+      const bitarray_ticket_t last =
+        bitarray_rotate_async(bitarray, bit_offset, bit_length,
+                              bit_right_amount - first - second,
+                              fuzz_count_done, &done);
+      bitarray_async_wait(bitarray, last);
+    }
+    bitarray_async_drain(bitarray);
+    assert(done == 3);
+  } else if (v >= FUZZ_FIRST_STRIDED) {
+    const size_t thread_count = strcmp(fuzz_variant_names[v], "strided") == 0 ?
+                                1 : FUZZ_THREADS;
+    KTIMING_REGION(nsec) {
+      bitarray_rotate_strided_parallel(bitarray, fuzz_case->first_offset,
+                                       fuzz_case->field_len,
+                                       fuzz_case->stride,
+                                       fuzz_case->field_count,
+                                       fuzz_case->field_right_amount,
+                                       thread_count);
+    }
+  } else {
+    // The rotation only lands when the view is materialized, so that is
+    // part of what is timed.
+    bitarray_set_lazy(bitarray, true);
+    KTIMING_REGION(nsec) {
+      bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+      bitarray_materialize(bitarray);
+    }
+    bitarray_set_lazy(bitarray, false);
+  }
+  return nsec;
+}
+
+bool check_operations(const size_t case_count, const unsigned int seed) {
+  char path[] = "/tmp/everybit-check-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    perror("mkstemp");
+    return false;
+  }
+  close(fd);
+
+  uint64_t mismatches[CHECK_FORM_COUNT][CHECK_KIND_COUNT] = {{0}};
+  size_t reports = 0;
+  for (size_t c = 0; c < case_count; c++) {
+    // Each case has a state of its own, so that -O 1,seed with the seed a
+    // mismatch reports runs the same checks again (on a small array).
+    uint64_t state = seed + c;
+    const unsigned max_log = c % CHECK_LARGE_EVERY == CHECK_LARGE_EVERY - 1 ?
+                             CHECK_LARGE_LOG : CHECK_SMALL_LOG;
+    const size_t bit_sz = 1 + fuzz_next(&state) %
+                          ((size_t) 1 << (fuzz_next(&state) % max_log + 1));
+    const size_t words = (bit_sz + 63) / 64;
+    uint64_t* const model = malloc(words * sizeof(uint64_t));
+    assert(model != NULL);
+    for (size_t f = 0; f < CHECK_FORM_COUNT; f++) {
+      for (size_t k = 0; k < CHECK_KIND_COUNT; k++) {
+        bitarray_t* const bitarray = check_new(bit_sz, f, model, &state);
+        const bool ok = check_kinds[k].run(bitarray, model, &state, path) &&
+                        check_matches(bitarray, model);
+        bitarray_free(bitarray);
+        if (!ok) {
+          mismatches[f][k]++;
+          if (reports++ < FUZZ_MAX_REPORTS) {
+            fprintf(stderr, "MISMATCH form=%s check=%s seed=%u size=%zu\n",
+                    check_form_names[f], check_kinds[k].name,
+                    (unsigned int) (seed + c), bit_sz);
+          }
+        }
+      }
+    }
+    free(model);
+  }
+
+  size_t accepted = 0;
+  for (size_t m = 0; m < CHECK_MALFORMED_COUNT; m++) {
+    if (!check_rejects(&check_malformed_files[m], path)) {
+      accepted++;
+      fprintf(stderr, "ACCEPTED malformed=%s\n",
+              check_malformed_files[m].name);
+    }
+  }
+  unlink(path);
+
+  printf("%zu cases, seed %u\n", case_count, seed);
+  printf("%-10s %-10s %10s\n", "form", "check", "mismatches");
+  bool ok = accepted == 0;
+  for (size_t f = 0; f < CHECK_FORM_COUNT; f++) {
+    for (size_t k = 0; k < CHECK_KIND_COUNT; k++) {
+      printf("%-10s %-10s %10" PRIu64 "\n", check_form_names[f],
+             check_kinds[k].name, mismatches[f][k]);
+      ok = ok && mismatches[f][k] == 0;
+    }
+  }
+  printf("%zu of %zu malformed files accepted\n", accepted,
+         (size_t) CHECK_MALFORMED_COUNT);
+  return ok;
+}
+
+static bool check_matches(const bitarray_t* const bitarray,
+                          const uint64_t* const model) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  const size_t words = (bit_sz + 63) / 64;
+  uint64_t* const actual = malloc(words * sizeof(uint64_t));
+  assert(actual != NULL);
+  bitarray_get_range(bitarray, 0, bit_sz, actual);
+  const bool ok = memcmp(actual, model, words * sizeof(uint64_t)) == 0;
+  free(actual);
+  return ok;
+}
+
+static bool check_model_get(const uint64_t* const model, const size_t i) {
+  return (model[i / 64] >> (i % 64)) & 1;
+}
+
+static void check_model_set(uint64_t* const model,
+                            const size_t i,
+                            const bool value) {
+  model[i / 64] = (model[i / 64] & ~(UINT64_C(1) << (i % 64))) |
+                  (uint64_t) value << (i % 64);
+}
+
+static bitarray_t* check_new(const size_t bit_sz,
+                             const size_t f,
+                             uint64_t* const model,
+                             uint64_t* const state) {
+  const size_t words = (bit_sz + 63) / 64;
+  for (size_t w = 0; w < words; w++) {
+    model[w] = fuzz_next(state);
+  }
+  // The model keeps the unused high bits of its last word clear, as
+  // bitarray_get_range does.
+  if (bit_sz % 64 != 0) {
+    model[words - 1] &= (UINT64_C(1) << (bit_sz % 64)) - 1;
+  }
+  bitarray_t* const bitarray = bitarray_new(bit_sz);
+  assert(bitarray != NULL);
+  bitarray_set_range(bitarray, 0, bit_sz, model);
+
+  const char* const form = check_form_names[f];
+  const size_t rotations = strcmp(form, "lazy") == 0 ? 1 :
+                           strcmp(form, "segmented") == 0 ? 3 : 0;
+  bitarray_set_lazy(bitarray, strcmp(form, "lazy") == 0);
+  bitarray_set_segmented(bitarray, strcmp(form, "segmented") == 0);
+  for (size_t r = 0; r < rotations; r++) {
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t bit_right_amount;
+    check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                        &bit_right_amount);
+    bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+    check_rotate_model(model, bit_sz, bit_offset, bit_length,
+                       bit_right_amount);
+  }
+  return bitarray;
+}
+
+static void check_draw_rotation(uint64_t* const state,
+                                const size_t bit_sz,
+                                size_t* const bit_offset,
+                                size_t* const bit_length,
+                                ssize_t* const bit_right_amount) {
+  *bit_offset = fuzz_next(state) % bit_sz;
+  *bit_length = 1 + fuzz_next(state) % (bit_sz - *bit_offset);
+  *bit_right_amount = (ssize_t) (fuzz_next(state) % (4 * *bit_length + 1)) -
+                      (ssize_t) (2 * *bit_length);
+}
+
+static void check_rotate_model(uint64_t* const model,
+                               const size_t bit_sz,
+                               const size_t bit_offset,
+                               const size_t bit_length,
+                               const ssize_t bit_right_amount) {
+  const size_t words = (bit_sz + 63) / 64;
+  uint64_t* const src = malloc(words * sizeof(uint64_t));
+  assert(src != NULL);
+  memcpy(src, model, words * sizeof(uint64_t));
+  reference_rotate(model, src, bit_offset, bit_length, bit_right_amount);
+  free(src);
+}
+
+static bool check_range(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+  check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                      &bit_right_amount);
+  const size_t words = (bit_length + 63) / 64;
+  uint64_t* const range = malloc(words * sizeof(uint64_t));
+  assert(range != NULL);
+  // The bits come out at the bottom of the words, with the rest of the
+  // last word cleared.
+  memset(range, 0xff, words * sizeof(uint64_t));
+  bitarray_get_range(bitarray, bit_offset, bit_length, range);
+  bool ok = bit_length % 64 == 0 ||
+            range[words - 1] >> (bit_length % 64) == 0;
+  for (size_t i = 0; i < bit_length; i++) {
+    ok = ok && check_model_get(range, i) ==
+               check_model_get(model, bit_offset + i);
+  }
+
+  // Random words go back in somewhere else; the high bits of the last one
+  // must be ignored.
+  for (size_t w = 0; w < words; w++) {
+    range[w] = fuzz_next(state);
+  }
+  const size_t dst_offset = fuzz_next(state) % (bit_sz - bit_length + 1);
+  bitarray_set_range(bitarray, dst_offset, bit_length, range);
+  for (size_t i = 0; i < bit_length; i++) {
+    check_model_set(model, dst_offset + i, check_model_get(range, i));
+  }
+  free(range);
+  return ok;
+}
+
+static bool check_fill(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+  check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                      &bit_right_amount);
+  const bool value = fuzz_next(state) % 2;
+  bitarray_fill(bitarray, bit_offset, bit_length, value);
+  for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+    check_model_set(model, i, value);
+  }
+  return true;
+}
+
+static bool check_copy(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path) {
+  // From another array, of any size and form.
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  const size_t src_sz = 1 + fuzz_next(state) % (2 * bit_sz);
+  uint64_t* const src_model = malloc((src_sz + 63) / 64 * sizeof(uint64_t));
+  assert(src_model != NULL);
+  bitarray_t* const src = check_new(src_sz,
+                                    fuzz_next(state) % CHECK_FORM_COUNT,
+                                    src_model, state);
+  size_t bit_length = 1 + fuzz_next(state) %
+                      (src_sz < bit_sz ? src_sz : bit_sz);
+  size_t src_offset = fuzz_next(state) % (src_sz - bit_length + 1);
+  size_t dst_offset = fuzz_next(state) % (bit_sz - bit_length + 1);
+  bitarray_copy(bitarray, dst_offset, src, src_offset, bit_length);
+  for (size_t i = 0; i < bit_length; i++) {
+    check_model_set(model, dst_offset + i,
+                    check_model_get(src_model, src_offset + i));
+  }
+  const bool ok = check_matches(src, src_model);
+  bitarray_free(src);
+  free(src_model);
+
+  // Within the array, between ranges that may overlap.
+  const size_t words = (bit_sz + 63) / 64;
+  uint64_t* const before = malloc(words * sizeof(uint64_t));
+  assert(before != NULL);
+  memcpy(before, model, words * sizeof(uint64_t));
+  bit_length = 1 + fuzz_next(state) % bit_sz;
+  src_offset = fuzz_next(state) % (bit_sz - bit_length + 1);
+  dst_offset = fuzz_next(state) % (bit_sz - bit_length + 1);
+  bitarray_copy(bitarray, dst_offset, bitarray, src_offset, bit_length);
+  for (size_t i = 0; i < bit_length; i++) {
+    check_model_set(model, dst_offset + i,
+                    check_model_get(before, src_offset + i));
+  }
+  free(before);
+  return ok;
+}
+
+static bool check_count(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  bool ok = true;
+  for (size_t q = 0; q < CHECK_QUERIES; q++) {
+    // Empty ranges, and ones at the very end, count too.
+    const size_t bit_offset = fuzz_next(state) % (bit_sz + 1);
+    const size_t bit_length = fuzz_next(state) % (bit_sz - bit_offset + 1);
+    size_t expected = 0;
+    for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+      expected += check_model_get(model, i);
+    }
+    ok = ok && bitarray_count(bitarray, bit_offset, bit_length) == expected;
+  }
+  return ok;
+}
+
+static bool check_find(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  bool ok = true;
+  for (size_t q = 0; q < CHECK_QUERIES; q++) {
+    // A run without the bits searched for, long enough to cross words now
+    // and then, and a search from somewhere in it.
+    const bool value = fuzz_next(state) % 2;
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t bit_right_amount;
+    check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                        &bit_right_amount);
+    bitarray_fill(bitarray, bit_offset, bit_length, !value);
+    for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+      check_model_set(model, i, !value);
+    }
+    const size_t bit_index = q == 0 ? bit_sz :
+                             bit_offset + fuzz_next(state) % (bit_length + 1);
+    size_t expected = bit_index;
+    while (expected < bit_sz && check_model_get(model, expected) != value) {
+      expected++;
+    }
+    ok = ok && bitarray_find_next(bitarray, bit_index, value) == expected;
+  }
+  return ok;
+}
+
+static bool check_snapshot(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  const size_t words = (bit_sz + 63) / 64;
+  uint64_t* const snapshot_model = malloc(words * sizeof(uint64_t));
+  assert(snapshot_model != NULL);
+  memcpy(snapshot_model, model, words * sizeof(uint64_t));
+  const bitarray_t* const snapshot = bitarray_snapshot(bitarray);
+  if (snapshot == NULL) {
+    free(snapshot_model);
+    return false;
+  }
+
+  // The original is written to in every way it can be, none of which the
+  // snapshot may see.
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+  check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                      &bit_right_amount);
+  const bool value = fuzz_next(state) % 2;
+  bitarray_fill(bitarray, bit_offset, bit_length, value);
+  for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+    check_model_set(model, i, value);
+  }
+  check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                      &bit_right_amount);
+  bitarray_rotate(bitarray, bit_offset, bit_length, bit_right_amount);
+  check_rotate_model(model, bit_sz, bit_offset, bit_length,
+                     bit_right_amount);
+  const size_t bit_index = fuzz_next(state) % bit_sz;
+  bitarray_set(bitarray, bit_index, !check_model_get(model, bit_index));
+  check_model_set(model, bit_index, !check_model_get(model, bit_index));
+
+  size_t count = 0;
+  size_t first_set = bit_sz;
+  for (size_t i = bit_sz; i-- > 0;) {
+    if (check_model_get(snapshot_model, i)) {
+      count++;
+      first_set = i;
+    }
+  }
+  bool ok = check_matches(snapshot, snapshot_model) &&
+            bitarray_get(snapshot, bit_index) ==
+            check_model_get(snapshot_model, bit_index) &&
+            bitarray_count(snapshot, 0, bit_sz) == count &&
+            bitarray_find_next(snapshot, 0, true) == first_set;
+
+  // A snapshot is the source of a copy, and outlives the array it was
+  // taken of.
+  bitarray_t* const copy = bitarray_new(bit_sz);
+  assert(copy != NULL);
+  bitarray_copy(copy, 0, snapshot, 0, bit_sz);
+  const bitarray_t* const second = bitarray_snapshot(copy);
+  bitarray_fill(copy, 0, bit_sz, !value);
+  bitarray_free(copy);
+  ok = ok && second != NULL && check_matches(second, snapshot_model);
+  if (second != NULL) {
+    bitarray_snapshot_free(second);
+  }
+  bitarray_snapshot_free(snapshot);
+  free(snapshot_model);
+  return ok;
+}
+
+static bool check_mmap(bitarray_t* const bitarray,
+                       uint64_t* const model,
+                       uint64_t* const state,
+                       const char* const path) {
+  // A new file, filled from the array and rotated in place.
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  const size_t words = (bit_sz + 63) / 64;
+  unlink(path);
+  bitarray_t* mapped = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_CREATE);
+  if (mapped == NULL) {
+    return false;
+  }
+  uint64_t* const file_model = malloc(words * sizeof(uint64_t));
+  assert(file_model != NULL);
+  memcpy(file_model, model, words * sizeof(uint64_t));
+  bitarray_copy(mapped, 0, bitarray, 0, bit_sz);
+  size_t bit_offset;
+  size_t bit_length;
+  ssize_t bit_right_amount;
+  check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                      &bit_right_amount);
+  bitarray_rotate(mapped, bit_offset, bit_length, bit_right_amount);
+  check_rotate_model(file_model, bit_sz, bit_offset, bit_length,
+                     bit_right_amount);
+  bool ok = bitarray_sync(mapped) && check_matches(mapped, file_model);
+  bitarray_free(mapped);
+
+  // The file holds the bits as bytes of little-endian words.
+  const size_t file_bytes = (bit_sz + 7) / 8;
+  char* const bytes = malloc(file_bytes + 1);
+  assert(bytes != NULL);
+  const int fd = open(path, O_RDONLY);
+  ok = ok && fd >= 0 &&
+       pread(fd, bytes, file_bytes + 1, 0) == (ssize_t) file_bytes &&
+       memcmp(bytes, file_model, file_bytes) == 0;
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(bytes);
+
+  // A private mapping starts out with the bits, and keeps its changes to
+  // itself.
+  mapped = bitarray_open_mmap(path, bit_sz, BITARRAY_MMAP_PRIVATE);
+  ok = ok && mapped != NULL && check_matches(mapped, file_model);
+  if (mapped != NULL) {
+    bitarray_fill(mapped, 0, bit_sz, fuzz_next(state) % 2);
+    ok = ok && bitarray_sync(mapped);
+    bitarray_free(mapped);
+  }
+  mapped = bitarray_open_mmap(path, bit_sz, 0);
+  ok = ok && mapped != NULL && check_matches(mapped, file_model);
+  if (mapped != NULL) {
+    bitarray_free(mapped);
+  }
+  free(file_model);
+  return ok;
+}
+
+static bool check_concurrent(bitarray_t* const bitarray,
+                             uint64_t* const model,
+                             uint64_t* const state,
+                             const char* const path) {
+  // The array is cut at random into a range for each thread, so that
+  // neighbouring ranges mostly share a word.
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  uint64_t cuts[CHECK_THREADS + 1];
+  cuts[0] = 0;
+  cuts[CHECK_THREADS] = bit_sz;
+  for (size_t t = 1; t < CHECK_THREADS; t++) {
+    cuts[t] = fuzz_next(state) % bit_sz;
+  }
+  qsort(cuts, CHECK_THREADS + 1, sizeof(cuts[0]), compare_times);
+  check_rotator_t rotators[CHECK_THREADS];
+  for (size_t t = 0; t < CHECK_THREADS; t++) {
+    rotators[t] = (check_rotator_t) {
+      bitarray, cuts[t], cuts[t + 1] - cuts[t], fuzz_next(state),
+    };
+  }
+
+  bitarray_set_concurrent(bitarray, true);
+  pthread_t threads[CHECK_THREADS];
+  bool started[CHECK_THREADS];
+  for (size_t t = 0; t < CHECK_THREADS; t++) {
+    started[t] = pthread_create(&threads[t], NULL, check_rotator_worker,
+                                &rotators[t]) == 0;
+    if (!started[t]) {
+      check_rotator_worker(&rotators[t]);
+    }
+  }
+  for (size_t t = 0; t < CHECK_THREADS; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+  bitarray_set_concurrent(bitarray, false);
+
+  // The ranges are disjoint, so the rotations can be replayed one thread
+  // after the other.
+  for (size_t t = 0; t < CHECK_THREADS; t++) {
+    uint64_t rotator_state = rotators[t].seed;
+    for (size_t r = 0; rotators[t].bit_length > 0 && r < CHECK_ROUNDS; r++) {
+      size_t bit_offset;
+      size_t bit_length;
+      ssize_t bit_right_amount;
+      check_draw_rotation(&rotator_state, rotators[t].bit_length,
+                          &bit_offset, &bit_length, &bit_right_amount);
+      check_rotate_model(model, bit_sz, rotators[t].bit_offset + bit_offset,
+                         bit_length, bit_right_amount);
+    }
+  }
+  return true;
+}
+
+static bool check_async(bitarray_t* const bitarray,
+                        uint64_t* const model,
+                        uint64_t* const state,
+                        const char* const path) {
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  size_t done = 0;
+  bitarray_ticket_t middle = 0;
+  for (size_t r = 0; r < CHECK_ASYNC_ROTATIONS; r++) {
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t bit_right_amount;
+    check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                        &bit_right_amount);
+    const bitarray_ticket_t ticket =
+      bitarray_rotate_async(bitarray, bit_offset, bit_length,
+                            bit_right_amount, fuzz_count_done, &done);
+    check_rotate_model(model, bit_sz, bit_offset, bit_length,
+                       bit_right_amount);
+    if (r == CHECK_ASYNC_ROTATIONS / 2) {
+      middle = ticket;
+    }
+  }
+  // Waiting for one rotation in the middle leaves the rest in flight.
+  bitarray_async_wait(bitarray, middle);
+  const bool ok = bitarray_async_poll(bitarray, middle);
+  bitarray_async_drain(bitarray);
+  return ok && done == CHECK_ASYNC_ROTATIONS;
+}
+
+static void* check_rotator_worker(void* const arg) {
+  const check_rotator_t* const rotator = arg;
+  uint64_t state = rotator->seed;
+  for (size_t r = 0; rotator->bit_length > 0 && r < CHECK_ROUNDS; r++) {
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t bit_right_amount;
+    check_draw_rotation(&state, rotator->bit_length, &bit_offset,
+                        &bit_length, &bit_right_amount);
+    bitarray_rotate(rotator->bitarray, rotator->bit_offset + bit_offset,
+                    bit_length, bit_right_amount);
+  }
+  return NULL;
+}
+
+static bool check_save(bitarray_t* const bitarray,
+                       const uint64_t* const model,
+                       const bitarray_codec_t codec,
+                       const char* const path) {
+  if (!bitarray_save(bitarray, path, codec)) {
+    return false;
+  }
+  bitarray_t* const loaded = bitarray_load(path);
+  bool ok = loaded != NULL && check_matches(loaded, model);
+  if (loaded != NULL) {
+    bitarray_free(loaded);
+  }
+  errno = 0;
+  bitarray_t* const mapped = bitarray_load_mmap(path, BITARRAY_MMAP_PRIVATE);
+  if (codec == BITARRAY_CODEC_RAW) {
+    ok = ok && mapped != NULL && check_matches(mapped, model);
+  } else {
+    ok = ok && mapped == NULL && errno == EINVAL;
+  }
+  if (mapped != NULL) {
+    bitarray_free(mapped);
+  }
+  return ok;
+}
+
+static bool check_save_raw(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path) {
+  return check_save(bitarray, model, BITARRAY_CODEC_RAW, path);
+}
+
+static bool check_save_rle(bitarray_t* const bitarray,
+                           uint64_t* const model,
+                           uint64_t* const state,
+                           const char* const path) {
+  // Runs the encoder can fold, in among the random words.
+  const size_t bit_sz = bitarray_get_bit_sz(bitarray);
+  for (size_t r = 0; r < 4; r++) {
+    size_t bit_offset;
+    size_t bit_length;
+    ssize_t bit_right_amount;
+    check_draw_rotation(state, bit_sz, &bit_offset, &bit_length,
+                        &bit_right_amount);
+    const bool value = fuzz_next(state) % 2;
+    bitarray_fill(bitarray, bit_offset, bit_length, value);
+    for (size_t i = bit_offset; i < bit_offset + bit_length; i++) {
+      check_model_set(model, i, value);
+    }
+  }
+  return check_save(bitarray, model, BITARRAY_CODEC_RLE, path);
+}
+
+static bool check_rejects(const check_malformed_t* const malformed,
+                          const char* const path) {
+  uint64_t state = CHECK_MALFORMED_BITS;
+  uint64_t model[(CHECK_MALFORMED_BITS + 63) / 64];
+  bitarray_t* const bitarray = check_new(CHECK_MALFORMED_BITS, 0, model,
+                                         &state);
+  const bool saved = bitarray_save(bitarray, path, malformed->codec);
+  bitarray_free(bitarray);
+  const int fd = open(path, O_RDWR);
+  if (!saved || fd < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return false;
+  }
+  uint64_t payload_offset = 0;
+  struct stat st;
+  bool ok = pread(fd, &payload_offset, sizeof(payload_offset),
+                  SAVE_AT_PAYLOAD_OFFSET) == sizeof(payload_offset) &&
+            fstat(fd, &st) == 0;
+  for (size_t p = 0; p < 2; p++) {
+    const check_patch_t* const patch = &malformed->patches[p];
+    const off_t offset = patch->offset +
+                         (patch->in_payload ? payload_offset : 0);
+    // The first value_bytes bytes of value hold it on little-endian
+    // machines.
+    ok = ok && (patch->value_bytes == 0 ||
+                pwrite(fd, &patch->value, patch->value_bytes, offset) ==
+                (ssize_t) patch->value_bytes);
+  }
+  ok = ok && ftruncate(fd, st.st_size - malformed->cut_bytes) == 0;
+  close(fd);
+
+  errno = 0;
+  bitarray_t* const loaded = bitarray_load(path);
+  ok = ok && loaded == NULL && errno == EINVAL;
+  if (loaded != NULL) {
+    bitarray_free(loaded);
+  }
+  errno = 0;
+  bitarray_t* const mapped = bitarray_load_mmap(path, BITARRAY_MMAP_PRIVATE);
+  ok = ok && mapped == NULL && errno == EINVAL;
+  if (mapped != NULL) {
+    bitarray_free(mapped);
+  }
+  return ok;
+}
+
+bool select_rotate_strategy(const char* const name) {
+  const size_t count = sizeof(strategy_names) / sizeof(strategy_names[0]);
+  for (size_t i = 0; i < count; i++) {
+    if (strategy_names[i] != NULL && strcmp(name, strategy_names[i]) == 0) {
+      test_strategy = (bitarray_rotate_strategy_t) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+void select_rotate_threads(const size_t thread_count) {
+  test_threads = thread_count;
+}
+
+void select_rotate_batching(const bool batch) {
+  test_batch = batch;
+}
+
+void select_lazy_arrays(const bool lazy) {
+  test_lazy = lazy;
+}
+
+void select_segmented_arrays(const bool segmented) {
+  test_segmented = segmented;
+}
+
+void select_async_rotations(const bool async) {
+  test_async = async;
+}
+
+void select_test_jobs(const size_t job_count) {
+  test_jobs = job_count < 1 ? 1 :
+              job_count > TEST_MAX_JOBS ? TEST_MAX_JOBS : job_count;
+}
+
+bool select_perf_counters(const bool enable) {
+  if (enable && !test_counters) {
+    test_counters = perfcount_open();
+  } else if (!enable && test_counters) {
+    perfcount_close();
+    test_counters = false;
+  }
+  return test_counters == enable;
+}
+
 static bool boolfromchar(const char c) {
   assert(c == '0' || c == '1');
   return c == '1';
 }
 
-char* next_arg_char() {
-  char* buf = strtok(NULL, " ");
+char* next_arg_char(char** const save) {
+  char* buf = strtok_r(NULL, " ", save);
   char* eol = NULL;
   if ((eol = strchr(buf, '\n')) != NULL) {
     *eol = '\0';
@@ -337,45 +2214,171 @@ void parse_and_run_tests(const char* filename, int selected_test) {
   test_verbose = false;
   fprintf(stderr, "Testing file %s.\n", filename);
   FILE* f = fopen(filename, "r");
-
-  char* buf = NULL;
-  size_t bufsize = 0;
-  int test = -1;
-  int line = 0;
-  bool ready_to_run = false;
   if (f == NULL) {
     fprintf(stderr, "Error opening file.\n");
     return;
   }
-  while (getline(&buf, &bufsize, f) != -1) {
+
+  // The blocks are independent, so they may run in any order and on any
+  // thread, as long as what they print comes out in file order.
+  test_block_t* const blocks = malloc(TEST_BATCH_BLOCKS *
+                                      sizeof(test_block_t));
+  assert(blocks != NULL);
+  test_context_t context;
+  testutil_context_init(&context, stdout, stderr);
+  test_reader_t reader = {
+    .file = f,
+    .text = NULL,
+    .text_size = 0,
+    .text_len = -1,
+    .line = 0,
+  };
+  size_t block_count;
+  while ((block_count = read_test_blocks(&reader, blocks,
+                                         TEST_BATCH_BLOCKS)) > 0) {
+    run_test_blocks(&context, blocks, block_count, filename, selected_test,
+                    run_test_block);
+    for (size_t b = 0; b < block_count; b++) {
+      free(blocks[b].text);
+    }
+  }
+  testutil_context_destroy(&context);
+  free(reader.text);
+  free(blocks);
+  fclose(f);
+
+  fprintf(stderr, "Done testing file %s.\n", filename);
+}
+
+static void run_test_blocks(test_context_t* const context,
+                            test_block_t* const blocks,
+                            const size_t block_count,
+                            const char* const filename,
+                            const int selected_test,
+                            const test_block_runner_t run) {
+  const size_t job_count = test_jobs < block_count ? test_jobs :
+                           block_count;
+  if (job_count <= 1) {
+    for (size_t b = 0; b < block_count; b++) {
+      run(context, &blocks[b], filename, selected_test);
+    }
+  } else {
+    size_t next_block = 0;
+    test_worker_t worker = {
+      .filename = filename,
+      .selected_test = selected_test,
+      .blocks = blocks,
+      .block_count = block_count,
+      .next_block = &next_block,
+      .run = run,
+    };
+    // If we cannot get another thread, the others take up its share.
+    pthread_t threads[TEST_MAX_JOBS];
+    bool started[TEST_MAX_JOBS];
+    for (size_t j = 1; j < job_count; j++) {
+      started[j] = pthread_create(&threads[j], NULL, run_test_worker,
+                                  &worker) == 0;
+    }
+    run_test_worker(&worker);
+    for (size_t j = 1; j < job_count; j++) {
+      if (started[j]) {
+        pthread_join(threads[j], NULL);
+      }
+    }
+    for (size_t b = 0; b < block_count; b++) {
+      fwrite(blocks[b].out_text, 1, blocks[b].out_len, stdout);
+      fwrite(blocks[b].err_text, 1, blocks[b].err_len, stderr);
+      free(blocks[b].out_text);
+      free(blocks[b].err_text);
+    }
+  }
+}
+
+static size_t read_test_blocks(test_reader_t* const reader,
+                               test_block_t* const blocks,
+                               const size_t max_blocks) {
+  size_t count = 0;
+  test_block_t* block = NULL;
+  size_t capacity = 0;
+  for (;;) {
+    if (reader->text_len < 0) {
+      reader->text_len = getline(&reader->text, &reader->text_size,
+                                 reader->file);
+      if (reader->text_len < 0) {
+        break;
+      }
+    }
+    // A line that starts a block we have no room for stays for next time.
+    const size_t len = reader->text_len;
+    if (reader->text[0] == 't' || block == NULL) {
+      if (count == max_blocks) {
+        break;
+      }
+      block = &blocks[count++];
+      block->text = NULL;
+      block->text_len = 0;
+      block->first_line = reader->line + 1;
+      capacity = 0;
+    }
+    if (block->text_len + len + 1 > capacity) {
+      capacity = 2 * (block->text_len + len + 1);
+      block->text = realloc(block->text, capacity);
+      assert(block->text != NULL);
+    }
+    memcpy(block->text + block->text_len, reader->text, len + 1);
+    block->text_len += len + 1;
+    reader->line++;
+    reader->text_len = -1;
+  }
+  return count;
+}
+
+static void run_test_block(test_context_t* const context,
+                           const test_block_t* const block,
+                           const char* const filename,
+                           const int selected_test) {
+  int test = -1;
+  int line = block->first_line - 1;
+  bool ready_to_run = false;
+  char* next = block->text;
+  while (next < block->text + block->text_len) {
+    // Splitting the line into tokens cuts it short, so find the next one
+    // first.
+    char* const buf = next;
+    next += strlen(next) + 1;
     line++;
-    char* token = strtok(buf, " ");
+    char* save = NULL;
+    char* token = strtok_r(buf, " ", &save);
+    // Queued rotations must land before anything else looks at the array.
+    if (token[0] != 'r') {
+      testutil_flush_rotations(context);
+    }
     switch (token[0]) {
     case '\n':
     case '#':
       continue;
     case 't':
-      test = (int) NEXT_ARG_LONG();
+      test = (int) NEXT_ARG_LONG(&save);
       ready_to_run = (test == selected_test || selected_test == -1);
       if (!ready_to_run) {
         continue;
       }
 
-      fprintf(stderr, "\nRunning test #%d...\n", test);
+      fprintf(context->err, "\nRunning test #%d...\n", test);
       break;
     case 'n':
       if (!ready_to_run) {
         continue;
       }
-      testutil_frmstr(next_arg_char());
+      testutil_frmstr(context, next_arg_char(&save));
       break;
     case 'e':
       if (!ready_to_run) {
         continue;
       }
       {
-        char* expected = next_arg_char();
-        testutil_expect_internal(expected, filename, line);
+        char* expected = next_arg_char(&save);
+        testutil_expect_internal(context, expected, filename, line);
       }
       break;
     case 'r':
@@ -383,22 +2386,354 @@ void parse_and_run_tests(const char* filename, int selected_test) {
         continue;
       }
       {
-        size_t offset = (size_t) NEXT_ARG_LONG();
-        size_t length = (size_t) NEXT_ARG_LONG();
-        ssize_t amount = (ssize_t) NEXT_ARG_LONG();
-        testutil_require_valid_input(offset, length, amount, filename, line);
-        testutil_rotate(offset, length, amount);
+        size_t offset = (size_t) NEXT_ARG_LONG(&save);
+        size_t length = (size_t) NEXT_ARG_LONG(&save);
+        ssize_t amount = (ssize_t) NEXT_ARG_LONG(&save);
+        testutil_require_valid_input(context, offset, length, amount,
+                                     filename, line);
+        if (test_batch || test_async) {
+          testutil_queue_rotate(context, offset, length, amount);
+        } else {
+          testutil_rotate(context, offset, length, amount);
+        }
       }
       break;
     default:
-      fprintf(stderr, "Unknown command %s", buf);
+      fprintf(context->err, "Unknown command %s", buf);
+    }
+  }
+  testutil_flush_rotations(context);
+}
+
+static void* run_test_worker(void* const arg) {
+  const test_worker_t* const worker = arg;
+  test_context_t context;
+  testutil_context_init(&context, NULL, NULL);
+  for (;;) {
+    const size_t b = __atomic_fetch_add(worker->next_block, 1,
+                                        __ATOMIC_RELAXED);
+    if (b >= worker->block_count) {
+      break;
+    }
+    test_block_t* const block = &worker->blocks[b];
+    context.out = open_memstream(&block->out_text, &block->out_len);
+    context.err = open_memstream(&block->err_text, &block->err_len);
+    assert(context.out != NULL && context.err != NULL);
+    worker->run(&context, block, worker->filename, worker->selected_test);
+    fclose(context.out);
+    fclose(context.err);
+  }
+  testutil_context_destroy(&context);
+  return NULL;
+}
+
+bool convert_test_file(const char* const text_filename,
+                       const char* const binary_filename) {
+  FILE* const in = fopen(text_filename, "r");
+  if (in == NULL) {
+    fprintf(stderr, "Error opening file %s.\n", text_filename);
+    return false;
+  }
+  FILE* const out = fopen(binary_filename, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "Error opening file %s.\n", binary_filename);
+    fclose(in);
+    return false;
+  }
+
+  binary_header_t header = {
+    .version = BINARY_VERSION,
+    .byte_order = BINARY_BYTE_ORDER,
+  };
+  memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+
+  char* buf = NULL;
+  size_t bufsize = 0;
+  int line = 0;
+  while (ok && getline(&buf, &bufsize, in) != -1) {
+    line++;
+    char* save = NULL;
+    char* token = strtok_r(buf, " ", &save);
+    if (token == NULL || token[0] == '\n' || token[0] == '#') {
+      continue;
+    }
+    const binary_record_t record = {.kind = token[0], .line = line};
+    switch (token[0]) {
+    case 't':
+      {
+        const int64_t test = NEXT_ARG_LONG(&save);
+        ok = fwrite(&record, sizeof(record), 1, out) == 1 &&
+             fwrite(&test, sizeof(test), 1, out) == 1;
+      }
+      break;
+    case 'n':
+    case 'e':
+      ok = fwrite(&record, sizeof(record), 1, out) == 1 &&
+           write_binary_bits(out, next_arg_char(&save));
+      break;
+    case 'r':
+      {
+        int64_t rotation[3];
+        for (int i = 0; i < 3; i++) {
+          rotation[i] = NEXT_ARG_LONG(&save);
+        }
+        ok = fwrite(&record, sizeof(record), 1, out) == 1 &&
+             fwrite(rotation, sizeof(rotation), 1, out) == 1;
+      }
+      break;
+    default:
+      fprintf(stderr, "Unknown command %s at line %d.\n", token, line);
+      ok = false;
     }
   }
   free(buf);
+  fclose(in);
+  ok = fclose(out) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Could not convert %s to %s.\n", text_filename,
+            binary_filename);
+  }
+  return ok;
+}
+
+static bool write_binary_bits(FILE* const f, const char* const bitstring) {
+  const uint64_t bit_sz = strlen(bitstring);
+  const size_t word_count = (bit_sz + 63) / 64;
+  uint64_t* const words = calloc(word_count + 1, sizeof(uint64_t));
+  assert(words != NULL);
+  bool ok = true;
+  for (size_t i = 0; i < bit_sz; i++) {
+    if (bitstring[i] != '0' && bitstring[i] != '1') {
+      ok = false;
+    }
+    words[i / 64] |= (uint64_t) (bitstring[i] == '1') << (i % 64);
+  }
+  ok = ok && fwrite(&bit_sz, sizeof(bit_sz), 1, f) == 1 &&
+       fwrite(words, sizeof(uint64_t), word_count, f) == word_count;
+  free(words);
+  return ok;
+}
+
+void parse_and_run_binary_tests(const char* filename, int selected_test) {
+  test_verbose = false;
+  fprintf(stderr, "Testing file %s.\n", filename);
+  const int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "Error opening file.\n");
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  const size_t file_bytes = st.st_size;
+  char* const file = file_bytes > 0 ?
+                     mmap(NULL, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0) :
+                     MAP_FAILED;
+  close(fd);
+  const binary_header_t* const header = (const binary_header_t*) file;
+  if (file == MAP_FAILED || file_bytes < sizeof(binary_header_t) ||
+      memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != BINARY_VERSION ||
+      header->byte_order != BINARY_BYTE_ORDER) {
+    fprintf(stderr, "Not a binary test file for this machine.\n");
+    if (file != MAP_FAILED) {
+      munmap(file, file_bytes);
+    }
+    return;
+  }
+
+  // Cut the records into blocks at each 't', just as the text runner cuts
+  // lines; the blocks point straight into the mapping.
+  test_block_t* const blocks = malloc(TEST_BATCH_BLOCKS *
+                                      sizeof(test_block_t));
+  assert(blocks != NULL);
+  test_context_t context;
+  testutil_context_init(&context, stdout, stderr);
+  const char* const end = file + file_bytes;
+  char* record = file + sizeof(binary_header_t);
+  while (record < end) {
+    size_t block_count = 0;
+    while (record < end) {
+      const size_t record_bytes = binary_record_size(record, end);
+      if (record_bytes == 0) {
+        break;
+      }
+      const binary_record_t* const kind = (const binary_record_t*) record;
+      if (kind->kind == 't' || block_count == 0) {
+        if (block_count == TEST_BATCH_BLOCKS) {
+          break;
+        }
+        blocks[block_count].text = record;
+        blocks[block_count].text_len = 0;
+        blocks[block_count].first_line = kind->line;
+        block_count++;
+      }
+      blocks[block_count - 1].text_len += record_bytes;
+      record += record_bytes;
+    }
+    run_test_blocks(&context, blocks, block_count, filename, selected_test,
+                    run_binary_block);
+    if (record < end && binary_record_size(record, end) == 0) {
+      fprintf(stderr, "Malformed record at byte %zu.\n",
+              (size_t) (record - file));
+      break;
+    }
+  }
+  testutil_context_destroy(&context);
+  free(blocks);
+  munmap(file, file_bytes);
 
   fprintf(stderr, "Done testing file %s.\n", filename);
 }
 
+static size_t binary_record_size(const char* const record,
+                                 const char* const end) {
+  const size_t left = end - record;
+  if (left < sizeof(binary_record_t)) {
+    return 0;
+  }
+  const binary_record_t* const header = (const binary_record_t*) record;
+  size_t size = sizeof(binary_record_t);
+  switch (header->kind) {
+  case 't':
+    size += sizeof(int64_t);
+    break;
+  case 'n':
+  case 'e':
+    if (left < size + sizeof(uint64_t)) {
+      return 0;
+    }
+    {
+      const uint64_t bit_sz = *(const uint64_t*) (record + size);
+      if (bit_sz / 64 >= left / sizeof(uint64_t)) {
+        return 0;
+      }
+      size += sizeof(uint64_t) * (1 + (bit_sz + 63) / 64);
+    }
+    break;
+  case 'r':
+    size += 3 * sizeof(int64_t);
+    break;
+  default:
+    return 0;
+  }
+  return size <= left ? size : 0;
+}
+
+static void run_binary_block(test_context_t* const context,
+                             const test_block_t* const block,
+                             const char* const filename,
+                             const int selected_test) {
+  int test = -1;
+  bool ready_to_run = false;
+  const char* record = block->text;
+  const char* const end = block->text + block->text_len;
+  while (record < end) {
+    const binary_record_t* const header = (const binary_record_t*) record;
+    const int64_t* const args =
+      (const int64_t*) (record + sizeof(binary_record_t));
+    record += binary_record_size(record, end);
+    // Queued rotations must land before anything else looks at the array.
+    if (header->kind != 'r') {
+      testutil_flush_rotations(context);
+    }
+    if (header->kind != 't' && !ready_to_run) {
+      continue;
+    }
+    switch (header->kind) {
+    case 't':
+      test = (int) args[0];
+      ready_to_run = (test == selected_test || selected_test == -1);
+      if (ready_to_run) {
+        fprintf(context->err, "\nRunning test #%d...\n", test);
+      }
+      break;
+    case 'n':
+      testutil_frmwords(context, args[0], (const uint64_t*) &args[1]);
+      break;
+    case 'e':
+      testutil_expect_words(context, args[0], (const uint64_t*) &args[1],
+                            filename, header->line);
+      break;
+    case 'r':
+      testutil_require_valid_input(context, args[0], args[1], args[2],
+                                   filename, header->line);
+      if (test_batch || test_async) {
+        testutil_queue_rotate(context, args[0], args[1], args[2]);
+      } else {
+        testutil_rotate(context, args[0], args[1], args[2]);
+      }
+      break;
+    }
+  }
+  testutil_flush_rotations(context);
+}
+
+static void testutil_frmwords(test_context_t* const context,
+                              const size_t bit_sz,
+                              const uint64_t* const words) {
+  if (context->bitarray != NULL) {
+    bitarray_free(context->bitarray);
+  }
+  context->bitarray = testutil_new(context, bit_sz);
+  assert(context->bitarray != NULL);
+  bitarray_set_lazy(context->bitarray, test_lazy);
+  bitarray_set_segmented(context->bitarray, test_segmented);
+  bitarray_set_range(context->bitarray, 0, bit_sz, words);
+  // Unlike testutil_frmstr, only print the array when asked to: these can
+  // be big.
+  if (test_verbose) {
+    bitarray_fprint(context->out, context->bitarray);
+    fprintf(context->out, " newwords sz=%zu\n", bit_sz);
+  }
+}
+
+static void testutil_expect_words(test_context_t* const context,
+                                  const size_t bit_sz,
+                                  const uint64_t* const words,
+                                  const char* const func_name,
+                                  const int line) {
+  const bitarray_t* const bitarray = context->bitarray;
+  assert(bitarray != NULL);
+
+  const char* bad = NULL;
+  const size_t actual_sz = bitarray_get_bit_sz(bitarray);
+  const size_t word_count = (actual_sz + 63) / 64;
+  uint64_t* const actual = malloc((word_count + 1) * sizeof(uint64_t));
+  assert(actual != NULL);
+  bitarray_get_range(bitarray, 0, actual_sz, actual);
+  if (actual_sz != bit_sz) {
+    bad = "bitarray size";
+  } else if (memcmp(actual, words, word_count * sizeof(uint64_t)) != 0) {
+    bad = "bitarray content";
+  }
+
+  if (bad != NULL) {
+    char* const expected_bitstring = bitstring_from_words(words, bit_sz);
+    char* const actual_bitstring = bitstring_from_words(actual, actual_sz);
+    TEST_FAIL_WITH_NAME(context, func_name, line, " Incorrect %s.\n    Expected: %s\n    Actual:   %s",
+                        bad, expected_bitstring, actual_bitstring);
+    free(expected_bitstring);
+    free(actual_bitstring);
+  } else {
+    TEST_PASS_WITH_NAME(context, func_name, line);
+  }
+  free(actual);
+}
+
+static char* bitstring_from_words(const uint64_t* const words,
+                                  const size_t bit_sz) {
+  char* const bitstring = malloc(bit_sz + 1);
+  assert(bitstring != NULL);
+  for (size_t i = 0; i < bit_sz; i++) {
+    bitstring[i] = (words[i / 64] >> (i % 64)) & 1 ? '1' : '0';
+  }
+  bitstring[bit_sz] = '\0';
+  return bitstring;
+}
+
 // Local Variables:
 // mode: C
 // fill-column: 100
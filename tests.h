@@ -39,8 +39,89 @@
 int timed_rotation(const double time_limit_seconds);
 
 
+// Runs a sweep of rotation benchmarks over subarray lengths, offsets and
+// amounts, and prints the median, 99th percentile and fastest time of each
+// case and the throughput at the median.  format_name is "text", "csv" or
+// "json"; returns false, without running anything, for any other name.
+// The rotations follow the strategy, thread count and laziness selected
+// for the tests.
+bool benchmark_rotations(const char* const format_name);
+
+// Rotates case_count random subarrays of random bit arrays, drawn from
+// seed, with every rotation strategy, the parallel, lazy, segmented,
+// concurrent and asynchronous rotations and every set of word kernels the
+// CPU can run, and rotates random fields of the same arrays with the
+// strided rotations, checking each result against a simple reference
+// rotation.  Prints the mismatches and the rotations per second each
+// combination reached, and returns false if any result was wrong.
+bool fuzz_rotations(const size_t case_count, const unsigned int seed);
+
+// Checks the operations other than rotation on case_count random bit
+// arrays, drawn from seed, each of them flat, lazy and segmented, against
+// a simple reference:
+//  - reading and writing ranges, filling, and copying between and within
+//    arrays;
+//  - counting bits and finding the next one set or clear;
+//  - taking a snapshot, writing to the original, and reading and copying
+//    the snapshot, also once its array is freed;
+//  - copying into a new file-backed array, rotating and syncing it, and
+//    reading it back through shared and private mappings;
+//  - saving and loading with each codec, and turning down spoiled files;
+//  - rotating disjoint ranges of a concurrent array on several threads;
+//  - submitting rotations asynchronously and waiting for them.
+// Prints the mismatches of each check, and returns false if there were any.
+bool check_operations(const size_t case_count, const unsigned int seed);
+
 // Runs the testsuite specified in a given file.
 void parse_and_run_tests(const char* filename, int min_test);
 
+// Runs the testsuite in a binary test file made by convert_test_file.  The
+// file is mapped, and the bit arrays in it are loaded and checked a word at
+// a time.
+void parse_and_run_binary_tests(const char* filename, int selected_test);
+
+// Converts the text test file text_filename into a binary test file, for
+// parse_and_run_binary_tests to run.  Returns false, after saying why on
+// stderr, if the text file cannot be read or converted.
+bool convert_test_file(const char* const text_filename,
+                       const char* const binary_filename);
+
+// Makes every later rotation in the test harness use the named rotation
+// strategy ("auto", "reversal", "cycle" or "shift") instead of letting
+// bitarray_rotate choose.  Returns false if the name is not recognized.
+bool select_rotate_strategy(const char* const name);
+
+// Makes every later rotation in the test harness use
+// bitarray_rotate_parallel with the given number of threads.  A count of 1
+// goes back to the single-threaded bitarray_rotate.
+void select_rotate_threads(const size_t thread_count);
+
+// Makes parse_and_run_tests collect each run of consecutive rotations in a
+// test file and perform it with one call to bitarray_rotate_batch.
+void select_rotate_batching(const bool batch);
+
+// Makes the test harness create lazy bit arrays (see bitarray_set_lazy).
+void select_lazy_arrays(const bool lazy);
+
+// Makes the test harness create segmented bit arrays (see
+// bitarray_set_segmented).
+void select_segmented_arrays(const bool segmented);
+
+// Makes parse_and_run_tests submit the rotations in a test file with
+// bitarray_rotate_async, and wait for them only before anything else is
+// done with the bit array.
+void select_async_rotations(const bool async);
+
+// Makes parse_and_run_tests run the test blocks of a file on the given
+// number of threads, each with a bit array of its own.  The results are
+// printed in file order all the same.
+void select_test_jobs(const size_t job_count);
+
+// Makes the performance tests (timed_rotation and benchmark_rotations)
+// read the hardware counters around each rotation and report cycles,
+// instructions, last-level cache misses, dTLB misses and branch mispredicts
+// along with the times.  Returns false if no counter can be read here.
+bool select_perf_counters(const bool enable);
+
 #endif  // TESTS_H
 